@@ -0,0 +1,69 @@
+// Copyright 2023 Haoru Xue
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#ifndef LMPC_UTILS__CODEGEN_HPP_
+#define LMPC_UTILS__CODEGEN_HPP_
+
+#include <string>
+#include <vector>
+
+#include <casadi/casadi.hpp>
+
+namespace lmpc
+{
+namespace utils
+{
+/**
+ * @brief Generate C code for a set of functions, without compiling it.
+ * The source is self-contained and can be compiled by the build system.
+ *
+ * @param functions functions to generate. They keep their names in the source.
+ * @param name name of the generated source, without extension.
+ * @param directory output directory. Created if it does not exist.
+ * @return std::string path to the generated source.
+ */
+std::string generate_functions(
+  const std::vector<casadi::Function> & functions, const std::string & name,
+  const std::string & directory);
+
+/**
+ * @brief Generate C code for a set of functions and compile it into a shared library.
+ * The source and the library are built under a temporary name, and the library is renamed
+ * into place, so that concurrent processes never compile or load a partially written file.
+ *
+ * @param functions functions to generate. They keep their names in the library.
+ * @param name name of the library, without extension.
+ * @param directory output directory. Created if it does not exist.
+ * @param compiler compiler command used to build the shared library, as whitespace separated
+ * arguments. It is run without a shell.
+ * @return std::string path to the compiled library.
+ */
+std::string compile_functions(
+  const std::vector<casadi::Function> & functions, const std::string & name,
+  const std::string & directory, const std::string & compiler = "gcc -fPIC -shared -O3");
+
+/**
+ * @brief Load functions from a compiled shared library.
+ *
+ * @param names names of the functions to load.
+ * @param library path to the shared library.
+ * @return std::vector<casadi::Function> loaded functions, in the order of names.
+ */
+std::vector<casadi::Function> load_compiled_functions(
+  const std::vector<std::string> & names,
+  const std::string & library);
+}  // namespace utils
+}  // namespace lmpc
+#endif  // LMPC_UTILS__CODEGEN_HPP_
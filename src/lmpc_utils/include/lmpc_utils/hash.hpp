@@ -0,0 +1,66 @@
+// Copyright 2023 Haoru Xue
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#ifndef LMPC_UTILS__HASH_HPP_
+#define LMPC_UTILS__HASH_HPP_
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+namespace lmpc
+{
+namespace utils
+{
+constexpr uint64_t FNV1A_64_OFFSET = 14695981039346656037ULL;
+constexpr uint64_t FNV1A_64_PRIME = 1099511628211ULL;
+
+/**
+ * @brief 64 bit FNV-1a hash of a byte buffer.
+ * Not cryptographic. Meant for cache keys and data integrity checks.
+ *
+ * @param data pointer to the buffer.
+ * @param size size of the buffer in bytes.
+ * @param hash hash to continue from, for hashing several buffers in sequence.
+ * @return uint64_t the hash.
+ */
+inline uint64_t fnv1a_64(const void * data, const size_t & size, uint64_t hash = FNV1A_64_OFFSET)
+{
+  const auto * bytes = static_cast<const unsigned char *>(data);
+  for (size_t i = 0; i < size; i++) {
+    hash ^= bytes[i];
+    hash *= FNV1A_64_PRIME;
+  }
+  return hash;
+}
+
+/**
+ * @brief Format a hash as a fixed width hexadecimal string.
+ *
+ * @param hash the hash.
+ * @return std::string 16 lower case hexadecimal digits.
+ */
+inline std::string hash_to_string(const uint64_t & hash)
+{
+  static constexpr char digits[] = "0123456789abcdef";
+  std::string out(16, '0');
+  for (size_t i = 0; i < 16; i++) {
+    out[15 - i] = digits[(hash >> (4 * i)) & 0xf];
+  }
+  return out;
+}
+}  // namespace utils
+}  // namespace lmpc
+#endif  // LMPC_UTILS__HASH_HPP_
@@ -70,6 +70,27 @@ struct FrenetPose2D
   double yaw = 0.0;
 };
 
+// batches of poses stored as structure of arrays
+struct Poses2D
+{
+  std::vector<double> x;
+  std::vector<double> y;
+  std::vector<double> yaw;
+
+  void resize(const size_t & n);
+  size_t size() const;
+};
+
+struct FrenetPoses2D
+{
+  std::vector<double> s;
+  std::vector<double> t;
+  std::vector<double> yaw;
+
+  void resize(const size_t & n);
+  size_t size() const;
+};
+
 std::ostream & operator<<(std::ostream & os, const Position2D & pos);
 std::ostream & operator<<(std::ostream & os, const Position3D & pos);
 std::ostream & operator<<(std::ostream & os, const BodyVelocity2D & vel);
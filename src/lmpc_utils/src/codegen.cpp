@@ -0,0 +1,118 @@
+// Copyright 2023 Haoru Xue
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#include <spawn.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cerrno>
+#include <filesystem>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "lmpc_utils/codegen.hpp"
+
+namespace lmpc
+{
+namespace utils
+{
+namespace
+{
+// run a command without a shell, so that paths are passed to it verbatim
+bool run_command(const std::vector<std::string> & args)
+{
+  std::vector<char *> argv;
+  for (const auto & arg : args) {
+    argv.push_back(const_cast<char *>(arg.c_str()));
+  }
+  argv.push_back(nullptr);
+  pid_t pid;
+  if (::posix_spawnp(&pid, argv[0], nullptr, nullptr, argv.data(), environ) != 0) {
+    return false;
+  }
+  int status;
+  while (::waitpid(pid, &status, 0) < 0) {
+    if (errno != EINTR) {
+      return false;
+    }
+  }
+  return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+}  // namespace
+
+std::string generate_functions(
+  const std::vector<casadi::Function> & functions, const std::string & name,
+  const std::string & directory)
+{
+  namespace fs = std::filesystem;
+  fs::create_directories(directory);
+
+  casadi::CodeGenerator gen(name + ".c", casadi::Dict{{"with_header", false}});
+  for (const auto & function : functions) {
+    gen.add(function);
+  }
+  return gen.generate((fs::path(directory) / "").string());
+}
+
+std::string compile_functions(
+  const std::vector<casadi::Function> & functions, const std::string & name,
+  const std::string & directory, const std::string & compiler)
+{
+  namespace fs = std::filesystem;
+  // the source and the library are built under a name unique to this call, so that processes
+  // and threads sharing the directory never compile or load each other's partial files
+  static std::atomic<uint64_t> build_count{0};
+  const auto tmp_name =
+    name + "_" + std::to_string(::getpid()) + "_" + std::to_string(build_count++);
+  const auto source = generate_functions(functions, tmp_name, directory);
+  const auto library = fs::path(directory) / (name + ".so");
+  const auto tmp_library = fs::path(directory) / (tmp_name + ".so");
+
+  std::vector<std::string> args;
+  std::istringstream compiler_args(compiler);
+  for (std::string arg; compiler_args >> arg; ) {
+    args.push_back(arg);
+  }
+  if (args.empty()) {
+    throw std::invalid_argument("the compiler command is empty.");
+  }
+  args.insert(args.end(), {source, "-o", tmp_library.string()});
+  const auto compiled = run_command(args);
+  fs::remove(source);
+  if (!compiled) {
+    fs::remove(tmp_library);
+    throw std::runtime_error(
+            "failed to compile generated code " + source + " with " + compiler);
+  }
+  fs::rename(tmp_library, library);
+  return library.string();
+}
+
+std::vector<casadi::Function> load_compiled_functions(
+  const std::vector<std::string> & names,
+  const std::string & library)
+{
+  std::vector<casadi::Function> functions;
+  functions.reserve(names.size());
+  for (const auto & name : names) {
+    functions.push_back(casadi::external(name, library));
+  }
+  return functions;
+}
+}  // namespace utils
+}  // namespace lmpc
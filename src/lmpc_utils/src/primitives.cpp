@@ -18,6 +18,30 @@
 
 namespace lmpc
 {
+void Poses2D::resize(const size_t & n)
+{
+  x.resize(n);
+  y.resize(n);
+  yaw.resize(n);
+}
+
+size_t Poses2D::size() const
+{
+  return x.size();
+}
+
+void FrenetPoses2D::resize(const size_t & n)
+{
+  s.resize(n);
+  t.resize(n);
+  yaw.resize(n);
+}
+
+size_t FrenetPoses2D::size() const
+{
+  return s.size();
+}
+
 std::ostream & operator<<(std::ostream & os, const Position2D & pos)
 {
   os << "Position2D(" << pos.x << ", " << pos.y << ")";
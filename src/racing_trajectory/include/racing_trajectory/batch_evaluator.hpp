@@ -0,0 +1,113 @@
+// Copyright 2023 Haoru Xue
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#ifndef RACING_TRAJECTORY__BATCH_EVALUATOR_HPP_
+#define RACING_TRAJECTORY__BATCH_EVALUATOR_HPP_
+
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include <casadi/casadi.hpp>
+
+#include "racing_trajectory/executor.hpp"
+
+namespace lmpc
+{
+namespace vehicle_model
+{
+namespace racing_trajectory
+{
+/**
+ * @brief Evaluates a casadi function on many samples, such as the nominal model on the safe set
+ * neighbors. The function is called sample by sample through preallocated workspaces, so an
+ * evaluation builds no mapped function and allocates nothing once the workspaces exist.
+ * Evaluations are thread-safe, and the samples are split among threads.
+ *
+ */
+class BatchEvaluator
+{
+public:
+  typedef std::shared_ptr<BatchEvaluator> SharedPtr;
+  typedef std::unique_ptr<BatchEvaluator> UniquePtr;
+
+  /**
+   * @brief Construct a new BatchEvaluator object.
+   *
+   * @param f the function. All its inputs and outputs must be dense.
+   * @param executor the threads evaluating the chunks of samples.
+   * @throws std::invalid_argument if an input or output is sparse.
+   */
+  explicit BatchEvaluator(
+    const casadi::Function & f,
+    Executor::SharedPtr executor = std::make_shared<Executor>());
+  ~BatchEvaluator();
+
+  /**
+   * @brief Evaluate the function on every sample.
+   *
+   * @param inputs one pointer per function input, to the samples one column after another,
+   * each of the input size. A null pointer is a zero input.
+   * @param num_samples the number of samples.
+   * @param outputs one pointer per function output, to room for num_samples columns of the
+   * output size. A null pointer skips the output.
+   * @throws std::runtime_error if the function fails on a sample.
+   */
+  void evaluate(
+    const std::vector<const double *> & inputs, const size_t & num_samples,
+    const std::vector<double *> & outputs) const;
+
+  const casadi::Function & function() const;
+
+  // number of samples evaluated by one thread at a time
+  static constexpr size_t CHUNK_SIZE = 256;
+
+private:
+  struct Workspace
+  {
+    std::vector<const double *> arg;
+    std::vector<double *> res;
+    std::vector<casadi_int> iw;
+    std::vector<double> w;
+    int mem;
+  };
+
+  casadi::Function f_;
+  Executor::SharedPtr executor_;
+  std::vector<size_t> input_sizes_;
+  std::vector<size_t> output_sizes_;
+
+  // idle workspaces, one is checked out per thread and evaluation
+  mutable std::mutex workspace_mutex_;
+  mutable std::vector<std::unique_ptr<Workspace>> workspaces_;
+
+  // returns a checked out workspace to the pool on every exit path, including exceptions
+  struct WorkspaceReturner
+  {
+    const BatchEvaluator * evaluator;
+    void operator()(Workspace * workspace) const noexcept;
+  };
+  typedef std::unique_ptr<Workspace, WorkspaceReturner> WorkspaceLease;
+
+  WorkspaceLease checkout() const;
+  // false if the function fails on a sample
+  bool evaluate_chunk(
+    const std::vector<const double *> & inputs, const size_t & begin, const size_t & end,
+    const std::vector<double *> & outputs) const;
+};
+}  // namespace racing_trajectory
+}  // namespace vehicle_model
+}  // namespace lmpc
+#endif  // RACING_TRAJECTORY__BATCH_EVALUATOR_HPP_
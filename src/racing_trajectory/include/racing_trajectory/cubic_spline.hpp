@@ -0,0 +1,107 @@
+// Copyright 2023 Haoru Xue
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#ifndef RACING_TRAJECTORY__CUBIC_SPLINE_HPP_
+#define RACING_TRAJECTORY__CUBIC_SPLINE_HPP_
+
+#include <memory>
+#include <vector>
+
+namespace lmpc
+{
+namespace vehicle_model
+{
+namespace racing_trajectory
+{
+/**
+ * @brief Native piecewise cubic interpolation of several channels sharing the same knots.
+ * The not-a-knot end condition is used, which makes it the same interpolant as the
+ * casadi "bspline" interpolant built on the same data.
+ * Coefficients are packed per segment as [channel][a, b, c, d], where on segment i
+ * a channel evaluates to a + b * u + c * u^2 + d * u^3 with u = s - knots[i].
+ *
+ */
+class CubicSpline
+{
+public:
+  typedef std::shared_ptr<CubicSpline> SharedPtr;
+  typedef std::unique_ptr<CubicSpline> UniquePtr;
+
+  /**
+   * @brief Construct a new CubicSpline object.
+   *
+   * @param knots strictly increasing knots. At least 4 are required.
+   * @param channels the values of every channel at the knots.
+   */
+  CubicSpline(
+    const std::vector<double> & knots,
+    const std::vector<std::vector<double>> & channels);
+
+  size_t num_channels() const;
+  size_t num_segments() const;
+  const std::vector<double> & knots() const;
+
+  /**
+   * @brief Find the segment containing s with a binary search.
+   * s outside of the knots is clamped to the first or last segment.
+   *
+   * @param s the query abscissa.
+   * @return size_t the segment index.
+   */
+  size_t find_segment(const double & s) const;
+
+  /**
+   * @brief Find the segment containing s by walking from a nearby segment.
+   * Runs in constant time when s moved by a few segments since the hint.
+   *
+   * @param s the query abscissa.
+   * @param hint a segment index close to s.
+   * @return size_t the segment index.
+   */
+  size_t find_segment(const double & s, const size_t & hint) const;
+
+  /**
+   * @brief Evaluate one channel and optionally its first two derivatives.
+   *
+   * @param segment the segment containing s.
+   * @param channel the channel index.
+   * @param s the query abscissa.
+   * @param d1 if not null, receives the first derivative.
+   * @param d2 if not null, receives the second derivative.
+   * @return double the interpolated value.
+   */
+  double evaluate(
+    const size_t & segment, const size_t & channel, const double & s,
+    double * d1 = nullptr, double * d2 = nullptr) const;
+
+  /**
+   * @brief Packed coefficients of a segment, 4 per channel.
+   *
+   * @param segment the segment index.
+   * @return const double* pointer to the first coefficient of the segment.
+   */
+  const double * coefficients(const size_t & segment) const;
+
+protected:
+  std::vector<double> knots_;
+  std::vector<double> coeffs_;  // [segment][channel][a, b, c, d]
+  size_t num_channels_;
+
+  void fit_channel(const size_t & channel, const std::vector<double> & values);
+};
+}  // namespace racing_trajectory
+}  // namespace vehicle_model
+}  // namespace lmpc
+#endif  // RACING_TRAJECTORY__CUBIC_SPLINE_HPP_
@@ -0,0 +1,93 @@
+// Copyright 2023 Haoru Xue
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#ifndef RACING_TRAJECTORY__EXECUTOR_HPP_
+#define RACING_TRAJECTORY__EXECUTOR_HPP_
+
+#include <functional>
+#include <memory>
+#include <vector>
+
+namespace lmpc
+{
+namespace vehicle_model
+{
+namespace racing_trajectory
+{
+enum class ExecutorType
+{
+  SERIAL,  // on the calling thread, in order, for deterministic replay
+  TBB_ARENA  // work stealing in a dedicated TBB arena
+};
+
+enum class ExecutorPriority
+{
+  LOW,
+  NORMAL,
+  HIGH
+};
+
+struct ExecutorConfig
+{
+  ExecutorType type = ExecutorType::TBB_ARENA;
+  size_t num_threads = 0;  // including the calling thread, 0 for one per core
+  std::vector<int> cpus;  // cores the worker threads are pinned to, empty for no pinning
+  ExecutorPriority priority = ExecutorPriority::NORMAL;  // against the other TBB arenas
+};
+
+/**
+ * @brief Runs the parallel loops of the safe set, so that they share a bounded set of
+ * threads instead of competing with the rest of the process in the global TBB arena.
+ * One executor can be shared by several components.
+ *
+ */
+class Executor
+{
+public:
+  typedef std::shared_ptr<Executor> SharedPtr;
+  typedef std::unique_ptr<Executor> UniquePtr;
+
+  /**
+   * @brief Construct a new Executor object.
+   *
+   * @param config the threads of the executor.
+   * @throws std::invalid_argument if a pinned core does not exist.
+   */
+  explicit Executor(const ExecutorConfig & config = ExecutorConfig());
+  ~Executor();
+
+  /**
+   * @brief Call body(i) for every i in [0, n), and wait for all of them. The calling thread
+   * takes part in the loop. An exception thrown by a call is rethrown here.
+   *
+   * @param n the number of iterations.
+   * @param body the iteration, must be thread-safe unless the executor is serial.
+   */
+  void parallel_for(const size_t & n, const std::function<void(const size_t &)> & body) const;
+
+  // the maximum number of threads running a loop
+  size_t concurrency() const;
+
+  const ExecutorConfig & config() const;
+
+private:
+  struct Arena;  // keeps TBB out of the header
+  ExecutorConfig config_;
+  std::unique_ptr<Arena> arena_;  // null for the serial executor
+};
+}  // namespace racing_trajectory
+}  // namespace vehicle_model
+}  // namespace lmpc
+#endif  // RACING_TRAJECTORY__EXECUTOR_HPP_
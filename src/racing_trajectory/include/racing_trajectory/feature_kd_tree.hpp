@@ -0,0 +1,111 @@
+// Copyright 2023 Haoru Xue
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#ifndef RACING_TRAJECTORY__FEATURE_KD_TREE_HPP_
+#define RACING_TRAJECTORY__FEATURE_KD_TREE_HPP_
+
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <vector>
+
+namespace lmpc
+{
+namespace vehicle_model
+{
+namespace racing_trajectory
+{
+/**
+ * @brief KDTree for nearest neighbor search over points with any number of dimensions,
+ * such as weighted state features. Same flat layout as TrajectoryKDTree, with the reordered
+ * points stored one after another. All queries are const and thread-safe.
+ *
+ */
+class FeatureKDTree
+{
+public:
+  typedef std::shared_ptr<FeatureKDTree> SharedPtr;
+  typedef std::unique_ptr<FeatureKDTree> UniquePtr;
+
+  /**
+   * @brief Construct a new FeatureKDTree object.
+   *
+   * @param points the coordinates of the points, one point after another.
+   * @param num_dims the number of coordinates of every point.
+   */
+  FeatureKDTree(const std::vector<double> & points, const size_t & num_dims);
+
+  /**
+   * @brief Find the n closest points to a query.
+   *
+   * @param query pointer to the num_dims coordinates of the query.
+   * @param n the number of points to find.
+   * @param indices the indices of the closest points, appended from the closest.
+   */
+  void find_closest_indices(
+    const double * query, const size_t & n,
+    std::vector<size_t> & indices) const;
+
+  /**
+   * @brief Find the points closer than a radius to a query.
+   *
+   * @param query pointer to the num_dims coordinates of the query.
+   * @param radius the search radius.
+   * @param indices the indices of the points, appended from the closest.
+   * @param distances the distances of the points, appended from the closest.
+   * @param max_results if the radius holds more points, only the closest are returned.
+   */
+  void find_within_radius(
+    const double * query, const double & radius,
+    std::vector<size_t> & indices, std::vector<double> & distances,
+    const size_t & max_results = std::numeric_limits<size_t>::max()) const;
+
+  size_t size() const;
+  size_t num_dims() const;
+
+  static constexpr size_t LEAF_SIZE = 16;  // maximum number of points in a leaf
+
+protected:
+  size_t num_dims_;
+
+  // points reordered into leaves
+  std::vector<double> leaf_points_;
+  std::vector<size_t> leaf_indices_;  // original index of every reordered point
+
+  // split nodes in implicit layout
+  std::vector<double> split_values_;
+  std::vector<uint32_t> split_dims_;
+  size_t depth_ = 0;  // number of split levels above the leaves
+
+  void build(
+    const std::vector<double> & points, const size_t & node, const size_t & begin,
+    const size_t & end, const size_t & level);
+
+  /**
+   * @brief Depth-first search that visits the near child first and prunes the far child
+   * when the splitting plane is further than the visitor bound.
+   *
+   * @tparam Visitor provides bound() (squared distance) and scan(d2, begin).
+   */
+  template<typename Visitor>
+  void search(
+    const double * query, const size_t & node, const size_t & begin,
+    const size_t & end, const size_t & level, Visitor & visitor) const;
+};
+}  // namespace racing_trajectory
+}  // namespace vehicle_model
+}  // namespace lmpc
+#endif  // RACING_TRAJECTORY__FEATURE_KD_TREE_HPP_
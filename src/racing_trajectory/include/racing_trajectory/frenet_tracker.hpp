@@ -0,0 +1,110 @@
+// Copyright 2023 Haoru Xue
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#ifndef RACING_TRAJECTORY__FRENET_TRACKER_HPP_
+#define RACING_TRAJECTORY__FRENET_TRACKER_HPP_
+
+#include <cstdint>
+#include <memory>
+
+#include <lmpc_utils/primitives.hpp>
+
+#include "racing_trajectory/racing_trajectory.hpp"
+
+namespace lmpc
+{
+namespace vehicle_model
+{
+namespace racing_trajectory
+{
+/**
+ * @brief Tracks the frenet pose of a vehicle moving continuously along a trajectory.
+ * Each update starts the projection from the last abscissa and spline segment,
+ * which takes constant time. Teleports, diverged projections and jumps to another part
+ * of the track are detected and re-localized with the kd tree of the trajectory.
+ * Not thread-safe. Use one tracker per vehicle.
+ *
+ */
+class FrenetTracker
+{
+public:
+  typedef std::shared_ptr<FrenetTracker> SharedPtr;
+  typedef std::unique_ptr<FrenetTracker> UniquePtr;
+
+  /**
+   * @brief Construct a new FrenetTracker object.
+   *
+   * @param trajectory the trajectory to track on.
+   * @param window_segments number of neighbouring spline segments the foot point may move
+   * beyond the distance travelled by the vehicle in one update.
+   * @param max_jump_distance distance (m) travelled in one update beyond which the vehicle
+   * is considered teleported.
+   */
+  explicit FrenetTracker(
+    RacingTrajectory::SharedPtr trajectory,
+    const size_t & window_segments = 8,
+    const double & max_jump_distance = 10.0);
+
+  /**
+   * @brief Update the tracker with a new global pose.
+   *
+   * @param global_pose input global pose.
+   * @param frenet_pose output frenet pose. The abscissa is in [0, total_length).
+   * @return true if the pose was tracked incrementally, false if it was re-localized.
+   */
+  bool update(const Pose2D & global_pose, FrenetPose2D & frenet_pose);
+
+  /**
+   * @brief Switch to another trajectory. The next update re-localizes.
+   *
+   * @param trajectory the new trajectory.
+   */
+  void set_trajectory(RacingTrajectory::SharedPtr trajectory);
+
+  /**
+   * @brief Forget the tracked state. The next update re-localizes.
+   *
+   */
+  void reset();
+
+  bool initialized() const;
+  size_t segment() const;
+  int64_t laps() const;  // number of times the abscissa wrapped forward, minus backward
+  const RacingTrajectory & trajectory() const;
+
+protected:
+  RacingTrajectory::SharedPtr trajectory_;
+  size_t window_segments_;
+  double max_jump_distance_;
+  double window_length_;  // window_segments_ times the average segment length (m)
+
+  bool initialized_ = false;
+  size_t segment_ = 0;  // spline segment of the last foot point
+  double s_ = 0.0;  // last abscissa
+  Position2D position_;  // last global position
+  int64_t laps_ = 0;
+
+  /**
+   * @brief Re-localize with the closest waypoint of the trajectory.
+   *
+   * @param global_pose input global pose.
+   * @param frenet_pose output frenet pose.
+   */
+  void relocalize(const Pose2D & global_pose, FrenetPose2D & frenet_pose);
+};
+}  // namespace racing_trajectory
+}  // namespace vehicle_model
+}  // namespace lmpc
+#endif  // RACING_TRAJECTORY__FRENET_TRACKER_HPP_
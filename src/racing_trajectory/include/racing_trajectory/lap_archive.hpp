@@ -0,0 +1,141 @@
+// Copyright 2023 Haoru Xue
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#ifndef RACING_TRAJECTORY__LAP_ARCHIVE_HPP_
+#define RACING_TRAJECTORY__LAP_ARCHIVE_HPP_
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "racing_trajectory/lap_file.hpp"
+
+namespace lmpc
+{
+namespace vehicle_model
+{
+namespace racing_trajectory
+{
+constexpr char LAP_ARCHIVE_MAGIC[8] = "LMPCARC";
+constexpr char LAP_ARCHIVE_ENTRY_MAGIC[8] = "LMPCENT";
+constexpr uint32_t LAP_ARCHIVE_VERSION = 1;
+
+/**
+ * @brief Header of a lap archive file, followed by the entries one after another.
+ *
+ */
+struct LapArchiveHeader
+{
+  char magic[8];  // LAP_ARCHIVE_MAGIC
+  uint32_t version;  // LAP_ARCHIVE_VERSION
+  uint32_t header_size;  // size of this header in bytes
+};
+static_assert(sizeof(LapArchiveHeader) == 16, "the lap archive header must not be padded.");
+
+/**
+ * @brief Header of a lap in an archive. The header is followed by the column-major doubles of
+ * x, u, k and t, in native byte order.
+ *
+ */
+struct LapArchiveEntryHeader
+{
+  char magic[8];  // LAP_ARCHIVE_ENTRY_MAGIC
+  uint64_t entry_size;  // size of the header and the samples in bytes
+  uint64_t lap_id;
+  uint64_t trajectory_id;  // the track, or the racing line, the lap was driven on
+  uint64_t session_id;  // the session the lap was recorded in
+  double total_length;  // length of the track
+  double lap_time;  // time from the first to the last sample
+  uint64_t num_samples;  // columns of every matrix
+  uint64_t rows[4];  // rows of x, u, k and t
+  uint64_t checksum;  // FNV-1a of the samples
+};
+static_assert(
+  sizeof(LapArchiveEntryHeader) == 104, "the lap archive entry header must not be padded.");
+
+/**
+ * @brief Append-only file of the laps of many sessions, read through a memory map.
+ * Opening an archive only reads the entry headers into a directory, and a lap is paged in
+ * when it is loaded. A lap left incomplete by an interrupted append is ignored, and is
+ * overwritten by the next append. Loads are const and thread-safe.
+ *
+ */
+class LapArchive
+{
+public:
+  typedef std::shared_ptr<LapArchive> SharedPtr;
+  typedef std::unique_ptr<LapArchive> UniquePtr;
+
+  // directory entry of a lap
+  struct Entry
+  {
+    uint64_t lap_id;
+    uint64_t trajectory_id;
+    uint64_t session_id;
+    double total_length;
+    double lap_time;
+    uint64_t num_samples;
+    size_t offset;  // of the entry header in the file
+  };
+
+  /**
+   * @brief Open an archive, with the laps appended up to now.
+   *
+   * @param file_name the archive.
+   * @throws std::runtime_error if the file cannot be mapped or is not a lap archive.
+   */
+  explicit LapArchive(const std::string & file_name);
+  ~LapArchive();
+  LapArchive(const LapArchive &) = delete;
+  LapArchive & operator=(const LapArchive &) = delete;
+
+  // the laps, from the first appended
+  const std::vector<Entry> & entries() const;
+
+  /**
+   * @brief Copy a lap out of the archive.
+   *
+   * @param i the position of the lap in the entries.
+   * @return LapRecord the lap.
+   * @throws std::runtime_error if the samples are corrupted.
+   */
+  LapRecord load(const size_t & i) const;
+
+  /**
+   * @brief Append a lap to an archive, created if it does not exist.
+   * Not safe against concurrent appends to the same archive.
+   *
+   * @param file_name the archive.
+   * @param lap the lap, every matrix with the same number of columns.
+   * @param trajectory_id the track, or the racing line, the lap was driven on.
+   * @param session_id the session the lap was recorded in.
+   */
+  static void append(
+    const std::string & file_name, const LapRecord & lap,
+    const uint64_t & trajectory_id, const uint64_t & session_id);
+
+private:
+  std::string file_name_;
+  const unsigned char * data_ = nullptr;  // the mapped file
+  size_t size_ = 0;
+  size_t end_ = 0;  // of the last complete lap
+  std::vector<Entry> entries_;
+};
+}  // namespace racing_trajectory
+}  // namespace vehicle_model
+}  // namespace lmpc
+#endif  // RACING_TRAJECTORY__LAP_ARCHIVE_HPP_
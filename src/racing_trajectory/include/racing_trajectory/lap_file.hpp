@@ -0,0 +1,140 @@
+// Copyright 2023 Haoru Xue
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#ifndef RACING_TRAJECTORY__LAP_FILE_HPP_
+#define RACING_TRAJECTORY__LAP_FILE_HPP_
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+
+#include <casadi/casadi.hpp>
+
+namespace lmpc
+{
+namespace vehicle_model
+{
+namespace racing_trajectory
+{
+constexpr char LAP_FILE_MAGIC[8] = "LMPCLAP";
+constexpr uint32_t LAP_FILE_VERSION = 1;
+constexpr char LAP_FILE_EXTENSION[] = ".lap";
+
+/**
+ * @brief A recorded lap. x, u, k and t hold one sample per column.
+ *
+ */
+struct LapRecord
+{
+  uint64_t lap_id = 0;
+  double total_length = 0.0;  // length of the track the lap was recorded on
+  casadi::DM x;
+  casadi::DM u;
+  casadi::DM k;
+  casadi::DM t;
+};
+
+/**
+ * @brief Header of a binary lap file.
+ * The header is followed by the column-major doubles of x, u, k and t, in native byte order.
+ *
+ */
+struct LapFileHeader
+{
+  char magic[8];  // LAP_FILE_MAGIC
+  uint32_t version;  // LAP_FILE_VERSION
+  uint32_t header_size;  // size of this header in bytes
+  uint64_t lap_id;
+  double total_length;
+  uint64_t num_samples;  // columns of every matrix
+  uint64_t rows[4];  // rows of x, u, k and t
+  uint64_t checksum;  // FNV-1a of the payload
+};
+static_assert(sizeof(LapFileHeader) == 80, "the lap file header must not be padded.");
+
+/**
+ * @brief Write a lap to a binary lap file.
+ * The file is written next to its destination and renamed into place,
+ * so a partially written lap is never visible.
+ *
+ * @param file_name the lap file.
+ * @param lap the lap, every matrix with the same number of columns.
+ */
+void write_lap_file(const std::string & file_name, const LapRecord & lap);
+
+/**
+ * @brief Read a binary lap file.
+ * Throws std::runtime_error if the file is truncated, of another format or corrupted.
+ *
+ * @param file_name the lap file.
+ * @return LapRecord the lap.
+ */
+LapRecord read_lap_file(const std::string & file_name);
+
+/**
+ * @brief Writes lap files on a background thread.
+ * Queued laps are still written when the writer is destroyed.
+ *
+ */
+class LapWriter
+{
+public:
+  typedef std::shared_ptr<LapWriter> SharedPtr;
+  typedef std::unique_ptr<LapWriter> UniquePtr;
+
+  /**
+   * @brief Construct a new LapWriter object.
+   *
+   * @param max_queued_laps laps beyond this many pending writes are dropped.
+   */
+  explicit LapWriter(const size_t & max_queued_laps = 4);
+  ~LapWriter();
+
+  /**
+   * @brief Queue a lap to be written. Never blocks on file IO. Thread-safe.
+   *
+   * @param file_name the lap file.
+   * @param lap the lap.
+   * @return true if the lap is queued, false if the queue is full and the lap is dropped.
+   */
+  bool write(const std::string & file_name, LapRecord lap);
+
+  /**
+   * @brief Block until every queued lap is written.
+   *
+   */
+  void flush();
+
+private:
+  size_t max_queued_laps_;
+  std::deque<std::pair<std::string, LapRecord>> queue_;
+  bool writing_ = false;  // a lap is taken from the queue and being written
+  bool stop_ = false;
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::condition_variable idle_cv_;
+  std::thread thread_;
+
+  void write_loop();
+};
+}  // namespace racing_trajectory
+}  // namespace vehicle_model
+}  // namespace lmpc
+#endif  // RACING_TRAJECTORY__LAP_FILE_HPP_
@@ -16,12 +16,19 @@
 #ifndef RACING_TRAJECTORY__RACING_TRAJECTORY_HPP_
 #define RACING_TRAJECTORY__RACING_TRAJECTORY_HPP_
 
+#include <array>
 #include <memory>
+#include <mutex>
 #include <string>
+#include <utility>
+#include <vector>
 
 #include <casadi/casadi.hpp>
 
-#include <racing_trajectory/trajectory_kd_tree.hpp>
+#include <racing_trajectory/waypoint_index.hpp>
+#include <racing_trajectory/cubic_spline.hpp>
+#include <racing_trajectory/trajectory_projector.hpp>
+#include <racing_trajectory/trajectory_sampler.hpp>
 #include <lmpc_utils/primitives.hpp>
 
 namespace lmpc
@@ -67,8 +74,22 @@ public:
   typedef std::shared_ptr<RacingTrajectory> SharedPtr;
   typedef std::unique_ptr<RacingTrajectory> UniquePtr;
 
-  explicit RacingTrajectory(const casadi::DM & traj);
-  explicit RacingTrajectory(const std::string & file_name);
+  /**
+   * @brief Construct a new RacingTrajectory object.
+   *
+   * @param traj the trajectory table, one waypoint per column.
+   * @param codegen_cache_dir if not empty, the casadi functions are compiled to C in this directory
+   * and loaded from the cached library on the next construction with the same trajectory.
+   * Compiled functions are not differentiable, except frenet_to_global_function().
+   * @param index_type spatial index of the waypoints for the closest waypoint lookup.
+   */
+  explicit RacingTrajectory(
+    const casadi::DM & traj, const std::string & codegen_cache_dir = "",
+    const WaypointIndexType & index_type = WaypointIndexType::KD_TREE);
+  explicit RacingTrajectory(
+    const std::string & file_name,
+    const std::string & codegen_cache_dir = "",
+    const WaypointIndexType & index_type = WaypointIndexType::KD_TREE);
 
   /**
    * @brief Convert a frenet coordinate to a global coordinate.
@@ -80,6 +101,8 @@ public:
 
   /**
    * @brief Convert a global coordinate to a frenet coordinate.
+   * The foot point is found natively by the projector, starting from the closest
+   * waypoint or from the previous frenet pose.
    *
    * @param global_pose input global pose.
    * @param frenet_pose output frenet pose.
@@ -90,6 +113,29 @@ public:
     const bool & initialize_with_previous = false
   );
 
+  /**
+   * @brief Convert a batch of frenet coordinates to global coordinates.
+   * Large batches are split into chunks that are converted in parallel.
+   *
+   * @param frenet_poses input frenet poses.
+   * @param global_poses output global poses, resized to the input size.
+   */
+  void frenet_to_global(const FrenetPoses2D & frenet_poses, Poses2D & global_poses) const;
+
+  /**
+   * @brief Convert a batch of global coordinates to frenet coordinates.
+   * Large batches are split into chunks that are converted in parallel.
+   * Within a chunk, ordered poses are initialized with the result of the previous pose
+   * and fall back to the closest waypoint when it does not converge or jumps too far.
+   *
+   * @param global_poses input global poses.
+   * @param frenet_poses output frenet poses, resized to the input size.
+   * @param ordered if true, consecutive poses are assumed to be close along the trajectory.
+   */
+  void global_to_frenet(
+    const Poses2D & global_poses, FrenetPoses2D & frenet_poses,
+    const bool & ordered = false) const;
+
   /**
    * @brief Exposes the frenet-global conversion function.
    * Could be used for efficient evaluation and possible gradient evaluation.
@@ -165,12 +211,43 @@ public:
    */
   casadi::Function & velocity_interpolation_function();
 
+  /**
+   * @brief Exposes the native centerline projector used by global_to_frenet().
+   *
+   * @return const TrajectoryProjector&
+   */
+  const TrajectoryProjector & projector() const;
+
+  /**
+   * @brief Exposes the native sampler of all interpolated channels.
+   * Use it instead of the interpolation functions when gradients are not needed.
+   *
+   * @return const TrajectorySampler&
+   */
+  const TrajectorySampler & sampler() const;
+
+  /**
+   * @brief Build every casadi function now instead of on first use.
+   * Latency-critical users should call it before the first control cycle.
+   * Thread-safe, and a no-op once all functions are built.
+   *
+   */
+  void warm_up();
+
   const double & total_length() const;
 
+  /**
+   * @brief Find the abscissa of the waypoint closest to a global position.
+   *
+   * @param x the x coordinate of the position.
+   * @param y the y coordinate of the position.
+   * @return double the abscissa of the closest waypoint.
+   */
+  double closest_waypoint_abscissa(const double & x, const double & y) const;
+
 protected:
   casadi::DM traj_;  // stores the trajectory table
   casadi::DM abscissa_;  // stores the abscissa copied from the trajectory table
-  casadi::Function norm_2_;  // helper function to compute the norm of all waypoints
   casadi::Function yaw_intp_;  // interpolate yaw
   casadi::Function curvature_intp_;  // interpolate curvature
   casadi::Function left_intp_;  // interpolate left boundary
@@ -183,9 +260,59 @@ protected:
   casadi::Function global_to_frenet_sol_;  // g_to_f qp solver
 
   double total_length_;  // total length of the trajectory
+  std::string codegen_cache_dir_;  // compiled function cache, empty to not compile
+  std::vector<double> knots_;  // padded abscissa of the interpolation data
+  std::vector<std::vector<double>> channels_;  // padded interpolation data in SplineChannel order
+
+  // spatial index for fast nearest neighbor search of global coordinates
+  WaypointIndex::UniquePtr waypoint_index_;
+
+  CubicSpline::SharedPtr spline_;  // native spline of the centerline
+  TrajectoryProjector::UniquePtr projector_;  // native global to frenet projection
+  TrajectorySampler::UniquePtr sampler_;  // native sampling of all channels
+
+  static constexpr size_t BATCH_CHUNK_SIZE = 256;  // poses converted serially in a batch
+  static constexpr casadi_int CODEGEN_VERSION = 1;  // bump when the casadi functions change
+
+  /**
+   * @brief Groups of casadi functions that are built together on first use.
+   * Every group depends on the groups before it.
+   *
+   */
+  enum FunctionGroup : uint8_t
+  {
+    INTERPOLATION = 0,
+    FRENET_TO_GLOBAL = 1,
+    GLOBAL_TO_FRENET = 2,
+    NUM_FUNCTION_GROUPS = 3
+  };
+
+  std::array<std::once_flag, FunctionGroup::NUM_FUNCTION_GROUPS> function_flags_;
+  std::once_flag compiled_functions_flag_;
 
-  // kd tree for fast nearest neighbor search of global coordinates
-  TrajectoryKDTree kd_tree_;
+  /**
+   * @brief Build a group of casadi functions and its dependencies once. Thread-safe.
+   *
+   * @param group the function group.
+   */
+  void ensure_functions(const FunctionGroup & group);
+
+  void build_interpolation_functions();
+  void build_frenet_to_global_function();
+  void build_global_to_frenet_function();
+
+  /**
+   * @brief Load the casadi functions from the cached library, or build, compile and cache them.
+   *
+   */
+  void load_compiled_functions();
+
+  /**
+   * @brief The casadi functions stored in the compiled library, by name.
+   *
+   * @return std::vector<std::pair<std::string, casadi::Function *>>
+   */
+  std::vector<std::pair<std::string, casadi::Function *>> compiled_functions();
 };
 }  // namespace racing_trajectory
 }  // namespace vehicle_model
@@ -16,11 +16,18 @@
 #ifndef RACING_TRAJECTORY__RACING_TRAJECTORY_MAP_HPP_
 #define RACING_TRAJECTORY__RACING_TRAJECTORY_MAP_HPP_
 
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <map>
 #include <memory>
+#include <mutex>
 #include <string>
-#include <map>
+#include <thread>
+#include <vector>
 
 #include <casadi/casadi.hpp>
+#include <lmpc_msgs/msg/trajectory_command.hpp>
 
 #include <racing_trajectory/racing_trajectory.hpp>
 
@@ -32,6 +39,10 @@ namespace racing_trajectory
 {
 /**
  * @brief A set of racing trajectories.
+ * Trajectories are either all constructed in parallel at startup, or lazily on first use
+ * with a background thread that prefetches the trajectories likely to be used next.
+ * The active trajectory is published RCU-style: readers never lock, and a switch publishes
+ * a fully built trajectory atomically. Only the most recently requested switch is published.
  *
  */
 class RacingTrajectoryMap
@@ -40,12 +51,157 @@ public:
   typedef std::shared_ptr<RacingTrajectoryMap> SharedPtr;
   typedef std::unique_ptr<RacingTrajectoryMap> UniquePtr;
 
-  explicit RacingTrajectoryMap(const std::string & directory_path);
+  /**
+   * @brief Load every trajectory in a directory.
+   *
+   * @param directory_path directory of trajectory files named [number_name.txt].
+   * @param codegen_cache_dir if not empty, cache directory of the compiled trajectory functions.
+   * @param lazy if true, trajectories are constructed on first use or when prefetched.
+   * @param index_type spatial index of the trajectory waypoints.
+   */
+  explicit RacingTrajectoryMap(
+    const std::string & directory_path,
+    const std::string & codegen_cache_dir = "",
+    const bool & lazy = false,
+    const WaypointIndexType & index_type = WaypointIndexType::KD_TREE);
+
+  ~RacingTrajectoryMap();
 
+  /**
+   * @brief Get a trajectory, constructing it if it is not loaded yet.
+   * Queues the prefetch hints of the trajectory. Thread-safe.
+   *
+   * @param index the trajectory number.
+   * @return RacingTrajectory::SharedPtr the trajectory, or nullptr if it does not exist.
+   */
   RacingTrajectory::SharedPtr get_trajectory(const int & index);
 
+  /**
+   * @brief Construct a trajectory in the background if it is not loaded yet.
+   *
+   * @param index the trajectory number.
+   */
+  void prefetch(const int & index);
+
+  /**
+   * @brief Set the trajectories to prefetch whenever a trajectory is requested,
+   * e.g. the pit lane when the race line is requested.
+   *
+   * @param index the trajectory number.
+   * @param next_indices the trajectory numbers likely to be requested next.
+   */
+  void set_prefetch_hints(const int & index, const std::vector<int> & next_indices);
+
+  /**
+   * @brief Whether a trajectory is constructed.
+   *
+   * @param index the trajectory number.
+   * @return true if the trajectory exists and is constructed.
+   */
+  bool is_loaded(const int & index) const;
+
+  std::vector<int> trajectory_indices() const;
+
+  /**
+   * @brief Snapshot of the active trajectory. Never locks, and never waits for a build.
+   * The snapshot stays valid after a switch until it is released.
+   *
+   * @return RacingTrajectory::SharedPtr the active trajectory, or nullptr if none is active.
+   */
+  RacingTrajectory::SharedPtr get_active_trajectory() const;
+
+  /**
+   * @brief Number of the active trajectory.
+   *
+   * @return int the trajectory number, or -1 if none is active.
+   */
+  int get_active_trajectory_index() const;
+
+  /**
+   * @brief Build and warm up a trajectory on the calling thread, then make it active.
+   *
+   * @param index the trajectory number.
+   * @return true if the trajectory exists.
+   */
+  bool set_active_trajectory(const int & index);
+
+  /**
+   * @brief Build and warm up a trajectory on the background thread, then make it active.
+   * The previous trajectory stays active in the meantime.
+   *
+   * @param index the trajectory number.
+   * @return true if the trajectory exists.
+   */
+  bool set_active_trajectory_async(const int & index);
+
+  /**
+   * @brief Switch the active trajectory asynchronously if the command asks for another one.
+   *
+   * @param command the trajectory command.
+   */
+  void apply_command(const lmpc_msgs::msg::TrajectoryCommand & command);
+
 private:
-  std::map<int, RacingTrajectory::SharedPtr> trajectories_;
+  struct TrajectoryEntry
+  {
+    int index;
+    std::string path;
+    std::once_flag load_flag;
+    std::atomic<bool> loaded{false};
+    RacingTrajectory::SharedPtr trajectory;
+    std::vector<int> prefetch_hints;  // guarded by background_mutex_
+  };
+
+  std::string codegen_cache_dir_;
+  WaypointIndexType index_type_;
+  // the entries are fixed after construction, so lookups need no lock
+  std::map<int, std::unique_ptr<TrajectoryEntry>> entries_;
+
+  // the entries and their trajectories live as long as the map, so the active trajectory is
+  // published as a plain pointer to its entry. stored with release, loaded with acquire.
+  std::atomic<const TrajectoryEntry *> active_{nullptr};
+  static_assert(
+    std::atomic<const TrajectoryEntry *>::is_always_lock_free,
+    "the active trajectory must be readable without a lock");
+
+  struct BackgroundTask
+  {
+    int index;
+    bool activate;  // make the trajectory active after building it
+  };
+  std::thread background_thread_;
+  std::mutex background_mutex_;  // guards the background queue, hints and pending switch
+  std::condition_variable background_cv_;
+  std::deque<BackgroundTask> background_queue_;
+  int pending_active_index_ = -1;  // last requested switch
+  bool stop_background_ = false;
+
+  /**
+   * @brief Construct the trajectory of an entry once. Thread-safe.
+   *
+   * @param index the trajectory number.
+   * @param entry the trajectory entry.
+   */
+  void load(const int & index, TrajectoryEntry & entry);
+
+  /**
+   * @brief Construct every trajectory in parallel.
+   *
+   */
+  void load_all();
+
+  /**
+   * @brief Build and warm up a trajectory, then publish it as the active trajectory
+   * unless another switch was requested in the meantime.
+   *
+   * @param index the trajectory number.
+   * @param entry the trajectory entry.
+   * @return true if the trajectory is published, false if the switch is stale.
+   */
+  bool activate(const int & index, TrajectoryEntry & entry);
+
+  void queue_prefetch_hints(const TrajectoryEntry & entry);
+  void background_loop();
 };
 }  // namespace racing_trajectory
 }  // namespace vehicle_model
@@ -18,6 +18,7 @@
 
 #include <memory>
 #include <string>
+#include <vector>
 #include <shared_mutex>
 
 #include <casadi/casadi.hpp>
@@ -66,7 +67,7 @@ private:
 
   std::shared_mutex mutex_;
 
-  Polygon build_polygon(const casadi::DM & pts);
+  Polygon build_polygon(const std::vector<double> & x, const std::vector<double> & y);
   void on_static_vis_timer();
 };
 }  // namespace racing_trajectory
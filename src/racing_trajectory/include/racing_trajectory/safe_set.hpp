@@ -16,15 +16,31 @@
 #ifndef RACING_TRAJECTORY__SAFE_SET_HPP_
 #define RACING_TRAJECTORY__SAFE_SET_HPP_
 
+#include <condition_variable>
+#include <deque>
+#include <future>
+#include <limits>
+#include <map>
 #include <memory>
+#include <mutex>
+#include <optional>
+#include <shared_mutex>
 #include <vector>
 #include <string>
-#include <shared_mutex>
+#include <thread>
+#include <utility>
 
-#include <boost/circular_buffer.hpp>
 #include <casadi/casadi.hpp>
 
-#include "racing_trajectory/trajectory_kd_tree.hpp"
+#include <lmpc_utils/cycle_profiler.hpp>
+
+#include "racing_trajectory/batch_evaluator.hpp"
+#include "racing_trajectory/executor.hpp"
+#include "racing_trajectory/feature_kd_tree.hpp"
+#include "racing_trajectory/lap_archive.hpp"
+#include "racing_trajectory/lap_file.hpp"
+#include "racing_trajectory/safe_set_index.hpp"
+#include "racing_trajectory/waypoint_index.hpp"
 
 namespace lmpc
 {
@@ -32,10 +48,33 @@ namespace vehicle_model
 {
 namespace racing_trajectory
 {
+/**
+ * @brief Weighted state dimensions of the safe set nearest neighbor search. The distance
+ * between two states is sqrt(sum_i weights[i] * (x1[state_idxs[i]] - x2[state_idxs[i]])^2).
+ * The default is the unweighted track position, served by the planar waypoint indexes.
+ *
+ */
+struct SSMetric
+{
+  std::vector<casadi_int> state_idxs{0, 1};
+  std::vector<double> weights{1.0, 1.0};
+
+  /**
+   * @brief Check the metric.
+   *
+   * @param num_states the size of the state vector.
+   * @throws std::invalid_argument if an index is out of range or a weight is not positive.
+   */
+  void validate(const casadi_int & num_states) const;
+
+  // true for the unweighted first two states
+  bool is_planar() const;
+};
+
 struct SSQuery
 {
   casadi::DM x;    // state query
-  casadi::DM dist_max;    // maximum distance to the safe set
+  casadi::DM dist_max;    // maximum distance to the safe set in the metric, empty for no limit
   casadi_int max_num_total;    // maximum number of points to return
   casadi_int max_num_per_lap;    // maximum number of points to return per lap
 };
@@ -58,15 +97,19 @@ struct SSTrajectoryData
   casadi::DM J;
 };
 
+// state and control indices of the regression inputs
+typedef std::pair<std::vector<casadi_int>, std::vector<casadi_int>> RegFeatureIdxs;
+
 struct RegQuery
 {
   typedef std::vector<std::vector<casadi_int>> Indices;
-  casadi::DM x;  // state query
-  casadi::DM A;  // from nominal model
-  casadi::DM B;  // from nominal model
-  casadi::DM C;  // from nominal model
+  // queries in the regression input space, the states then the controls. one column per stage
+  casadi::DM x;
+  casadi::DM A;  // from nominal model, the blocks of the stages stacked horizontally
+  casadi::DM B;  // from nominal model, the blocks of the stages stacked horizontally
+  casadi::DM C;  // from nominal model, one column per stage
   casadi::Function f;  // nominal model
-  double dist_max;  // maximum distance to the safe set
+  double dist_max;  // maximum distance to the safe set, in the regression input space
   casadi_int max_num_total;  // maximum number of points to return
   casadi_int max_num_per_lap;  // maximum number of points to return per lap
   Indices reg_in_state_idxs;  // indices of the state variables to be used for regression
@@ -93,21 +136,103 @@ public:
   typedef std::shared_ptr<SSTrajectory> SharedPtr;
   typedef std::unique_ptr<SSTrajectory> UniquePtr;
 
+  // x, u and k are taken by value so that a finished lap is handed over without a copy
   explicit SSTrajectory(
-    const casadi::DM & x, const casadi::DM & u, const casadi::DM & k,
-    const casadi::DM & t, const double & total_length);
+    casadi::DM x, casadi::DM u, casadi::DM k,
+    const casadi::DM & t, const double & total_length,
+    const WaypointIndexType & index_type = WaypointIndexType::KD_TREE,
+    const SSMetric & metric = SSMetric());
 
   SSResult query(const SSQuery & query) const;
-  std::vector<RegResult> query(const RegQuery & query) const;
+  std::vector<RegResult> query(const RegQuery & query) const;  // for a single stage
+
+  /**
+   * @brief Find the points of the lap closest to the query state in the metric.
+   *
+   * @param query the query. Only the state, dist_max and max_num_per_lap are used.
+   * @param indices the columns of x_repeat and J, appended from the closest.
+   */
+  void find_points(const SSQuery & query, std::vector<size_t> & indices) const;
+
+  /**
+   * @brief Get the index of the regression inputs, built on the first call. The inputs
+   * of sample i are its selected states and controls. The last sample has no next state
+   * and is left out.
+   *
+   * @param features the state and control indices of the regression inputs.
+   * @return FeatureKDTree::SharedPtr the index, shared by all the later calls.
+   */
+  FeatureKDTree::SharedPtr regression_index(const RegFeatureIdxs & features) const;
+
+  const SSTrajectoryData & data() const;
+
+  // time from the first to the last sample
+  double lap_time() const;
+  // cost-to-go of the first sample, the number of steps of the lap
+  double iteration_cost() const;
+  // true if the lap was thinned out by downsample
+  bool downsampled() const;
+
+  /**
+   * @brief Estimate the memory held by the lap, its data and its indexes.
+   *
+   * @return size_t the approximate number of bytes.
+   */
+  size_t memory_usage() const;
+
+  /**
+   * @brief Thin out the lap in the state space. Along the lap, a sample is kept if it is at
+   * least spacing away from the last kept sample in the metric. The kept samples keep their
+   * cost-to-go, and their time step reaches the next kept sample.
+   *
+   * @param spacing the minimum distance between the kept samples.
+   * @return SSTrajectory::UniquePtr the downsampled lap, with the same lap time.
+   */
+  UniquePtr downsample(const double & spacing) const;
 
 private:
   SSTrajectoryData lap_;
-  lmpc::vehicle_model::racing_trajectory::TrajectoryKDTree tree_;
+  SSMetric metric_;
+  WaypointIndexType index_type_;
+  double lap_time_;
+  bool downsampled_;
+  WaypointIndex::UniquePtr tree_;  // for the planar metric
+  FeatureKDTree::UniquePtr feature_tree_;  // for any other metric, over the weighted states
 
-  SSTrajectoryData process_lap_data(
-    const casadi::DM & x, const casadi::DM & u,
-    const casadi::DM & k, const casadi::DM & t,
-    const double & total_length) const;
+  // regression input indexes, one per combination of inputs
+  mutable std::shared_mutex regression_mutex_;
+  mutable std::map<RegFeatureIdxs, FeatureKDTree::SharedPtr> regression_indexes_;
+
+  SSTrajectory(
+    SSTrajectoryData data, const double & lap_time, const WaypointIndexType & index_type,
+    const SSMetric & metric, const bool & downsampled);
+
+  static SSTrajectoryData process_lap_data(
+    casadi::DM x, casadi::DM u, casadi::DM k, const casadi::DM & t,
+    const double & total_length);
+};
+
+enum class LapRanking
+{
+  LAP_TIME,
+  ITERATION_COST
+};
+
+/**
+ * @brief Laps kept by the safe set. A lap is kept if it is one of the most recent laps, or one
+ * of the best laps. The newest lap is always kept. When the kept laps exceed the byte budget,
+ * the worst of the older laps are evicted first.
+ *
+ */
+struct SSRetentionPolicy
+{
+  size_t num_recent = 1;  // most recent laps kept
+  size_t num_best = 0;  // best laps kept, by the ranking
+  LapRanking ranking = LapRanking::LAP_TIME;
+  size_t max_bytes = std::numeric_limits<size_t>::max();  // memory budget of the kept laps
+  // the laps kept only for being the best are downsampled with this spacing in the metric.
+  // 0 to keep all their samples
+  double downsample_spacing = 0.0;
 };
 
 class SafeSetManager
@@ -116,17 +241,193 @@ public:
   typedef std::shared_ptr<SafeSetManager> SharedPtr;
   typedef std::unique_ptr<SafeSetManager> UniquePtr;
 
-  explicit SafeSetManager(const size_t & max_lap_stored);
+  /**
+   * @brief Construct a new SafeSetManager object.
+   *
+   * @param max_lap_stored the number of laps kept, the oldest are evicted first.
+   * @param index_type the spatial index of every lap, for the planar metric.
+   * @param metric the weighted state dimensions of the nearest neighbor search.
+   * @param executor the threads of the parallel queries, which may be shared. A serial
+   * executor makes the queries deterministic.
+   */
+  explicit SafeSetManager(
+    const size_t & max_lap_stored,
+    const WaypointIndexType & index_type = WaypointIndexType::KD_TREE,
+    const SSMetric & metric = SSMetric(),
+    Executor::SharedPtr executor = std::make_shared<Executor>());
+
+  /**
+   * @brief Construct a new SafeSetManager object with a retention policy.
+   *
+   * @param retention the laps kept. No lap is stored if it keeps neither recent nor best laps.
+   * @param index_type the spatial index of every lap, for the planar metric.
+   * @param metric the weighted state dimensions of the nearest neighbor search.
+   * @param executor the threads of the parallel queries, which may be shared.
+   */
+  explicit SafeSetManager(
+    const SSRetentionPolicy & retention,
+    const WaypointIndexType & index_type = WaypointIndexType::KD_TREE,
+    const SSMetric & metric = SSMetric(),
+    Executor::SharedPtr executor = std::make_shared<Executor>());
+  ~SafeSetManager();
 
   void add_lap(
-    const casadi::DM & x, const casadi::DM & u, const casadi::DM & k,
+    casadi::DM x, casadi::DM u, casadi::DM k,
     const casadi::DM & t, const double & total_length);
+
+  /**
+   * @brief Add a lap without blocking. The lap is processed on a background thread,
+   * in the order the laps are added. Laps still queued on destruction are added first.
+   *
+   * @param x states of the lap, one sample per column.
+   * @param u controls of the lap.
+   * @param k curvatures of the lap.
+   * @param t timestamps of the lap.
+   * @param total_length length of the track.
+   * @return std::future<void> ready when the lap is queryable. Holds the exception if the
+   * lap could not be added.
+   */
+  std::future<void> add_lap_async(
+    casadi::DM x, casadi::DM u, casadi::DM k, casadi::DM t,
+    const double & total_length);
+
+  /**
+   * @brief Add the laps of an archive kept by the retention policy. The laps are selected from
+   * the archive directory, and only the selected laps are read, in the background. Laps that
+   * fail to load are skipped.
+   *
+   * @param archive the archive, held until its laps are added.
+   * @param trajectory_id only the laps of this trajectory if set.
+   * @return std::future<void> ready when the laps are queryable.
+   */
+  std::future<void> attach(
+    LapArchive::SharedPtr archive,
+    const std::optional<uint64_t> & trajectory_id = std::nullopt);
+
+  /**
+   * @brief Block until every lap added with add_lap_async is queryable.
+   *
+   */
+  void flush();
+
   SSResult query(const SSQuery & query);
+
+  /**
+   * @brief Query the safe set into existing buffers. All the laps are searched at once,
+   * and the points are ordered from the newest lap, then from the closest point.
+   *
+   * @param query the query.
+   * @param result the query result. Its matrices are reused if they have the right size.
+   */
+  void query(const SSQuery & query, SSResult & result);
+
+  /**
+   * @brief Regress the error dynamics at every stage of a horizon. The neighbors of all the
+   * stages are gathered and evaluated with the nominal model once, and the stages are fitted
+   * in parallel.
+   *
+   * @param query the query, with one column of x per stage.
+   * @return RegResult the A, B and C of all the stages, stacked like the query. The samples
+   * are not returned.
+   */
   RegResult query(const RegQuery & query);
 
+  // timing of the recent safe set and regression queries
+  lmpc::utils::Profile<> safe_set_query_profile();
+  lmpc::utils::Profile<> regression_query_profile();
+
+  const Executor & executor() const;
+
+  // number of recent queries in the timing profiles
+  static constexpr size_t PROFILE_WINDOW = 100;
+
+private:
+  // immutable set of the stored laps
+  struct LapSnapshot
+  {
+    std::vector<SSTrajectory::SharedPtr> laps;  // from the oldest to the newest
+    SafeSetIndex index;  // points of all the laps, by their position in laps
+  };
+
+  // readers query a snapshot without locking. a new lap publishes a new snapshot,
+  // and an evicted lap is freed with the last snapshot holding it.
+  // accessed with std::atomic_load and std::atomic_store only
+  std::shared_ptr<const LapSnapshot> laps_;
+  std::mutex publish_mutex_;  // serializes the writers
+  SSRetentionPolicy retention_;
+  WaypointIndexType index_type_;  // spatial index of the new laps
+  SSMetric metric_;
+
+  // regression inputs seen so far, indexed when a lap is added.
+  // accessed with std::atomic_load and std::atomic_store only
+  std::shared_ptr<const std::vector<RegFeatureIdxs>> regression_features_;
+  // evaluator of the nominal model of the last regression query.
+  // accessed with std::atomic_load and std::atomic_store only
+  std::shared_ptr<const BatchEvaluator> nominal_model_;
+
+  Executor::SharedPtr executor_;
+  lmpc::utils::CycleProfiler<> safe_set_profiler_;
+  lmpc::utils::CycleProfiler<> regression_profiler_;
+
+  // background lap processing
+  std::deque<std::packaged_task<void()>> add_queue_;
+  std::mutex add_mutex_;
+  std::condition_variable add_cv_;
+  bool stop_adding_ = false;
+  std::thread add_thread_;
+
+  std::future<void> add_lap_async_task(std::packaged_task<void()> task);
+  void publish_lap(SSTrajectory::UniquePtr lap);
+  // which of the laps, from the oldest to the newest, the retention policy keeps.
+  // the laps only kept for being the best may be replaced by their downsampled version.
+  std::vector<bool> retain_laps(std::vector<SSTrajectory::SharedPtr> & laps) const;
+  void find_safe_set(const SSQuery & query, SSResult & result);
+  RegResult regress(const RegQuery & query);
+  // remember regression inputs that were indexed in a query, for the laps added later
+  void register_regression_features(const RegFeatureIdxs & features);
+  // index regression inputs in a new lap. a failure is logged and does not drop the lap.
+  static void build_regression_index(const SSTrajectory & lap, const RegFeatureIdxs & features);
+  void add_loop();
+};
+
+/**
+ * @brief Column-major buffer of equally sized samples with amortized constant time append.
+ *
+ */
+class ColumnBuffer
+{
+public:
+  /**
+   * @brief Construct a new ColumnBuffer object.
+   *
+   * @param capacity number of columns to reserve when the first sample is appended.
+   */
+  explicit ColumnBuffer(const size_t & capacity);
+
+  /**
+   * @brief Append a sample. The number of rows is fixed by the first sample.
+   *
+   * @param column the sample, a column vector.
+   */
+  void append(const casadi::DM & column);
+
+  /**
+   * @brief Hand the samples over to a dense matrix without copying them, and clear the buffer.
+   *
+   * @return casadi::DM the samples, one per column.
+   */
+  casadi::DM release();
+
+  void clear();
+  const double & at(const size_t & row, const size_t & col) const;
+  size_t rows() const;
+  size_t cols() const;
+
 private:
-  boost::circular_buffer<SSTrajectory::UniquePtr> laps_;
-  std::shared_mutex mutex_;
+  size_t capacity_;
+  size_t rows_ = 0;
+  size_t cols_ = 0;
+  std::vector<double> data_;
 };
 
 class SafeSetRecorder
@@ -135,27 +436,44 @@ public:
   typedef std::shared_ptr<SafeSetRecorder> SharedPtr;
   typedef std::unique_ptr<SafeSetRecorder> UniquePtr;
 
+  /**
+   * @brief Construct a new SafeSetRecorder object.
+   *
+   * @param manager the safe set to add the completed laps to.
+   * @param to_file if true, the completed laps are saved as binary lap files in the background.
+   * @param file_prefix prefix of the saved lap files.
+   * @param expected_lap_samples number of samples to preallocate for every lap.
+   */
   explicit SafeSetRecorder(
     SafeSetManager & manager,
     const bool & to_file,
-    const std::string & file_prefix);
+    const std::string & file_prefix,
+    const size_t & expected_lap_samples = 10000);
   void step(
     const casadi::DM & x, const casadi::DM & u, const casadi::DM & k, const casadi::DM & t,
     const double & total_length);
 
+  /**
+   * @brief Load laps into the safe set.
+   *
+   * @param from_files binary lap files, or prefixes of the lap files. A prefix loads
+   * [prefix.lap] if it exists, and the legacy [prefix_x.txt, prefix_u.txt, ...] otherwise.
+   * @param total_length length of the track.
+   */
   void load(const std::vector<std::string> & from_files, const double & total_length);
 
 private:
   SafeSetManager & manager_;
-  casadi::DM last_x_;
-  casadi::DM last_u_;
-  casadi::DM last_t_;
-  casadi::DM last_k_;
+  ColumnBuffer last_x_;
+  ColumnBuffer last_u_;
+  ColumnBuffer last_t_;
+  ColumnBuffer last_k_;
   bool last_x_valid_;
   bool initialized_;
   bool to_file_;
   std::string file_prefix_;
   size_t lap_count_;
+  LapWriter::UniquePtr writer_;  // saves the laps off the caller thread
 };
 
 }  // namespace racing_trajectory
@@ -0,0 +1,117 @@
+// Copyright 2023 Haoru Xue
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#ifndef RACING_TRAJECTORY__SAFE_SET_INDEX_HPP_
+#define RACING_TRAJECTORY__SAFE_SET_INDEX_HPP_
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "racing_trajectory/uniform_grid.hpp"
+
+namespace lmpc
+{
+namespace vehicle_model
+{
+namespace racing_trajectory
+{
+/**
+ * @brief Uniform grid over the points of every lap in the safe set.
+ * Every point carries the position of its lap, from the oldest to the newest, and its
+ * column in the lap. One ring search collects the closest points of all the laps, with a cap
+ * per lap and in total. A new index is merged from the previous one cell by cell in linear
+ * time, so adding or evicting a lap never sorts the points of the other laps again.
+ * The index is immutable. All queries are const and thread-safe.
+ *
+ */
+class SafeSetIndex
+{
+public:
+  typedef std::shared_ptr<SafeSetIndex> SharedPtr;
+  typedef std::unique_ptr<SafeSetIndex> UniquePtr;
+
+  struct Neighbor
+  {
+    uint32_t lap;  // position of the lap
+    uint32_t index;  // column of the point in the lap
+    double distance;
+  };
+
+  /**
+   * @brief Construct an empty SafeSetIndex object.
+   *
+   */
+  SafeSetIndex();
+
+  /**
+   * @brief Construct a new SafeSetIndex object from a previous index and a new lap.
+   * The grid of the previous index is kept if it covers the new lap.
+   *
+   * @param previous the index of the previous laps.
+   * @param lap_map the new position of every previous lap, or -1 to drop its points.
+   * @param x the x coordinates of the points of the new lap.
+   * @param y the y coordinates of the points of the new lap.
+   * @param lap the position of the new lap.
+   */
+  SafeSetIndex(
+    const SafeSetIndex & previous, const std::vector<int64_t> & lap_map,
+    const std::vector<double> & x, const std::vector<double> & y, const uint32_t & lap);
+
+  /**
+   * @brief Find the closest points of the newest laps. From the newest lap to the oldest,
+   * every lap contributes its closest points up to max_num_per_lap, until there are
+   * max_num_total points.
+   *
+   * @param x the x coordinate of the query.
+   * @param y the y coordinate of the query.
+   * @param max_num_per_lap the maximum number of points of every lap.
+   * @param max_num_total the maximum number of points.
+   * @param radius only the points closer than the radius. Infinity for no limit.
+   * @param neighbors the points, cleared first. Ordered from the newest lap, then from the
+   * closest point.
+   * @return false if the query is too far from every point to search the grid, and the
+   * neighbors are not valid.
+   */
+  bool query(
+    const double & x, const double & y, const size_t & max_num_per_lap,
+    const size_t & max_num_total, const double & radius,
+    std::vector<Neighbor> & neighbors) const;
+
+  size_t num_laps() const;
+  size_t size() const;
+  double cell_size() const;
+
+  static constexpr double SPACING_TO_CELL_SIZE = 2.0;  // cell size over median point spacing
+  static constexpr size_t MAX_CELLS_PER_POINT = 32;  // of a lap. the cell size grows beyond this
+  static constexpr double GRID_MARGIN = 0.1;  // relative margin of a new grid for later laps
+  static constexpr size_t MAX_SCANNED_CELLS = 2048;  // the search gives up beyond this
+
+protected:
+  UniformGrid grid_;
+  std::vector<size_t> lap_sizes_;  // number of points of every lap
+
+  // points sorted by cell, row major
+  std::vector<uint32_t> cell_offsets_;  // points of cell i are in [offsets[i], offsets[i + 1])
+  std::vector<double> cell_x_;
+  std::vector<double> cell_y_;
+  std::vector<uint32_t> cell_laps_;
+  std::vector<uint32_t> cell_indices_;
+};
+}  // namespace racing_trajectory
+}  // namespace vehicle_model
+}  // namespace lmpc
+#endif  // RACING_TRAJECTORY__SAFE_SET_INDEX_HPP_
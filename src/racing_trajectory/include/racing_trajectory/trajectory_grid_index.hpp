@@ -0,0 +1,104 @@
+// Copyright 2023 Haoru Xue
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#ifndef RACING_TRAJECTORY__TRAJECTORY_GRID_INDEX_HPP_
+#define RACING_TRAJECTORY__TRAJECTORY_GRID_INDEX_HPP_
+
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+#include "racing_trajectory/trajectory_kd_tree.hpp"
+#include "racing_trajectory/uniform_grid.hpp"
+#include "racing_trajectory/waypoint_index.hpp"
+
+namespace lmpc
+{
+namespace vehicle_model
+{
+namespace racing_trajectory
+{
+/**
+ * @brief Uniform grid for fast lookup of closest waypoints on track polylines.
+ * Race tracks are thin curves over a large bounding box, so a grid with cells of about
+ * the waypoint spacing finds the closest waypoints by scanning a few rings of cells
+ * around the query. The waypoints are stored in cell order as structure of arrays
+ * together with their original indices. Queries that are far from every waypoint
+ * fall back to an exact kd tree search. All queries are const and thread-safe.
+ *
+ */
+class TrajectoryGridIndex : public WaypointIndex
+{
+public:
+  /**
+   * @brief Construct a new TrajectoryGridIndex object.
+   *
+   * @param x the x coordinates of the waypoints.
+   * @param y the y coordinates of the waypoints.
+   * @param cell_size edge length of the grid cells. Computed from the waypoint spacing if
+   * not positive.
+   */
+  TrajectoryGridIndex(
+    const std::vector<double> & x, const std::vector<double> & y,
+    const double & cell_size = 0.0);
+
+  size_t find_closest_waypoint_index(const double & x, const double & y) const override;
+
+  void find_closest_waypoint_indices(
+    const double & x, const double & y, const size_t & n,
+    std::vector<size_t> & indices) const override;
+
+  void find_waypoints_within_radius(
+    const double & x, const double & y, const double & radius,
+    std::vector<size_t> & indices, std::vector<double> & distances,
+    const size_t & max_results = std::numeric_limits<size_t>::max()) const override;
+
+  double cell_size() const;
+
+  static constexpr double SPACING_TO_CELL_SIZE = 2.0;  // cell size over median waypoint spacing
+  static constexpr size_t MAX_CELLS_PER_WAYPOINT = 32;  // the cell size grows beyond this
+  static constexpr size_t MAX_SCANNED_CELLS = 256;  // kd tree search beyond this
+
+protected:
+  UniformGrid grid_;
+
+  // waypoints sorted by cell, row major
+  std::vector<uint32_t> cell_offsets_;  // waypoints of cell i are in [offsets[i], offsets[i + 1])
+  std::vector<double> cell_x_;
+  std::vector<double> cell_y_;
+  std::vector<size_t> cell_indices_;  // original index of every sorted waypoint
+
+  TrajectoryKDTree fallback_;  // for queries far off the track
+
+  /**
+   * @brief Scan rings of cells around the query until no unscanned waypoint can beat the
+   * visitor bound.
+   *
+   * @tparam Visitor provides bound() (squared distance) and push(squared distance, index).
+   * @return false if the search gave up and the visitor holds no valid result.
+   */
+  template<typename Visitor>
+  bool search(const double & x, const double & y, Visitor & visitor) const;
+
+  template<typename Visitor>
+  void scan(
+    const size_t & begin, const size_t & end, const double & x, const double & y,
+    Visitor & visitor) const;
+};
+}  // namespace racing_trajectory
+}  // namespace vehicle_model
+}  // namespace lmpc
+#endif  // RACING_TRAJECTORY__TRAJECTORY_GRID_INDEX_HPP_
@@ -16,19 +16,12 @@
 #ifndef RACING_TRAJECTORY__TRAJECTORY_KD_TREE_HPP_
 #define RACING_TRAJECTORY__TRAJECTORY_KD_TREE_HPP_
 
-#include <CGAL/Simple_cartesian.h>
-#include <CGAL/point_generators_2.h>
-#include <CGAL/Orthogonal_k_neighbor_search.h>
-#include <CGAL/Search_traits_2.h>
-
+#include <cstddef>
+#include <cstdint>
+#include <limits>
 #include <vector>
-#include <unordered_map>
 
-typedef CGAL::Simple_cartesian<double> K;
-typedef K::Point_2 Point_d;
-typedef CGAL::Search_traits_2<K> TreeTraits;
-typedef CGAL::Orthogonal_k_neighbor_search<TreeTraits> Neighbor_search;
-typedef Neighbor_search::Tree Tree;
+#include "racing_trajectory/waypoint_index.hpp"
 
 namespace lmpc
 {
@@ -36,37 +29,15 @@ namespace vehicle_model
 {
 namespace racing_trajectory
 {
-/**
- * @brief Internal map key to map waypoints to their indices.
- *
- */
-struct WaypointKey
-{
-  double x;
-  double y;
-  bool operator==(const WaypointKey & other) const
-  {
-    return x == other.x && y == other.y;
-  }
-};
-
-/**
- * @brief Hasher for WaypointKey for interal use.
- *
- */
-struct WaypointKeyHasher
-{
-  std::size_t operator()(const WaypointKey & k) const
-  {
-    return std::hash<double>()(k.x) ^ (std::hash<double>()(k.y) << 1);
-  }
-};
-
 /**
  * @brief KDTree for fast lookup of closest waypoints.
+ * The tree is flat: split nodes live in an implicit array layout (the children of node i
+ * are 2i + 1 and 2i + 2), and the waypoints are reordered into contiguous leaves stored as
+ * structure of arrays together with their original indices. Leaves are scanned with
+ * vectorized distance computation. All queries are const and thread-safe.
  *
  */
-class TrajectoryKDTree
+class TrajectoryKDTree : public WaypointIndex
 {
 public:
   /**
@@ -84,9 +55,7 @@ public:
    * @param y the y coordinate of the point.
    * @return size_t the index of the closest waypoint.
    */
-  size_t find_closest_waypoint_index(
-    const double & x, const double & y
-  ) const;
+  size_t find_closest_waypoint_index(const double & x, const double & y) const override;
 
   /**
    * @brief Find the n closest waypoints to a given point.
@@ -94,30 +63,44 @@ public:
    * @param x the x coordinate of the point.
    * @param y the y coordinate of the point.
    * @param n the number of waypoints to find.
-   * @param indices the indices of the closest waypoints.
+   * @param indices the indices of the closest waypoints, appended from the closest.
    */
   void find_closest_waypoint_indices(
-    const double & x, const double & y, const size_t & n, std::vector<size_t> & indices
-  ) const;
+    const double & x, const double & y, const size_t & n,
+    std::vector<size_t> & indices) const override;
 
-  /**
-   * @brief Get the waypoint.
-   *
-   * @param index the index of the waypoint.
-   * @param x the x coordinate of the waypoint.
-   * @param y the y coordinate of the waypoint.
-   */
-  void get_waypoint(
-    const size_t & index, double & x, double & y
-  ) const;
+  void find_waypoints_within_radius(
+    const double & x, const double & y, const double & radius,
+    std::vector<size_t> & indices, std::vector<double> & distances,
+    const size_t & max_results = std::numeric_limits<size_t>::max()) const override;
+
+  static constexpr size_t LEAF_SIZE = 16;  // maximum number of waypoints in a leaf
 
 protected:
-  typedef std::unordered_map<WaypointKey, size_t, WaypointKeyHasher> WaypointMap;
+  // waypoints reordered into leaves
+  std::vector<double> leaf_x_;
+  std::vector<double> leaf_y_;
+  std::vector<size_t> leaf_indices_;  // original index of every reordered waypoint
 
-  WaypointMap map_;
-  Tree tree_;
-  std::vector<double> x_;
-  std::vector<double> y_;
+  // split nodes in implicit layout
+  std::vector<double> split_values_;
+  std::vector<uint8_t> split_dims_;
+  size_t depth_ = 0;  // number of split levels above the leaves
+
+  void build(
+    const size_t & node, const size_t & begin, const size_t & end,
+    const size_t & level);
+
+  /**
+   * @brief Depth-first search that visits the near child first and prunes the far child
+   * when the splitting line is further than the visitor bound.
+   *
+   * @tparam Visitor provides bound() (squared distance) and scan(begin, end, x, y).
+   */
+  template<typename Visitor>
+  void search(
+    const double & x, const double & y, const size_t & node, const size_t & begin,
+    const size_t & end, const size_t & level, Visitor & visitor) const;
 };
 }  // namespace racing_trajectory
 }  // namespace vehicle_model
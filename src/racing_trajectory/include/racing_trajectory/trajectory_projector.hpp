@@ -0,0 +1,134 @@
+// Copyright 2023 Haoru Xue
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#ifndef RACING_TRAJECTORY__TRAJECTORY_PROJECTOR_HPP_
+#define RACING_TRAJECTORY__TRAJECTORY_PROJECTOR_HPP_
+
+#include <memory>
+
+#include <lmpc_utils/primitives.hpp>
+
+#include "racing_trajectory/cubic_spline.hpp"
+
+namespace lmpc
+{
+namespace vehicle_model
+{
+namespace racing_trajectory
+{
+/**
+ * @brief Projects global positions onto the spline centerline of a closed trajectory.
+ * The foot point is found with a bounded Newton iteration on the squared distance,
+ * starting from an initial guess of the abscissa. All methods are const and thread-safe.
+ *
+ */
+class TrajectoryProjector
+{
+public:
+  typedef std::shared_ptr<TrajectoryProjector> SharedPtr;
+  typedef std::unique_ptr<TrajectoryProjector> UniquePtr;
+
+  /**
+   * @brief Construct a new TrajectoryProjector object.
+   *
+   * @param spline the centerline spline, parameterized by the abscissa.
+   * @param x_channel the spline channel of global x.
+   * @param y_channel the spline channel of global y.
+   * @param total_length total length of the closed trajectory.
+   */
+  TrajectoryProjector(
+    CubicSpline::SharedPtr spline, const size_t & x_channel,
+    const size_t & y_channel, const double & total_length);
+
+  /**
+   * @brief Find the abscissa of the closest centerline point.
+   *
+   * @param x the x coordinate of the point.
+   * @param y the y coordinate of the point.
+   * @param s0 initial guess of the abscissa.
+   * @param s output abscissa in [0, total_length).
+   * @return true if the iteration converged to a local minimum of the distance.
+   */
+  bool project(const double & x, const double & y, const double & s0, double & s) const;
+
+  /**
+   * @brief Find the abscissa of the closest centerline point, starting from a known segment.
+   * The segment search walks from the hint, which is constant time for nearby guesses.
+   *
+   * @param x the x coordinate of the point.
+   * @param y the y coordinate of the point.
+   * @param s0 initial guess of the abscissa.
+   * @param s output abscissa in [0, total_length).
+   * @param segment spline segment of the initial guess as input, and of the output as output.
+   * @return true if the iteration converged to a local minimum of the distance.
+   */
+  bool project(
+    const double & x, const double & y, const double & s0, double & s,
+    size_t & segment) const;
+
+  /**
+   * @brief Convert a global pose to a frenet pose.
+   *
+   * @param global_pose input global pose.
+   * @param s0 initial guess of the abscissa.
+   * @param frenet_pose output frenet pose.
+   * @return true if the projection converged.
+   */
+  bool global_to_frenet(
+    const Pose2D & global_pose, const double & s0,
+    FrenetPose2D & frenet_pose) const;
+
+  /**
+   * @brief Convert a global pose to a frenet pose, starting from a known segment.
+   *
+   * @param global_pose input global pose.
+   * @param s0 initial guess of the abscissa.
+   * @param frenet_pose output frenet pose.
+   * @param segment spline segment of the initial guess as input, and of the output as output.
+   * @return true if the projection converged.
+   */
+  bool global_to_frenet(
+    const Pose2D & global_pose, const double & s0,
+    FrenetPose2D & frenet_pose, size_t & segment) const;
+
+  /**
+   * @brief Evaluate the centerline position and heading at an abscissa.
+   *
+   * @param s the abscissa. Wrapped around the total length.
+   * @param pose output centerline pose.
+   */
+  void centerline_pose(const double & s, Pose2D & pose) const;
+
+  /**
+   * @brief Wrap an abscissa into [0, total_length).
+   *
+   * @param s the abscissa.
+   * @return double the wrapped abscissa.
+   */
+  double wrap_abscissa(const double & s) const;
+
+protected:
+  CubicSpline::SharedPtr spline_;
+  size_t x_channel_;
+  size_t y_channel_;
+  double total_length_;
+
+  size_t max_iterations_ = 20;  // maximum number of newton iterations
+  double tolerance_ = 1e-8;  // convergence tolerance on the abscissa step (m)
+};
+}  // namespace racing_trajectory
+}  // namespace vehicle_model
+}  // namespace lmpc
+#endif  // RACING_TRAJECTORY__TRAJECTORY_PROJECTOR_HPP_
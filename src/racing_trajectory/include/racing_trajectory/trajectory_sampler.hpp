@@ -0,0 +1,129 @@
+// Copyright 2023 Haoru Xue
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#ifndef RACING_TRAJECTORY__TRAJECTORY_SAMPLER_HPP_
+#define RACING_TRAJECTORY__TRAJECTORY_SAMPLER_HPP_
+
+#include <memory>
+#include <vector>
+
+#include "racing_trajectory/cubic_spline.hpp"
+
+namespace lmpc
+{
+namespace vehicle_model
+{
+namespace racing_trajectory
+{
+/**
+ * @brief Channels of the trajectory spline.
+ * Yaw and curvature are derived from the x and y channels.
+ *
+ */
+enum SplineChannel : size_t
+{
+  SPLINE_X = 0,
+  SPLINE_Y = 1,
+  SPLINE_LEFT = 2,
+  SPLINE_RIGHT = 3,
+  SPLINE_SPEED = 4,
+  NUM_SPLINE_CHANNELS = 5
+};
+
+/**
+ * @brief All trajectory channels at one abscissa.
+ *
+ */
+struct TrajectorySample
+{
+  double x = 0.0;
+  double y = 0.0;
+  double yaw = 0.0;
+  double curvature = 0.0;
+  double left = 0.0;  // distance to the left boundary, positive
+  double right = 0.0;  // distance to the right boundary, negative
+  double velocity = 0.0;
+};
+
+/**
+ * @brief All trajectory channels at many abscissas, stored as structure of arrays.
+ *
+ */
+struct TrajectorySamples
+{
+  std::vector<double> x;
+  std::vector<double> y;
+  std::vector<double> yaw;
+  std::vector<double> curvature;
+  std::vector<double> left;
+  std::vector<double> right;
+  std::vector<double> velocity;
+
+  void resize(const size_t & n);
+  size_t size() const;
+};
+
+/**
+ * @brief Evaluates every trajectory channel with a single knot search.
+ * Natively equivalent to the casadi interpolation functions of RacingTrajectory,
+ * without DM boxing or function dispatch. All methods are const and thread-safe.
+ *
+ */
+class TrajectorySampler
+{
+public:
+  typedef std::shared_ptr<TrajectorySampler> SharedPtr;
+  typedef std::unique_ptr<TrajectorySampler> UniquePtr;
+
+  /**
+   * @brief Construct a new TrajectorySampler object.
+   *
+   * @param spline spline with the channels in SplineChannel order.
+   * @param total_length total length of the closed trajectory.
+   */
+  TrajectorySampler(CubicSpline::SharedPtr spline, const double & total_length);
+
+  /**
+   * @brief Sample all channels at one abscissa.
+   *
+   * @param s the abscissa. Wrapped around the total length.
+   * @param sample output sample.
+   */
+  void sample(const double & s, TrajectorySample & sample) const;
+
+  /**
+   * @brief Sample all channels at a contiguous array of abscissas.
+   * Polynomial evaluation is vectorized over blocks of the input.
+   * Sorted inputs reuse the previous knot search.
+   *
+   * @param s pointer to the abscissas. Wrapped around the total length.
+   * @param n number of abscissas.
+   * @param samples output samples, resized to n.
+   */
+  void sample(const double * s, const size_t & n, TrajectorySamples & samples) const;
+
+  const CubicSpline & spline() const;
+
+protected:
+  CubicSpline::SharedPtr spline_;
+  double total_length_;
+
+  double wrap_abscissa(const double & s) const;
+  size_t find_segment(const double & s, const size_t & hint) const;
+};
+}  // namespace racing_trajectory
+}  // namespace vehicle_model
+}  // namespace lmpc
+#endif  // RACING_TRAJECTORY__TRAJECTORY_SAMPLER_HPP_
@@ -0,0 +1,174 @@
+// Copyright 2023 Haoru Xue
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#ifndef RACING_TRAJECTORY__UNIFORM_GRID_HPP_
+#define RACING_TRAJECTORY__UNIFORM_GRID_HPP_
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace lmpc
+{
+namespace vehicle_model
+{
+namespace racing_trajectory
+{
+/**
+ * @brief Geometry of a uniform grid of square cells, numbered row major, and the ring search
+ * around a query point. The grid does not own any point. Its users keep the points sorted
+ * by cell and scan the cells the search asks for.
+ *
+ */
+class UniformGrid
+{
+public:
+  UniformGrid() = default;
+
+  /**
+   * @brief Construct a new UniformGrid object covering a bounding box.
+   *
+   * @param x_min the lower x bound of the box.
+   * @param y_min the lower y bound of the box.
+   * @param width the x extent of the box.
+   * @param height the y extent of the box.
+   * @param cell_size the desired edge length of the cells.
+   * @param max_cells the cells grow until the grid has no more cells than this.
+   */
+  UniformGrid(
+    const double & x_min, const double & y_min, const double & width, const double & height,
+    const double & cell_size, const double & max_cells);
+
+  /**
+   * @brief Find the cell of a point. Points outside the grid go to the closest border cell.
+   *
+   * @param x the x coordinate of the point.
+   * @param y the y coordinate of the point.
+   * @return size_t the row major cell index.
+   */
+  size_t cell(const double & x, const double & y) const;
+
+  /**
+   * @brief Check if a point is inside the grid.
+   *
+   * @param x the x coordinate of the point.
+   * @param y the y coordinate of the point.
+   * @return true if the point is in one of the cells.
+   */
+  bool contains(const double & x, const double & y) const;
+
+  size_t num_cells() const;
+  double cell_size() const;
+
+  /**
+   * @brief Scan rings of cells around a point until no point in the unscanned cells can beat
+   * the visitor bound.
+   *
+   * @tparam Visitor provides bound(), the squared distance a point has to beat.
+   * @tparam ScanCells callable scanning the cells [begin, end), which are in the same row.
+   * @param x the x coordinate of the query.
+   * @param y the y coordinate of the query.
+   * @param max_scanned_cells the search gives up after scanning this many cells.
+   * @param visitor the visitor.
+   * @param scan_cells the cell scanner.
+   * @return false if the search gave up and the visitor holds no valid result.
+   */
+  template<typename Visitor, typename ScanCells>
+  bool search(
+    const double & x, const double & y, const size_t & max_scanned_cells,
+    const Visitor & visitor, ScanCells && scan_cells) const;
+
+  /**
+   * @brief Median distance between consecutive distinct points of a polyline.
+   *
+   * @param x the x coordinates of the points.
+   * @param y the y coordinates of the points.
+   * @return double the median spacing, or zero if all the points are the same.
+   */
+  static double median_spacing(const std::vector<double> & x, const std::vector<double> & y);
+
+protected:
+  double x_min_ = 0.0;
+  double y_min_ = 0.0;
+  double cell_size_ = 1.0;
+  int64_t num_cols_ = 0;
+  int64_t num_rows_ = 0;
+};
+
+template<typename Visitor, typename ScanCells>
+bool UniformGrid::search(
+  const double & x, const double & y, const size_t & max_scanned_cells,
+  const Visitor & visitor, ScanCells && scan_cells) const
+{
+  const double fx = std::floor((x - x_min_) / cell_size_);
+  const double fy = std::floor((y - y_min_) / cell_size_);
+  // rings closer than the chebyshev distance to the grid are empty
+  const double gap = std::max(
+    {0.0, -fx, fx - static_cast<double>(num_cols_ - 1), -fy,
+      fy - static_cast<double>(num_rows_ - 1)});
+  if (!(gap <= static_cast<double>(num_cols_ + num_rows_))) {
+    // far away from every cell, or not finite
+    return false;
+  }
+  const auto ci = static_cast<int64_t>(fx);
+  const auto cj = static_cast<int64_t>(fy);
+  size_t num_scanned = 0;
+  for (auto r = static_cast<int64_t>(gap); ; r++) {
+    const auto i_lo = std::max<int64_t>(ci - r, 0);
+    const auto i_hi = std::min<int64_t>(ci + r, num_cols_ - 1);
+    // bottom and top rows of the ring, whose cells are contiguous. ring 0 is a single cell.
+    for (const auto & j : {cj - r, r > 0 ? cj + r : int64_t{-1}}) {
+      if (j >= 0 && j < num_rows_) {
+        const auto row = static_cast<size_t>(j * num_cols_);
+        scan_cells(row + static_cast<size_t>(i_lo), row + static_cast<size_t>(i_hi) + 1);
+        num_scanned += static_cast<size_t>(i_hi - i_lo + 1);
+      }
+    }
+    // left and right columns of the ring, without the corners
+    for (const auto & i : {ci - r, ci + r}) {
+      if (r > 0 && i >= 0 && i < num_cols_) {
+        for (auto j = std::max<int64_t>(cj - r + 1, 0);
+          j <= std::min<int64_t>(cj + r - 1, num_rows_ - 1); j++)
+        {
+          const auto c = static_cast<size_t>(j * num_cols_ + i);
+          scan_cells(c, c + 1);
+          num_scanned++;
+        }
+      }
+    }
+    if (ci - r <= 0 && ci + r >= num_cols_ - 1 && cj - r <= 0 && cj + r >= num_rows_ - 1) {
+      // every cell is scanned
+      return true;
+    }
+    // every unscanned point is outside the square of scanned cells
+    const double reach = std::min(
+      {x - (x_min_ + static_cast<double>(ci - r) * cell_size_),
+        x_min_ + static_cast<double>(ci + r + 1) * cell_size_ - x,
+        y - (y_min_ + static_cast<double>(cj - r) * cell_size_),
+        y_min_ + static_cast<double>(cj + r + 1) * cell_size_ - y});
+    if (reach > 0.0 && reach * reach >= visitor.bound()) {
+      return true;
+    }
+    if (num_scanned > max_scanned_cells) {
+      return false;
+    }
+  }
+}
+}  // namespace racing_trajectory
+}  // namespace vehicle_model
+}  // namespace lmpc
+#endif  // RACING_TRAJECTORY__UNIFORM_GRID_HPP_
@@ -0,0 +1,212 @@
+// Copyright 2023 Haoru Xue
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#ifndef RACING_TRAJECTORY__WAYPOINT_INDEX_HPP_
+#define RACING_TRAJECTORY__WAYPOINT_INDEX_HPP_
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <utility>
+#include <vector>
+
+namespace lmpc
+{
+namespace vehicle_model
+{
+namespace racing_trajectory
+{
+/**
+ * @brief Spatial index structures for closest waypoint lookup.
+ *
+ */
+enum class WaypointIndexType : uint8_t
+{
+  KD_TREE = 0,  // balanced 2D tree, good for any point distribution
+  GRID = 1  // uniform grid, near-constant time on track polylines
+};
+
+/**
+ * @brief Common interface of the closest waypoint lookup structures.
+ * All queries are const and thread-safe.
+ *
+ */
+class WaypointIndex
+{
+public:
+  typedef std::shared_ptr<WaypointIndex> SharedPtr;
+  typedef std::unique_ptr<WaypointIndex> UniquePtr;
+
+  virtual ~WaypointIndex() = default;
+
+  /**
+   * @brief Find the closest waypoint to a given point.
+   *
+   * @param x the x coordinate of the point.
+   * @param y the y coordinate of the point.
+   * @return size_t the index of the closest waypoint.
+   */
+  virtual size_t find_closest_waypoint_index(const double & x, const double & y) const = 0;
+
+  /**
+   * @brief Find the n closest waypoints to a given point.
+   *
+   * @param x the x coordinate of the point.
+   * @param y the y coordinate of the point.
+   * @param n the number of waypoints to find.
+   * @param indices the indices of the closest waypoints, appended from the closest.
+   */
+  virtual void find_closest_waypoint_indices(
+    const double & x, const double & y, const size_t & n,
+    std::vector<size_t> & indices) const = 0;
+
+  /**
+   * @brief Find the waypoints closer than a radius to a given point.
+   *
+   * @param x the x coordinate of the point.
+   * @param y the y coordinate of the point.
+   * @param radius the search radius.
+   * @param indices the indices of the waypoints, appended from the closest.
+   * @param distances the distances of the waypoints, appended from the closest.
+   * @param max_results if the radius holds more waypoints, only the closest are returned.
+   */
+  virtual void find_waypoints_within_radius(
+    const double & x, const double & y, const double & radius,
+    std::vector<size_t> & indices, std::vector<double> & distances,
+    const size_t & max_results = std::numeric_limits<size_t>::max()) const = 0;
+
+  /**
+   * @brief Get the waypoint.
+   *
+   * @param index the index of the waypoint.
+   * @param x the x coordinate of the waypoint.
+   * @param y the y coordinate of the waypoint.
+   */
+  void get_waypoint(const size_t & index, double & x, double & y) const;
+
+  size_t size() const;
+
+protected:
+  WaypointIndex(const std::vector<double> & x, const std::vector<double> & y);
+
+  std::vector<double> x_;
+  std::vector<double> y_;
+};
+
+/**
+ * @brief Create a waypoint index.
+ *
+ * @param type the index structure.
+ * @param x the x coordinates of the waypoints.
+ * @param y the y coordinates of the waypoints.
+ * @return WaypointIndex::UniquePtr the index.
+ */
+WaypointIndex::UniquePtr make_waypoint_index(
+  const WaypointIndexType & type, const std::vector<double> & x, const std::vector<double> & y);
+
+/**
+ * @brief The n closest candidates seen so far, sorted by squared distance.
+ *
+ */
+class NeighborBuffer
+{
+public:
+  explicit NeighborBuffer(const size_t & n)
+  : n_(n)
+  {
+    neighbors_.reserve(n);
+  }
+
+  // squared distance a candidate has to beat to be kept
+  double bound() const
+  {
+    return neighbors_.size() < n_ ? std::numeric_limits<double>::infinity() :
+           neighbors_.back().first;
+  }
+
+  void push(const double & d2, const size_t & index)
+  {
+    if (d2 >= bound()) {
+      return;
+    }
+    if (neighbors_.size() == n_) {
+      neighbors_.pop_back();
+    }
+    const std::pair<double, size_t> neighbor{d2, index};
+    neighbors_.insert(std::upper_bound(neighbors_.begin(), neighbors_.end(), neighbor), neighbor);
+  }
+
+  const std::vector<std::pair<double, size_t>> & neighbors() const
+  {
+    return neighbors_;
+  }
+
+private:
+  size_t n_;
+  std::vector<std::pair<double, size_t>> neighbors_;
+};
+
+/**
+ * @brief The candidates closer than a radius, sorted by squared distance when complete.
+ *
+ */
+class RadiusBuffer
+{
+public:
+  explicit RadiusBuffer(const double & radius)
+  : radius_sq_(radius * radius)
+  {
+  }
+
+  // squared distance a candidate has to beat to be kept
+  double bound() const
+  {
+    return radius_sq_;
+  }
+
+  void push(const double & d2, const size_t & index)
+  {
+    if (d2 < radius_sq_) {
+      neighbors_.emplace_back(d2, index);
+    }
+  }
+
+  /**
+   * @brief Sort the candidates and keep the closest.
+   *
+   * @param max_results the number of candidates to keep.
+   * @return const std::vector<std::pair<double, size_t>>& the sorted candidates.
+   */
+  const std::vector<std::pair<double, size_t>> & sort(const size_t & max_results)
+  {
+    if (neighbors_.size() > max_results) {
+      std::nth_element(
+        neighbors_.begin(), neighbors_.begin() + max_results, neighbors_.end());
+      neighbors_.resize(max_results);
+    }
+    std::sort(neighbors_.begin(), neighbors_.end());
+    return neighbors_;
+  }
+
+private:
+  double radius_sq_;
+  std::vector<std::pair<double, size_t>> neighbors_;
+};
+}  // namespace racing_trajectory
+}  // namespace vehicle_model
+}  // namespace lmpc
+#endif  // RACING_TRAJECTORY__WAYPOINT_INDEX_HPP_
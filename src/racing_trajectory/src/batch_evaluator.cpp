@@ -0,0 +1,135 @@
+// Copyright 2023 Haoru Xue
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#include <algorithm>
+#include <atomic>
+#include <stdexcept>
+#include <string>
+#include <utility>
+
+#include "racing_trajectory/batch_evaluator.hpp"
+
+namespace lmpc
+{
+namespace vehicle_model
+{
+namespace racing_trajectory
+{
+BatchEvaluator::BatchEvaluator(const casadi::Function & f, Executor::SharedPtr executor)
+: f_(f), executor_(std::move(executor))
+{
+  for (casadi_int i = 0; i < f_.n_in(); i++) {
+    if (!f_.sparsity_in(i).is_dense()) {
+      throw std::invalid_argument("the inputs of " + f_.name() + " must be dense.");
+    }
+    input_sizes_.push_back(static_cast<size_t>(f_.nnz_in(i)));
+  }
+  for (casadi_int i = 0; i < f_.n_out(); i++) {
+    if (!f_.sparsity_out(i).is_dense()) {
+      throw std::invalid_argument("the outputs of " + f_.name() + " must be dense.");
+    }
+    output_sizes_.push_back(static_cast<size_t>(f_.nnz_out(i)));
+  }
+}
+
+BatchEvaluator::~BatchEvaluator()
+{
+  for (const auto & workspace : workspaces_) {
+    f_.release(workspace->mem);
+  }
+}
+
+void BatchEvaluator::evaluate(
+  const std::vector<const double *> & inputs, const size_t & num_samples,
+  const std::vector<double *> & outputs) const
+{
+  if (inputs.size() != input_sizes_.size() || outputs.size() != output_sizes_.size()) {
+    throw std::invalid_argument("one pointer is needed for every input and output.");
+  }
+  const size_t num_chunks = (num_samples + CHUNK_SIZE - 1) / CHUNK_SIZE;
+  std::atomic<bool> succeeded = true;
+  executor_->parallel_for(
+    num_chunks, [&](const size_t & chunk) {
+      if (!evaluate_chunk(
+        inputs, chunk * CHUNK_SIZE, std::min(num_samples, (chunk + 1) * CHUNK_SIZE), outputs))
+      {
+        succeeded = false;
+      }
+    });
+  if (!succeeded) {
+    throw std::runtime_error("failed to evaluate " + f_.name() + " on a sample.");
+  }
+}
+
+const casadi::Function & BatchEvaluator::function() const
+{
+  return f_;
+}
+
+BatchEvaluator::WorkspaceLease BatchEvaluator::checkout() const
+{
+  {
+    std::lock_guard<std::mutex> lock(workspace_mutex_);
+    if (!workspaces_.empty()) {
+      WorkspaceLease workspace(workspaces_.back().release(), WorkspaceReturner{this});
+      workspaces_.pop_back();
+      return workspace;
+    }
+  }
+  auto workspace = std::make_unique<Workspace>();
+  workspace->arg.resize(f_.sz_arg());
+  workspace->res.resize(f_.sz_res());
+  workspace->iw.resize(f_.sz_iw());
+  workspace->w.resize(f_.sz_w());
+  workspace->mem = f_.checkout();
+  return WorkspaceLease(workspace.release(), WorkspaceReturner{this});
+}
+
+void BatchEvaluator::WorkspaceReturner::operator()(Workspace * workspace) const noexcept
+{
+  std::unique_ptr<Workspace> owned(workspace);
+  try {
+    std::lock_guard<std::mutex> lock(evaluator->workspace_mutex_);
+    evaluator->workspaces_.push_back(std::move(owned));
+  } catch (...) {
+    // the pool cannot grow, so give the memory slot back to the function instead
+    evaluator->f_.release(owned->mem);
+  }
+}
+
+bool BatchEvaluator::evaluate_chunk(
+  const std::vector<const double *> & inputs, const size_t & begin, const size_t & end,
+  const std::vector<double *> & outputs) const
+{
+  auto workspace = checkout();
+  for (size_t j = begin; j < end; j++) {
+    for (size_t i = 0; i < inputs.size(); i++) {
+      workspace->arg[i] = inputs[i] ? inputs[i] + j * input_sizes_[i] : nullptr;
+    }
+    for (size_t i = 0; i < outputs.size(); i++) {
+      workspace->res[i] = outputs[i] ? outputs[i] + j * output_sizes_[i] : nullptr;
+    }
+    if (f_(
+        workspace->arg.data(), workspace->res.data(), workspace->iw.data(),
+        workspace->w.data(), workspace->mem) != 0)
+    {
+      return false;
+    }
+  }
+  return true;
+}
+}  // namespace racing_trajectory
+}  // namespace vehicle_model
+}  // namespace lmpc
@@ -0,0 +1,154 @@
+// Copyright 2023 Haoru Xue
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#include <algorithm>
+#include <stdexcept>
+
+#include "racing_trajectory/cubic_spline.hpp"
+
+namespace lmpc
+{
+namespace vehicle_model
+{
+namespace racing_trajectory
+{
+CubicSpline::CubicSpline(
+  const std::vector<double> & knots,
+  const std::vector<std::vector<double>> & channels)
+: knots_(knots), num_channels_(channels.size())
+{
+  if (knots_.size() < 4) {
+    throw std::invalid_argument("at least 4 knots are required for cubic interpolation.");
+  }
+  for (size_t i = 1; i < knots_.size(); i++) {
+    if (!(knots_[i] > knots_[i - 1])) {
+      throw std::invalid_argument("knots must be strictly increasing.");
+    }
+  }
+  coeffs_.resize(num_segments() * num_channels_ * 4);
+  for (size_t j = 0; j < num_channels_; j++) {
+    if (channels[j].size() != knots_.size()) {
+      throw std::invalid_argument("every channel must have the same size as the knots.");
+    }
+    fit_channel(j, channels[j]);
+  }
+}
+
+size_t CubicSpline::num_channels() const
+{
+  return num_channels_;
+}
+
+size_t CubicSpline::num_segments() const
+{
+  return knots_.size() - 1;
+}
+
+const std::vector<double> & CubicSpline::knots() const
+{
+  return knots_;
+}
+
+size_t CubicSpline::find_segment(const double & s) const
+{
+  const auto it = std::upper_bound(knots_.begin() + 1, knots_.end() - 1, s);
+  return static_cast<size_t>(it - knots_.begin()) - 1;
+}
+
+size_t CubicSpline::find_segment(const double & s, const size_t & hint) const
+{
+  size_t i = std::min(hint, num_segments() - 1);
+  while (i > 0 && s < knots_[i]) {
+    i--;
+  }
+  while (i + 1 < num_segments() && s >= knots_[i + 1]) {
+    i++;
+  }
+  return i;
+}
+
+double CubicSpline::evaluate(
+  const size_t & segment, const size_t & channel, const double & s,
+  double * d1, double * d2) const
+{
+  const double * c = coefficients(segment) + 4 * channel;
+  const double u = s - knots_[segment];
+  if (d1) {
+    *d1 = c[1] + u * (2.0 * c[2] + u * 3.0 * c[3]);
+  }
+  if (d2) {
+    *d2 = 2.0 * c[2] + u * 6.0 * c[3];
+  }
+  return c[0] + u * (c[1] + u * (c[2] + u * c[3]));
+}
+
+const double * CubicSpline::coefficients(const size_t & segment) const
+{
+  return coeffs_.data() + segment * num_channels_ * 4;
+}
+
+void CubicSpline::fit_channel(const size_t & channel, const std::vector<double> & values)
+{
+  // solve for the second derivatives M at the knots.
+  // the not-a-knot conditions (continuous third derivative at the second and the
+  // second last knots) are eliminated into the first and the last interior rows,
+  // which leaves a tridiagonal system on M[1] ... M[n - 2].
+  const size_t n = knots_.size();
+  std::vector<double> h(n - 1);
+  std::vector<double> slope(n - 1);
+  for (size_t i = 0; i < n - 1; i++) {
+    h[i] = knots_[i + 1] - knots_[i];
+    slope[i] = (values[i + 1] - values[i]) / h[i];
+  }
+
+  const size_t m = n - 2;
+  std::vector<double> lower(m), diag(m), upper(m), rhs(m);
+  for (size_t r = 0; r < m; r++) {
+    const size_t i = r + 1;
+    lower[r] = h[i - 1];
+    diag[r] = 2.0 * (h[i - 1] + h[i]);
+    upper[r] = h[i];
+    rhs[r] = 6.0 * (slope[i] - slope[i - 1]);
+  }
+  diag[0] += h[0] * (h[0] + h[1]) / h[1];
+  upper[0] -= h[0] * h[0] / h[1];
+  diag[m - 1] += h[n - 2] * (h[n - 3] + h[n - 2]) / h[n - 3];
+  lower[m - 1] -= h[n - 2] * h[n - 2] / h[n - 3];
+
+  // thomas algorithm
+  for (size_t r = 1; r < m; r++) {
+    const double w = lower[r] / diag[r - 1];
+    diag[r] -= w * upper[r - 1];
+    rhs[r] -= w * rhs[r - 1];
+  }
+  std::vector<double> M(n);
+  M[m] = rhs[m - 1] / diag[m - 1];
+  for (size_t r = m - 1; r-- > 0; ) {
+    M[r + 1] = (rhs[r] - upper[r] * M[r + 2]) / diag[r];
+  }
+  M[0] = ((h[0] + h[1]) * M[1] - h[0] * M[2]) / h[1];
+  M[n - 1] = ((h[n - 3] + h[n - 2]) * M[n - 2] - h[n - 2] * M[n - 3]) / h[n - 3];
+
+  for (size_t i = 0; i < n - 1; i++) {
+    double * c = coeffs_.data() + (i * num_channels_ + channel) * 4;
+    c[0] = values[i];
+    c[1] = slope[i] - h[i] * (2.0 * M[i] + M[i + 1]) / 6.0;
+    c[2] = M[i] / 2.0;
+    c[3] = (M[i + 1] - M[i]) / (6.0 * h[i]);
+  }
+}
+}  // namespace racing_trajectory
+}  // namespace vehicle_model
+}  // namespace lmpc
@@ -0,0 +1,165 @@
+// Copyright 2023 Haoru Xue
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#include <pthread.h>
+#include <sched.h>
+
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <unordered_map>
+
+#include <tbb/parallel_for.h>
+#include <tbb/task_arena.h>
+#include <tbb/task_scheduler_observer.h>
+
+#include "racing_trajectory/executor.hpp"
+
+namespace lmpc
+{
+namespace vehicle_model
+{
+namespace racing_trajectory
+{
+namespace
+{
+// pins the worker threads while they are in an arena. the workers belong to the process wide
+// pool, so they get their previous affinity back when they leave. the calling threads keep
+// their affinity.
+class ArenaPinner : public tbb::task_scheduler_observer
+{
+public:
+  ArenaPinner(tbb::task_arena & arena, const std::vector<int> & cpus)
+  : tbb::task_scheduler_observer(arena)
+  {
+    CPU_ZERO(&cpus_);
+    for (const auto & cpu : cpus) {
+      if (cpu < 0 || cpu >= CPU_SETSIZE) {
+        throw std::invalid_argument("the executor core index is out of range.");
+      }
+      CPU_SET(cpu, &cpus_);
+    }
+    observe(true);
+  }
+
+  ~ArenaPinner()
+  {
+    observe(false);
+  }
+
+  void on_scheduler_entry(bool is_worker) override
+  {
+    if (!is_worker) {
+      return;
+    }
+    cpu_set_t previous;
+    if (pthread_getaffinity_np(pthread_self(), sizeof(previous), &previous) != 0) {
+      return;
+    }
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      previous_cpus_[std::this_thread::get_id()] = previous;
+    }
+    pthread_setaffinity_np(pthread_self(), sizeof(cpus_), &cpus_);
+  }
+
+  void on_scheduler_exit(bool is_worker) override
+  {
+    if (!is_worker) {
+      return;
+    }
+    cpu_set_t previous;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      const auto it = previous_cpus_.find(std::this_thread::get_id());
+      if (it == previous_cpus_.end()) {
+        return;
+      }
+      previous = it->second;
+      previous_cpus_.erase(it);
+    }
+    pthread_setaffinity_np(pthread_self(), sizeof(previous), &previous);
+  }
+
+private:
+  cpu_set_t cpus_;
+  std::mutex mutex_;  // guards previous_cpus_
+  std::unordered_map<std::thread::id, cpu_set_t> previous_cpus_;  // of the workers in the arena
+};
+
+tbb::task_arena::priority to_tbb_priority(const ExecutorPriority & priority)
+{
+  switch (priority) {
+    case ExecutorPriority::LOW:
+      return tbb::task_arena::priority::low;
+    case ExecutorPriority::HIGH:
+      return tbb::task_arena::priority::high;
+    default:
+      return tbb::task_arena::priority::normal;
+  }
+}
+}  // namespace
+
+struct Executor::Arena
+{
+  tbb::task_arena arena;
+  std::unique_ptr<ArenaPinner> pinner;
+};
+
+Executor::Executor(const ExecutorConfig & config)
+: config_(config)
+{
+  if (config_.type == ExecutorType::SERIAL) {
+    return;
+  }
+  const int num_threads = config_.num_threads > 0 ?
+    static_cast<int>(config_.num_threads) : tbb::task_arena::automatic;
+  arena_ = std::make_unique<Arena>();
+  arena_->arena.initialize(num_threads, 1, to_tbb_priority(config_.priority));
+  if (!config_.cpus.empty()) {
+    arena_->pinner = std::make_unique<ArenaPinner>(arena_->arena, config_.cpus);
+  }
+}
+
+Executor::~Executor() = default;
+
+void Executor::parallel_for(
+  const size_t & n,
+  const std::function<void(const size_t &)> & body) const
+{
+  if (!arena_ || n <= 1) {
+    for (size_t i = 0; i < n; i++) {
+      body(i);
+    }
+    return;
+  }
+  arena_->arena.execute(
+    [&]() {
+      tbb::parallel_for(size_t(0), n, [&body](const size_t & i) {body(i);});
+    });
+}
+
+size_t Executor::concurrency() const
+{
+  return arena_ ? static_cast<size_t>(arena_->arena.max_concurrency()) : 1;
+}
+
+const ExecutorConfig & Executor::config() const
+{
+  return config_;
+}
+}  // namespace racing_trajectory
+}  // namespace vehicle_model
+}  // namespace lmpc
@@ -0,0 +1,190 @@
+// Copyright 2023 Haoru Xue
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#include "racing_trajectory/feature_kd_tree.hpp"
+
+#include <Eigen/Dense>
+
+#include <algorithm>
+#include <cmath>
+#include <numeric>
+#include <stdexcept>
+
+#include "racing_trajectory/waypoint_index.hpp"
+
+namespace lmpc
+{
+namespace vehicle_model
+{
+namespace racing_trajectory
+{
+namespace
+{
+constexpr Eigen::Index MAX_LEAF_SIZE = FeatureKDTree::LEAF_SIZE;
+
+// fixed capacity array lives on the stack
+typedef Eigen::Array<double, 1, Eigen::Dynamic, Eigen::RowMajor, 1, MAX_LEAF_SIZE> LeafArray;
+
+template<typename Buffer>
+struct BufferVisitor
+{
+  Buffer buffer;
+
+  double bound() const
+  {
+    return buffer.bound();
+  }
+
+  void scan(const LeafArray & d2, const size_t & begin)
+  {
+    for (Eigen::Index k = 0; k < d2.size(); k++) {
+      buffer.push(d2(k), begin + static_cast<size_t>(k));
+    }
+  }
+};
+}  // namespace
+
+FeatureKDTree::FeatureKDTree(const std::vector<double> & points, const size_t & num_dims)
+: num_dims_(num_dims)
+{
+  if (num_dims_ == 0 || points.size() % num_dims_ != 0) {
+    throw std::invalid_argument("the points must have num_dims coordinates each.");
+  }
+  const size_t n = points.size() / num_dims_;
+  // halve until the largest leaf, ceil(n / 2^depth), fits
+  while (((n + (1ul << depth_) - 1) >> depth_) > LEAF_SIZE) {
+    depth_++;
+  }
+  leaf_indices_.resize(n);
+  std::iota(leaf_indices_.begin(), leaf_indices_.end(), 0);
+  split_values_.resize((1ul << depth_) - 1);
+  split_dims_.resize(split_values_.size());
+  if (n > 0) {
+    build(points, 0, 0, n, 0);
+  }
+  leaf_points_.resize(points.size());
+  for (size_t i = 0; i < n; i++) {
+    std::copy_n(
+      points.begin() + static_cast<std::ptrdiff_t>(leaf_indices_[i] * num_dims_), num_dims_,
+      leaf_points_.begin() + static_cast<std::ptrdiff_t>(i * num_dims_));
+  }
+}
+
+void FeatureKDTree::find_closest_indices(
+  const double * query, const size_t & n,
+  std::vector<size_t> & indices) const
+{
+  if (n == 0 || leaf_indices_.empty()) {
+    return;
+  }
+  BufferVisitor<NeighborBuffer> visitor{NeighborBuffer(std::min(n, leaf_indices_.size()))};
+  search(query, 0, 0, leaf_indices_.size(), 0, visitor);
+  for (const auto & neighbor : visitor.buffer.neighbors()) {
+    indices.push_back(leaf_indices_[neighbor.second]);
+  }
+}
+
+void FeatureKDTree::find_within_radius(
+  const double * query, const double & radius,
+  std::vector<size_t> & indices, std::vector<double> & distances,
+  const size_t & max_results) const
+{
+  if (max_results == 0 || leaf_indices_.empty()) {
+    return;
+  }
+  BufferVisitor<RadiusBuffer> visitor{RadiusBuffer(radius)};
+  search(query, 0, 0, leaf_indices_.size(), 0, visitor);
+  for (const auto & neighbor : visitor.buffer.sort(max_results)) {
+    indices.push_back(leaf_indices_[neighbor.second]);
+    distances.push_back(std::sqrt(neighbor.first));
+  }
+}
+
+size_t FeatureKDTree::size() const
+{
+  return leaf_indices_.size();
+}
+
+size_t FeatureKDTree::num_dims() const
+{
+  return num_dims_;
+}
+
+void FeatureKDTree::build(
+  const std::vector<double> & points, const size_t & node, const size_t & begin,
+  const size_t & end, const size_t & level)
+{
+  if (level == depth_) {
+    return;
+  }
+  // split the widest extent of the bounding box at the median
+  uint32_t dim = 0;
+  double widest = -1.0;
+  for (size_t d = 0; d < num_dims_; d++) {
+    const auto [lo, hi] = std::minmax_element(
+      leaf_indices_.begin() + begin, leaf_indices_.begin() + end,
+      [&](const size_t & a, const size_t & b) {
+        return points[a * num_dims_ + d] < points[b * num_dims_ + d];
+      });
+    const double extent = points[*hi * num_dims_ + d] - points[*lo * num_dims_ + d];
+    if (extent > widest) {
+      widest = extent;
+      dim = static_cast<uint32_t>(d);
+    }
+  }
+  const size_t mid = begin + (end - begin) / 2;
+  std::nth_element(
+    leaf_indices_.begin() + begin, leaf_indices_.begin() + mid, leaf_indices_.begin() + end,
+    [&](const size_t & a, const size_t & b) {
+      return points[a * num_dims_ + dim] < points[b * num_dims_ + dim];
+    });
+  split_values_[node] = points[leaf_indices_[mid] * num_dims_ + dim];
+  split_dims_[node] = dim;
+  build(points, 2 * node + 1, begin, mid, level + 1);
+  build(points, 2 * node + 2, mid, end, level + 1);
+}
+
+template<typename Visitor>
+void FeatureKDTree::search(
+  const double * query, const size_t & node, const size_t & begin,
+  const size_t & end, const size_t & level, Visitor & visitor) const
+{
+  if (level == depth_) {
+    const auto m = static_cast<Eigen::Index>(end - begin);
+    const auto dims = static_cast<Eigen::Index>(num_dims_);
+    const Eigen::Map<const Eigen::MatrixXd> leaf(leaf_points_.data() + begin * num_dims_, dims, m);
+    const Eigen::Map<const Eigen::VectorXd> q(query, dims);
+    const LeafArray d2 = (leaf.colwise() - q).colwise().squaredNorm().array();
+    visitor.scan(d2, begin);
+    return;
+  }
+  // left holds coordinates <= split and right holds coordinates >= split
+  const size_t mid = begin + (end - begin) / 2;
+  const double diff = query[split_dims_[node]] - split_values_[node];
+  if (diff < 0.0) {
+    search(query, 2 * node + 1, begin, mid, level + 1, visitor);
+    if (diff * diff < visitor.bound()) {
+      search(query, 2 * node + 2, mid, end, level + 1, visitor);
+    }
+  } else {
+    search(query, 2 * node + 2, mid, end, level + 1, visitor);
+    if (diff * diff < visitor.bound()) {
+      search(query, 2 * node + 1, begin, mid, level + 1, visitor);
+    }
+  }
+}
+}  // namespace racing_trajectory
+}  // namespace vehicle_model
+}  // namespace lmpc
@@ -0,0 +1,121 @@
+// Copyright 2023 Haoru Xue
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+
+#include "racing_trajectory/frenet_tracker.hpp"
+
+namespace lmpc
+{
+namespace vehicle_model
+{
+namespace racing_trajectory
+{
+FrenetTracker::FrenetTracker(
+  RacingTrajectory::SharedPtr trajectory,
+  const size_t & window_segments,
+  const double & max_jump_distance)
+: window_segments_(window_segments), max_jump_distance_(max_jump_distance)
+{
+  set_trajectory(trajectory);
+}
+
+bool FrenetTracker::update(const Pose2D & global_pose, FrenetPose2D & frenet_pose)
+{
+  if (!initialized_ || distance(global_pose.position, position_) > max_jump_distance_) {
+    relocalize(global_pose, frenet_pose);
+    return false;
+  }
+
+  const double & L = trajectory_->total_length();
+  size_t segment = segment_;
+  const bool converged =
+    trajectory_->projector().global_to_frenet(global_pose, s_, frenet_pose, segment);
+
+  // the foot point should not slide much further than the vehicle moved.
+  // otherwise the projection fell onto another part of the track.
+  const double ds = frenet_pose.position.s - s_;
+  const double ds_wrapped = std::min(std::fabs(ds), L - std::fabs(ds));
+  const double dq = distance(global_pose.position, position_);
+  if (!converged || ds_wrapped > 2.0 * dq + window_length_) {
+    relocalize(global_pose, frenet_pose);
+    return false;
+  }
+
+  if (ds < -L / 2.0) {
+    laps_++;
+  } else if (ds > L / 2.0) {
+    laps_--;
+  }
+  segment_ = segment;
+  s_ = frenet_pose.position.s;
+  position_ = global_pose.position;
+  return true;
+}
+
+void FrenetTracker::set_trajectory(RacingTrajectory::SharedPtr trajectory)
+{
+  if (!trajectory) {
+    throw std::invalid_argument("the trajectory to track is null.");
+  }
+  trajectory_ = trajectory;
+  const auto & spline = trajectory_->sampler().spline();
+  window_length_ = static_cast<double>(window_segments_) *
+    (spline.knots().back() - spline.knots().front()) / static_cast<double>(spline.num_segments());
+  reset();
+}
+
+void FrenetTracker::reset()
+{
+  initialized_ = false;
+  laps_ = 0;
+}
+
+bool FrenetTracker::initialized() const
+{
+  return initialized_;
+}
+
+size_t FrenetTracker::segment() const
+{
+  return segment_;
+}
+
+int64_t FrenetTracker::laps() const
+{
+  return laps_;
+}
+
+const RacingTrajectory & FrenetTracker::trajectory() const
+{
+  return *trajectory_;
+}
+
+void FrenetTracker::relocalize(const Pose2D & global_pose, FrenetPose2D & frenet_pose)
+{
+  const double s0 = trajectory_->closest_waypoint_abscissa(
+    global_pose.position.x, global_pose.position.y);
+  size_t segment = trajectory_->sampler().spline().find_segment(s0);
+  trajectory_->projector().global_to_frenet(global_pose, s0, frenet_pose, segment);
+  initialized_ = true;
+  segment_ = segment;
+  s_ = frenet_pose.position.s;
+  position_ = global_pose.position;
+}
+}  // namespace racing_trajectory
+}  // namespace vehicle_model
+}  // namespace lmpc
@@ -0,0 +1,231 @@
+// Copyright 2023 Haoru Xue
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <array>
+#include <cerrno>
+#include <cstring>
+#include <limits>
+#include <stdexcept>
+
+#include <lmpc_utils/hash.hpp>
+
+#include "racing_trajectory/lap_archive.hpp"
+
+namespace lmpc
+{
+namespace vehicle_model
+{
+namespace racing_trajectory
+{
+namespace
+{
+// size of an entry with its samples, or 0 if the header is not valid
+uint64_t entry_size(const LapArchiveEntryHeader & header)
+{
+  if (std::memcmp(header.magic, LAP_ARCHIVE_ENTRY_MAGIC, sizeof(header.magic)) != 0) {
+    return 0;
+  }
+  // the four matrices must not overflow the entry size
+  constexpr auto max_elements = std::numeric_limits<uint64_t>::max() / sizeof(double) / 4;
+  uint64_t num_elements = 0;
+  for (const auto & rows : header.rows) {
+    if (header.num_samples > 0 && rows > max_elements / header.num_samples) {
+      return 0;
+    }
+    num_elements += rows * header.num_samples;
+  }
+  const auto size = sizeof(LapArchiveEntryHeader) + num_elements * sizeof(double);
+  return size == header.entry_size ? size : 0;
+}
+
+void write_all(const int & fd, const void * data, size_t size, const std::string & file_name)
+{
+  const auto * bytes = static_cast<const char *>(data);
+  while (size > 0) {
+    const auto written = ::write(fd, bytes, size);
+    if (written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      throw std::runtime_error("failed to append to lap archive " + file_name);
+    }
+    bytes += written;
+    size -= static_cast<size_t>(written);
+  }
+}
+}  // namespace
+
+LapArchive::LapArchive(const std::string & file_name)
+: file_name_(file_name)
+{
+  const int fd = ::open(file_name.c_str(), O_RDONLY);
+  if (fd < 0) {
+    throw std::runtime_error("failed to open lap archive " + file_name);
+  }
+  struct stat st;
+  if (::fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < sizeof(LapArchiveHeader)) {
+    ::close(fd);
+    throw std::runtime_error(file_name + " is not a lap archive.");
+  }
+  size_ = static_cast<size_t>(st.st_size);
+  void * data = ::mmap(nullptr, size_, PROT_READ, MAP_SHARED, fd, 0);
+  ::close(fd);
+  if (data == MAP_FAILED) {
+    throw std::runtime_error("failed to map lap archive " + file_name);
+  }
+  data_ = static_cast<const unsigned char *>(data);
+  // the laps are loaded one by one, so only the pages of the loaded laps are read
+  ::madvise(data, size_, MADV_RANDOM);
+
+  LapArchiveHeader header;
+  std::memcpy(&header, data_, sizeof(header));
+  if (std::memcmp(header.magic, LAP_ARCHIVE_MAGIC, sizeof(header.magic)) != 0 ||
+    header.version != LAP_ARCHIVE_VERSION || header.header_size != sizeof(LapArchiveHeader))
+  {
+    ::munmap(data, size_);
+    throw std::runtime_error(file_name + " is not a lap archive of version " +
+            std::to_string(LAP_ARCHIVE_VERSION));
+  }
+
+  // walk the entry headers. a truncated or invalid entry ends the archive.
+  size_t offset = sizeof(LapArchiveHeader);
+  while (size_ - offset >= sizeof(LapArchiveEntryHeader)) {
+    LapArchiveEntryHeader entry;
+    std::memcpy(&entry, data_ + offset, sizeof(entry));
+    const auto size = entry_size(entry);
+    if (size == 0 || size > size_ - offset) {
+      break;
+    }
+    entries_.push_back(
+      Entry{entry.lap_id, entry.trajectory_id, entry.session_id, entry.total_length,
+        entry.lap_time, entry.num_samples, offset});
+    offset += size;
+  }
+  end_ = offset;
+}
+
+LapArchive::~LapArchive()
+{
+  ::munmap(const_cast<unsigned char *>(data_), size_);
+}
+
+const std::vector<LapArchive::Entry> & LapArchive::entries() const
+{
+  return entries_;
+}
+
+LapRecord LapArchive::load(const size_t & i) const
+{
+  const auto & entry = entries_.at(i);
+  LapArchiveEntryHeader header;
+  std::memcpy(&header, data_ + entry.offset, sizeof(header));
+  LapRecord lap;
+  lap.lap_id = header.lap_id;
+  lap.total_length = header.total_length;
+  const std::array<casadi::DM *, 4> matrices{&lap.x, &lap.u, &lap.k, &lap.t};
+  const auto * samples = data_ + entry.offset + sizeof(header);
+  uint64_t checksum = utils::FNV1A_64_OFFSET;
+  for (size_t m = 0; m < matrices.size(); m++) {
+    *matrices[m] = casadi::DM(
+      casadi::Sparsity::dense(
+        static_cast<casadi_int>(header.rows[m]), static_cast<casadi_int>(header.num_samples)));
+    auto & nonzeros = matrices[m]->nonzeros();
+    const auto size = nonzeros.size() * sizeof(double);
+    std::memcpy(nonzeros.data(), samples, size);
+    checksum = utils::fnv1a_64(samples, size, checksum);
+    samples += size;
+  }
+  if (checksum != header.checksum) {
+    throw std::runtime_error(
+            "lap " + std::to_string(header.lap_id) + " of " + file_name_ +
+            " is corrupted. The checksum does not match.");
+  }
+  return lap;
+}
+
+void LapArchive::append(
+  const std::string & file_name, const LapRecord & lap,
+  const uint64_t & trajectory_id, const uint64_t & session_id)
+{
+  const std::array<const casadi::DM *, 4> matrices{&lap.x, &lap.u, &lap.k, &lap.t};
+  std::array<casadi::DM, 4> dense;
+  LapArchiveEntryHeader header{};
+  std::memcpy(header.magic, LAP_ARCHIVE_ENTRY_MAGIC, sizeof(header.magic));
+  header.lap_id = lap.lap_id;
+  header.trajectory_id = trajectory_id;
+  header.session_id = session_id;
+  header.total_length = lap.total_length;
+  header.lap_time = lap.t.is_empty() ? 0.0 :
+    static_cast<double>(lap.t(-1)) - static_cast<double>(lap.t(0));
+  header.num_samples = static_cast<uint64_t>(lap.x.size2());
+  header.checksum = utils::FNV1A_64_OFFSET;
+  header.entry_size = sizeof(header);
+  for (size_t m = 0; m < matrices.size(); m++) {
+    if (matrices[m]->size2() != lap.x.size2()) {
+      throw std::invalid_argument("every matrix of a lap must have the same number of samples.");
+    }
+    dense[m] = casadi::DM::densify(*matrices[m]);
+    const auto & nonzeros = dense[m].nonzeros();
+    header.rows[m] = static_cast<uint64_t>(dense[m].size1());
+    header.entry_size += nonzeros.size() * sizeof(double);
+    header.checksum =
+      utils::fnv1a_64(nonzeros.data(), nonzeros.size() * sizeof(double), header.checksum);
+  }
+
+  // append after the last complete lap, over an interrupted append if any. a file shorter
+  // than the archive header is an interrupted first append, so the header is written again.
+  size_t end = 0;
+  struct stat st;
+  if (::stat(file_name.c_str(), &st) == 0 &&
+    static_cast<size_t>(st.st_size) >= sizeof(LapArchiveHeader))
+  {
+    end = LapArchive(file_name).end_;
+  }
+  const int fd = ::open(file_name.c_str(), O_WRONLY | O_CREAT, 0644);
+  if (fd < 0) {
+    throw std::runtime_error("failed to open lap archive " + file_name);
+  }
+  try {
+    if (::ftruncate(fd, static_cast<off_t>(end)) != 0 ||
+      ::lseek(fd, static_cast<off_t>(end), SEEK_SET) < 0)
+    {
+      throw std::runtime_error("failed to append to lap archive " + file_name);
+    }
+    if (end == 0) {
+      LapArchiveHeader archive_header{};
+      std::memcpy(archive_header.magic, LAP_ARCHIVE_MAGIC, sizeof(archive_header.magic));
+      archive_header.version = LAP_ARCHIVE_VERSION;
+      archive_header.header_size = sizeof(LapArchiveHeader);
+      write_all(fd, &archive_header, sizeof(archive_header), file_name);
+    }
+    write_all(fd, &header, sizeof(header), file_name);
+    for (const auto & matrix : dense) {
+      const auto & nonzeros = matrix.nonzeros();
+      write_all(fd, nonzeros.data(), nonzeros.size() * sizeof(double), file_name);
+    }
+  } catch (...) {
+    ::close(fd);
+    throw;
+  }
+  ::close(fd);
+}
+}  // namespace racing_trajectory
+}  // namespace vehicle_model
+}  // namespace lmpc
@@ -0,0 +1,199 @@
+// Copyright 2023 Haoru Xue
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#include <array>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+
+#include <lmpc_utils/hash.hpp>
+
+#include "racing_trajectory/lap_file.hpp"
+
+namespace lmpc
+{
+namespace vehicle_model
+{
+namespace racing_trajectory
+{
+void write_lap_file(const std::string & file_name, const LapRecord & lap)
+{
+  const std::array<const casadi::DM *, 4> matrices{&lap.x, &lap.u, &lap.k, &lap.t};
+  std::array<casadi::DM, 4> densified;
+  std::array<const casadi::DM *, 4> dense;
+  LapFileHeader header{};
+  std::memcpy(header.magic, LAP_FILE_MAGIC, sizeof(header.magic));
+  header.version = LAP_FILE_VERSION;
+  header.header_size = sizeof(LapFileHeader);
+  header.lap_id = lap.lap_id;
+  header.total_length = lap.total_length;
+  header.num_samples = static_cast<uint64_t>(lap.x.size2());
+  header.checksum = utils::FNV1A_64_OFFSET;
+  for (size_t i = 0; i < matrices.size(); i++) {
+    if (matrices[i]->size2() != lap.x.size2()) {
+      throw std::invalid_argument("every matrix of a lap must have the same number of samples.");
+    }
+    dense[i] = matrices[i];
+    if (!matrices[i]->is_dense()) {
+      densified[i] = casadi::DM::densify(*matrices[i]);
+      dense[i] = &densified[i];
+    }
+    const auto & nonzeros = dense[i]->nonzeros();
+    header.rows[i] = static_cast<uint64_t>(dense[i]->size1());
+    header.checksum =
+      utils::fnv1a_64(nonzeros.data(), nonzeros.size() * sizeof(double), header.checksum);
+  }
+
+  const auto tmp_file_name = file_name + ".tmp";
+  {
+    std::ofstream out(tmp_file_name, std::ios::binary | std::ios::trunc);
+    out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    for (const auto & matrix : dense) {
+      const auto & nonzeros = matrix->nonzeros();
+      out.write(
+        reinterpret_cast<const char *>(nonzeros.data()),
+        static_cast<std::streamsize>(nonzeros.size() * sizeof(double)));
+    }
+    if (!out.good()) {
+      throw std::runtime_error("failed to write lap file " + tmp_file_name);
+    }
+  }
+  std::filesystem::rename(tmp_file_name, file_name);
+}
+
+LapRecord read_lap_file(const std::string & file_name)
+{
+  std::ifstream in(file_name, std::ios::binary);
+  if (!in) {
+    throw std::runtime_error("failed to open lap file " + file_name);
+  }
+  LapFileHeader header;
+  in.read(reinterpret_cast<char *>(&header), sizeof(header));
+  if (!in || std::memcmp(header.magic, LAP_FILE_MAGIC, sizeof(header.magic)) != 0) {
+    throw std::runtime_error(file_name + " is not a lap file.");
+  }
+  if (header.version != LAP_FILE_VERSION || header.header_size != sizeof(LapFileHeader)) {
+    throw std::runtime_error(
+            file_name + " has unsupported lap file version " + std::to_string(header.version));
+  }
+
+  // validate the size before allocating anything
+  const auto file_size = std::filesystem::file_size(file_name);
+  const auto max_elements = file_size / sizeof(double);
+  uint64_t num_elements = 0;
+  for (const auto & rows : header.rows) {
+    if (header.num_samples > 0 && rows > max_elements / header.num_samples) {
+      throw std::runtime_error(file_name + " is truncated.");
+    }
+    num_elements += rows * header.num_samples;
+  }
+  if (sizeof(LapFileHeader) + num_elements * sizeof(double) != file_size) {
+    throw std::runtime_error(file_name + " is truncated.");
+  }
+
+  LapRecord lap;
+  lap.lap_id = header.lap_id;
+  lap.total_length = header.total_length;
+  const std::array<casadi::DM *, 4> matrices{&lap.x, &lap.u, &lap.k, &lap.t};
+  uint64_t checksum = utils::FNV1A_64_OFFSET;
+  for (size_t i = 0; i < matrices.size(); i++) {
+    *matrices[i] = casadi::DM(
+      casadi::Sparsity::dense(
+        static_cast<casadi_int>(header.rows[i]), static_cast<casadi_int>(header.num_samples)));
+    auto & nonzeros = matrices[i]->nonzeros();
+    in.read(
+      reinterpret_cast<char *>(nonzeros.data()),
+      static_cast<std::streamsize>(nonzeros.size() * sizeof(double)));
+    checksum = utils::fnv1a_64(nonzeros.data(), nonzeros.size() * sizeof(double), checksum);
+  }
+  if (!in) {
+    throw std::runtime_error(file_name + " is truncated.");
+  }
+  if (checksum != header.checksum) {
+    throw std::runtime_error(file_name + " is corrupted. The checksum does not match.");
+  }
+  return lap;
+}
+
+LapWriter::LapWriter(const size_t & max_queued_laps)
+: max_queued_laps_(max_queued_laps)
+{
+  thread_ = std::thread(&LapWriter::write_loop, this);
+}
+
+LapWriter::~LapWriter()
+{
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stop_ = true;
+  }
+  cv_.notify_all();
+  thread_.join();
+}
+
+bool LapWriter::write(const std::string & file_name, LapRecord lap)
+{
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (queue_.size() >= max_queued_laps_) {
+      std::cerr << "Lap writer queue is full. Dropping lap " << lap.lap_id << "." << std::endl;
+      return false;
+    }
+    queue_.emplace_back(file_name, std::move(lap));
+  }
+  cv_.notify_one();
+  return true;
+}
+
+void LapWriter::flush()
+{
+  std::unique_lock<std::mutex> lock(mutex_);
+  idle_cv_.wait(lock, [this]() {return queue_.empty() && !writing_;});
+}
+
+void LapWriter::write_loop()
+{
+  while (true) {
+    std::pair<std::string, LapRecord> item;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      cv_.wait(lock, [this]() {return stop_ || !queue_.empty();});
+      if (queue_.empty()) {
+        // stopped, and every queued lap is written
+        return;
+      }
+      item = std::move(queue_.front());
+      queue_.pop_front();
+      writing_ = true;
+    }
+    try {
+      write_lap_file(item.first, item.second);
+      std::cout << "Saved lap " << item.second.lap_id << " to " << item.first << std::endl;
+    } catch (const std::exception & e) {
+      std::cerr << "Failed to save lap " << item.second.lap_id << " to " << item.first << ": " <<
+        e.what() << std::endl;
+    }
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      writing_ = false;
+    }
+    idle_cv_.notify_all();
+  }
+}
+}  // namespace racing_trajectory
+}  // namespace vehicle_model
+}  // namespace lmpc
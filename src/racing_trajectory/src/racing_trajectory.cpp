@@ -13,7 +13,21 @@
 // You should have received a copy of the GNU Lesser General Public License
 // along with this program.  If not, see <https://www.gnu.org/licenses/>.
 
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <execution>
+#include <filesystem>
+#include <mutex>
+#include <numeric>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
 #include "racing_trajectory/racing_trajectory.hpp"
+#include "lmpc_utils/codegen.hpp"
+#include "lmpc_utils/hash.hpp"
 #include "lmpc_utils/utils.hpp"
 
 namespace lmpc
@@ -22,76 +36,110 @@ namespace vehicle_model
 {
 namespace racing_trajectory
 {
-RacingTrajectory::RacingTrajectory(const casadi::DM & traj)
+namespace
+{
+/**
+ * @brief Run a function on every chunk of [0, n) in parallel.
+ * Batches smaller than one chunk run on the calling thread.
+ *
+ * @param n total number of elements.
+ * @param chunk_size number of elements per chunk.
+ * @param func function taking the begin and end index of a chunk.
+ */
+template<typename Func>
+void for_each_chunk(const size_t & n, const size_t & chunk_size, const Func & func)
+{
+  if (n <= chunk_size) {
+    func(size_t{0}, n);
+    return;
+  }
+  std::vector<size_t> chunks((n + chunk_size - 1) / chunk_size);
+  std::iota(chunks.begin(), chunks.end(), 0);
+  std::for_each(
+    std::execution::par, chunks.begin(), chunks.end(),
+    [&](const size_t & i) {
+      func(i * chunk_size, std::min(n, (i + 1) * chunk_size));
+    });
+}
+}  // namespace
+
+RacingTrajectory::RacingTrajectory(
+  const casadi::DM & traj,
+  const std::string & codegen_cache_dir,
+  const WaypointIndexType & index_type)
 : traj_(traj),
   abscissa_(traj_(TrajectoryIndex::DIST_TO_SF_BWD, casadi::Slice())),
-  norm_2_(utils::norm_2_function(traj_.size2())),
   total_length_(traj_(TrajectoryIndex::DIST_TO_SF_FWD, 0)),
-  kd_tree_(traj_(TrajectoryIndex::PX, casadi::Slice()).get_elements(),
-    traj_(TrajectoryIndex::PY, casadi::Slice()).get_elements())
+  codegen_cache_dir_(codegen_cache_dir),
+  waypoint_index_(make_waypoint_index(
+      index_type, traj_(TrajectoryIndex::PX, casadi::Slice()).get_elements(),
+      traj_(TrajectoryIndex::PY, casadi::Slice()).get_elements()))
 {
   using casadi::Slice;
   using casadi::DM;
-  using casadi::MX;
-  using casadi::Function;
 
-  {
-    // create the interpolants
-    auto interpolants = DM(traj_);
-    // cubic spline interpolation requires 3 points on both ends to
-    // garantee smoothness and interpolatability at the ends.
-    // lets repeat the first 3 points at the end and the last 3 points at the beginning.
-    // note that we are actually appending the first 4 points to the end
-    // in order to close the trajectory loop.
+  // create the interpolation data
+  auto interpolants = DM(traj_);
+  // cubic spline interpolation requires 3 points on both ends to
+  // garantee smoothness and interpolatability at the ends.
+  // lets repeat the first 3 points at the end and the last 3 points at the beginning.
+  // note that we are actually appending the first 4 points to the end
+  // in order to close the trajectory loop.
 
-    // append the first 4 points
-    interpolants = DM::horzcat({interpolants, interpolants(Slice(), Slice(0, 4))});
+  // append the first 4 points
+  interpolants = DM::horzcat({interpolants, interpolants(Slice(), Slice(0, 4))});
 
-    // make sure the distance measure is continuous
-    interpolants(
-      TrajectoryIndex::DIST_TO_SF_BWD,
-      Slice(-4, std::numeric_limits<casadi_int>::max())) += total_length_;
+  // make sure the distance measure is continuous
+  interpolants(
+    TrajectoryIndex::DIST_TO_SF_BWD,
+    Slice(-4, std::numeric_limits<casadi_int>::max())) += total_length_;
 
-    // prepend the last 3 points
-    interpolants = DM::horzcat({interpolants(Slice(), Slice(-7, -4)), interpolants});
+  // prepend the last 3 points
+  interpolants = DM::horzcat({interpolants(Slice(), Slice(-7, -4)), interpolants});
 
-    // make sure the distance measure is continuous
-    interpolants(TrajectoryIndex::DIST_TO_SF_BWD, Slice(0, 3)) -= total_length_;
+  // make sure the distance measure is continuous
+  interpolants(TrajectoryIndex::DIST_TO_SF_BWD, Slice(0, 3)) -= total_length_;
+
+  // distances from the centerline to the boundaries. left is positive, right is negative.
+  const auto px = interpolants(TrajectoryIndex::PX, Slice()).get_elements();
+  const auto py = interpolants(TrajectoryIndex::PY, Slice()).get_elements();
+  const auto left_x = interpolants(TrajectoryIndex::LEFT_BOUND_X, Slice()).get_elements();
+  const auto left_y = interpolants(TrajectoryIndex::LEFT_BOUND_Y, Slice()).get_elements();
+  const auto right_x = interpolants(TrajectoryIndex::RIGHT_BOUND_X, Slice()).get_elements();
+  const auto right_y = interpolants(TrajectoryIndex::RIGHT_BOUND_Y, Slice()).get_elements();
+  std::vector<double> t_left(px.size()), t_right(px.size());
+  for (size_t i = 0; i < px.size(); i++) {
+    t_left[i] = std::hypot(px[i] - left_x[i], py[i] - left_y[i]);
+    t_right[i] = -std::hypot(px[i] - right_x[i], py[i] - right_y[i]);
+  }
+  knots_ = interpolants(TrajectoryIndex::DIST_TO_SF_BWD, Slice()).get_elements();
+  channels_ = {px, py, t_left, t_right,
+    interpolants(TrajectoryIndex::SPEED, Slice()).get_elements()};
+
+  // native spline on the same data for fast projection and sampling
+  spline_ = std::make_shared<CubicSpline>(knots_, channels_);
+  projector_ = std::make_unique<TrajectoryProjector>(spline_, SPLINE_X, SPLINE_Y, total_length_);
+  sampler_ = std::make_unique<TrajectorySampler>(spline_, total_length_);
+  // the casadi functions are built on first use
+}
+
+void RacingTrajectory::build_interpolation_functions()
+{
+  using casadi::MX;
+  using casadi::Function;
 
+  {
     // build the interpolation functions
-    auto norm_2_interpolant = utils::norm_2_function(interpolants.size2());
-    const auto abscissa = interpolants(TrajectoryIndex::DIST_TO_SF_BWD, Slice());
-    const auto t_left =
-      norm_2_interpolant(
-      interpolants(
-        Slice(TrajectoryIndex::PX, TrajectoryIndex::PY + 1),
-        Slice()) -
-      interpolants(
-        Slice(TrajectoryIndex::LEFT_BOUND_X, TrajectoryIndex::LEFT_BOUND_Y + 1),
-        Slice()))[0];
-    const auto t_right = -1.0 *
-      norm_2_interpolant(
-      interpolants(
-        Slice(TrajectoryIndex::PX, TrajectoryIndex::PY + 1),
-        Slice()) -
-      interpolants(
-        Slice(TrajectoryIndex::RIGHT_BOUND_X, TrajectoryIndex::RIGHT_BOUND_Y + 1),
-        Slice()))[0];
     const auto left_intp = casadi::interpolant(
-      "left_intp_impl", "bspline",
-      {abscissa.get_elements()}, t_left.get_elements());
+      "left_intp_impl", "bspline", {knots_}, channels_[SPLINE_LEFT]);
     const auto right_intp = casadi::interpolant(
-      "right_intp_impl", "bspline",
-      {abscissa.get_elements()}, t_right.get_elements());
+      "right_intp_impl", "bspline", {knots_}, channels_[SPLINE_RIGHT]);
     const auto x_intp = casadi::interpolant(
-      "x_intp_impl", "bspline",
-      {abscissa.get_elements()}, interpolants(TrajectoryIndex::PX, Slice()).get_elements());
+      "x_intp_impl", "bspline", {knots_}, channels_[SPLINE_X]);
     const auto y_intp = casadi::interpolant(
-      "y_intp_impl", "bspline",
-      {abscissa.get_elements()}, interpolants(TrajectoryIndex::PY, Slice()).get_elements());
+      "y_intp_impl", "bspline", {knots_}, channels_[SPLINE_Y]);
     const auto vel_intp = casadi::interpolant(
-      "vel_intp_impl", "bspline",
-      {abscissa.get_elements()}, interpolants(TrajectoryIndex::SPEED, Slice()).get_elements());
+      "vel_intp_impl", "bspline", {knots_}, channels_[SPLINE_SPEED]);
 
     const auto s = MX::sym("s", 1, 1);
     const auto s_mod = utils::align_abscissa<MX>(s, total_length_ / 2.0, total_length_);
@@ -117,6 +165,12 @@ RacingTrajectory::RacingTrajectory(const casadi::DM & traj)
     y_intp_ = Function("y_intp", {s}, {y_intp(s_mod)});
     vel_intp_ = Function("vel_intp", {s}, {vel_intp(s_mod)});
   }
+}
+
+void RacingTrajectory::build_frenet_to_global_function()
+{
+  using casadi::MX;
+  using casadi::Function;
 
   // build the frenet to global transformation
   {
@@ -133,6 +187,13 @@ RacingTrajectory::RacingTrajectory(const casadi::DM & traj)
     const auto out = MX::vertcat({x0 + d_x, y0 + d_y, phi});
     frenet_to_global_ = Function("frenet_to_global", {MX::vertcat({s, t, xi})}, {out});
   }
+}
+
+void RacingTrajectory::build_global_to_frenet_function()
+{
+  using casadi::Slice;
+  using casadi::MX;
+  using casadi::Function;
 
   // build the global to frenet transformation
   {
@@ -186,19 +247,126 @@ RacingTrajectory::RacingTrajectory(const casadi::DM & traj)
   }
 }
 
-RacingTrajectory::RacingTrajectory(const std::string & file_name)
-: RacingTrajectory(casadi::DM::from_file(file_name).T())
+RacingTrajectory::RacingTrajectory(
+  const std::string & file_name,
+  const std::string & codegen_cache_dir,
+  const WaypointIndexType & index_type)
+: RacingTrajectory(casadi::DM::from_file(file_name).T(), codegen_cache_dir, index_type)
+{
+}
+
+void RacingTrajectory::load_compiled_functions()
+{
+  // the library is keyed by the trajectory table and the version of the generated functions
+  const auto & data = traj_.nonzeros();
+  uint64_t hash = utils::fnv1a_64(data.data(), data.size() * sizeof(double));
+  const std::array<casadi_int, 3> key{traj_.size1(), traj_.size2(), CODEGEN_VERSION};
+  hash = utils::fnv1a_64(key.data(), sizeof(key), hash);
+  const auto name = "racing_trajectory_" + utils::hash_to_string(hash);
+  const auto library = (std::filesystem::path(codegen_cache_dir_) / (name + ".so")).string();
+
+  auto functions = compiled_functions();
+  if (!std::filesystem::exists(library)) {
+    build_interpolation_functions();
+    build_frenet_to_global_function();
+    build_global_to_frenet_function();
+    std::vector<casadi::Function> generated;
+    for (const auto & function : functions) {
+      generated.push_back(*function.second);
+    }
+    // the jacobian keeps frenet_to_global differentiable after loading
+    generated.push_back(frenet_to_global_.jacobian());
+    utils::compile_functions(generated, name, codegen_cache_dir_);
+    std::cout << "Compiled trajectory functions to " << library << "." << std::endl;
+  }
+
+  std::vector<std::string> names;
+  for (const auto & function : functions) {
+    names.push_back(function.first);
+  }
+  const auto loaded = utils::load_compiled_functions(names, library);
+  for (size_t i = 0; i < functions.size(); i++) {
+    *functions[i].second = loaded[i];
+  }
+}
+
+std::vector<std::pair<std::string, casadi::Function *>> RacingTrajectory::compiled_functions()
 {
+  return {
+    {"x_intp", &x_intp_},
+    {"y_intp", &y_intp_},
+    {"yaw_intp", &yaw_intp_},
+    {"curvature_intp", &curvature_intp_},
+    {"left_intp", &left_intp_},
+    {"right_intp", &right_intp_},
+    {"vel_intp", &vel_intp_},
+    {"frenet_to_global", &frenet_to_global_},
+    {"global_to_frenet", &global_to_frenet_}};
+}
+
+void RacingTrajectory::ensure_functions(const FunctionGroup & group)
+{
+  if (!codegen_cache_dir_.empty()) {
+    // the compiled library holds every group
+    std::call_once(compiled_functions_flag_, [this]() {load_compiled_functions();});
+    return;
+  }
+  // every group depends on the groups before it
+  if (group > FunctionGroup::INTERPOLATION) {
+    ensure_functions(static_cast<FunctionGroup>(group - 1));
+  }
+  std::call_once(
+    function_flags_[group], [this, &group]() {
+      switch (group) {
+        case FunctionGroup::INTERPOLATION:
+          build_interpolation_functions();
+          break;
+        case FunctionGroup::FRENET_TO_GLOBAL:
+          build_frenet_to_global_function();
+          break;
+        case FunctionGroup::GLOBAL_TO_FRENET:
+          build_global_to_frenet_function();
+          break;
+        default:
+          throw std::invalid_argument("unknown function group.");
+      }
+    });
+}
+
+void RacingTrajectory::warm_up()
+{
+  for (uint8_t group = 0; group < FunctionGroup::NUM_FUNCTION_GROUPS; group++) {
+    ensure_functions(static_cast<FunctionGroup>(group));
+  }
 }
 
 void RacingTrajectory::frenet_to_global(const FrenetPose2D & frenet_pose, Pose2D & global_pose)
 {
-  const auto out = frenet_to_global_(
-    casadi::DM{frenet_pose.position.s, frenet_pose.position.t,
-      frenet_pose.yaw})[0].get_elements();
-  global_pose.position.x = out[0];
-  global_pose.position.y = out[1];
-  global_pose.yaw = out[2];
+  TrajectorySample sample;
+  sampler_->sample(frenet_pose.position.s, sample);
+  global_pose.position.x = sample.x - std::sin(sample.yaw) * frenet_pose.position.t;
+  global_pose.position.y = sample.y + std::cos(sample.yaw) * frenet_pose.position.t;
+  global_pose.yaw = utils::align_yaw(sample.yaw + frenet_pose.yaw, 0.0);
+}
+
+void RacingTrajectory::frenet_to_global(
+  const FrenetPoses2D & frenet_poses,
+  Poses2D & global_poses) const
+{
+  const size_t n = frenet_poses.size();
+  global_poses.resize(n);
+  for_each_chunk(
+    n, BATCH_CHUNK_SIZE, [&](const size_t & begin, const size_t & end) {
+      TrajectorySamples samples;
+      sampler_->sample(frenet_poses.s.data() + begin, end - begin, samples);
+      for (size_t i = begin; i < end; i++) {
+        const size_t k = i - begin;
+        const double t = frenet_poses.t[i];
+        global_poses.x[i] = samples.x[k] - std::sin(samples.yaw[k]) * t;
+        global_poses.y[i] = samples.y[k] + std::cos(samples.yaw[k]) * t;
+        global_poses.yaw[i] = utils::align_yaw(samples.yaw[k] + frenet_poses.yaw[i], 0.0);
+      }
+    });
 }
 
 void RacingTrajectory::global_to_frenet(
@@ -206,84 +374,133 @@ void RacingTrajectory::global_to_frenet(
   const bool & initialize_with_previous
 )
 {
-  FrenetPose2D p0 = {0.0, 0.0, 0.0};
   if (initialize_with_previous) {
-    p0 = frenet_pose;
-  } else {
-    // initialize with the closest point on the trajectory
-    const size_t idx = kd_tree_.find_closest_waypoint_index(
-      global_pose.position.x,
-      global_pose.position.y);
-    p0.position.s = static_cast<double>(abscissa_(idx));
-
-    Pose2D p0_g;
-    kd_tree_.get_waypoint(idx, p0_g.position.x, p0_g.position.y);
-    p0_g.yaw = static_cast<double>(yaw_intp_(casadi::DM(p0.position.s))[0]);
-    p0.position.t =
-      static_cast<double>(distance(global_pose.position, p0_g.position)) * lateral_sign(
-      global_pose.position, p0_g);
-    p0.yaw = utils::align_yaw(global_pose.yaw, p0_g.yaw);
+    // the previous pose could be stale. fall back to the closest waypoint if it did not converge.
+    const double s0 = frenet_pose.position.s;
+    if (projector_->global_to_frenet(global_pose, s0, frenet_pose)) {
+      return;
+    }
   }
 
-  const auto out = global_to_frenet_(
-    casadi::DM{
-          global_pose.position.x, global_pose.position.y, global_pose.yaw,
-          p0.position.s, p0.position.t
-        })[0].get_elements();
-  frenet_pose.position.s = out[0];
-  frenet_pose.position.t = out[1];
-  frenet_pose.yaw = out[2];
+  // initialize with the closest point on the trajectory
+  projector_->global_to_frenet(
+    global_pose,
+    closest_waypoint_abscissa(global_pose.position.x, global_pose.position.y), frenet_pose);
+}
+
+void RacingTrajectory::global_to_frenet(
+  const Poses2D & global_poses, FrenetPoses2D & frenet_poses,
+  const bool & ordered) const
+{
+  const size_t n = global_poses.size();
+  frenet_poses.resize(n);
+  for_each_chunk(
+    n, BATCH_CHUNK_SIZE, [&](const size_t & begin, const size_t & end) {
+      Pose2D global_pose;
+      FrenetPose2D frenet_pose;
+      for (size_t i = begin; i < end; i++) {
+        global_pose.position.x = global_poses.x[i];
+        global_pose.position.y = global_poses.y[i];
+        global_pose.yaw = global_poses.yaw[i];
+        bool done = false;
+        if (ordered && i > begin) {
+          // warm start from the previous pose. the abscissa should not move much further
+          // than the position did, otherwise the projection jumped to another part of the track.
+          const double s_prev = frenet_poses.s[i - 1];
+          if (projector_->global_to_frenet(global_pose, s_prev, frenet_pose)) {
+            const double ds = std::fabs(frenet_pose.position.s - s_prev);
+            const double dq = std::hypot(
+              global_poses.x[i] - global_poses.x[i - 1],
+              global_poses.y[i] - global_poses.y[i - 1]);
+            done = std::min(ds, total_length_ - ds) <= 2.0 * dq + 1.0;
+          }
+        }
+        if (!done) {
+          projector_->global_to_frenet(
+            global_pose,
+            closest_waypoint_abscissa(global_pose.position.x, global_pose.position.y),
+            frenet_pose);
+        }
+        frenet_poses.s[i] = frenet_pose.position.s;
+        frenet_poses.t[i] = frenet_pose.position.t;
+        frenet_poses.yaw[i] = frenet_pose.yaw;
+      }
+    });
 }
 
 casadi::Function & RacingTrajectory::frenet_to_global_function()
 {
+  ensure_functions(FunctionGroup::FRENET_TO_GLOBAL);
   return frenet_to_global_;
 }
 
 casadi::Function & RacingTrajectory::global_to_frenet_function()
 {
+  ensure_functions(FunctionGroup::GLOBAL_TO_FRENET);
   return global_to_frenet_;
 }
 
 casadi::Function & RacingTrajectory::curvature_interpolation_function()
 {
+  ensure_functions(FunctionGroup::INTERPOLATION);
   return curvature_intp_;
 }
 
 casadi::Function & RacingTrajectory::left_boundary_interpolation_function()
 {
+  ensure_functions(FunctionGroup::INTERPOLATION);
   return left_intp_;
 }
 
 casadi::Function & RacingTrajectory::right_boundary_interpolation_function()
 {
+  ensure_functions(FunctionGroup::INTERPOLATION);
   return right_intp_;
 }
 
 casadi::Function & RacingTrajectory::x_interpolation_function()
 {
+  ensure_functions(FunctionGroup::INTERPOLATION);
   return x_intp_;
 }
 
 casadi::Function & RacingTrajectory::y_interpolation_function()
 {
+  ensure_functions(FunctionGroup::INTERPOLATION);
   return y_intp_;
 }
 
 casadi::Function & RacingTrajectory::yaw_interpolation_function()
 {
+  ensure_functions(FunctionGroup::INTERPOLATION);
   return yaw_intp_;
 }
 
 casadi::Function & RacingTrajectory::velocity_interpolation_function()
 {
+  ensure_functions(FunctionGroup::INTERPOLATION);
   return vel_intp_;
 }
 
+const TrajectoryProjector & RacingTrajectory::projector() const
+{
+  return *projector_;
+}
+
+const TrajectorySampler & RacingTrajectory::sampler() const
+{
+  return *sampler_;
+}
+
 const double & RacingTrajectory::total_length() const
 {
   return total_length_;
 }
+
+double RacingTrajectory::closest_waypoint_abscissa(const double & x, const double & y) const
+{
+  return abscissa_.nonzeros()[waypoint_index_->find_closest_waypoint_index(x, y)];
+}
 }  // namespace racing_trajectory
 }  // namespace vehicle_model
 }  // namespace lmpc
@@ -13,9 +13,17 @@
 // You should have received a copy of the GNU Lesser General Public License
 // along with this program.  If not, see <https://www.gnu.org/licenses/>.
 
+#include <algorithm>
+#include <chrono>
+#include <exception>
+#include <execution>
+#include <filesystem>
+#include <iostream>
+#include <numeric>
 #include <regex>
+#include <sstream>
 #include <string>
-#include <filesystem>
+#include <vector>
 
 #include <racing_trajectory/racing_trajectory_map.hpp>
 
@@ -26,7 +34,12 @@ namespace vehicle_model
 namespace racing_trajectory
 {
 
-RacingTrajectoryMap::RacingTrajectoryMap(const std::string & directory_path)
+RacingTrajectoryMap::RacingTrajectoryMap(
+  const std::string & directory_path,
+  const std::string & codegen_cache_dir,
+  const bool & lazy,
+  const WaypointIndexType & index_type)
+: codegen_cache_dir_(codegen_cache_dir), index_type_(index_type)
 {
   std::regex pattern(R"((\d+)_.*\.txt)");
 
@@ -40,23 +53,259 @@ RacingTrajectoryMap::RacingTrajectoryMap(const std::string & directory_path)
     }
 
     int number = std::stoi(match[1]);
-    if (trajectories_.find(number) != trajectories_.end()) {
+    if (entries_.find(number) != entries_.end()) {
       throw std::runtime_error("Duplicate trajectory number found: " + std::to_string(number));
     }
-    const auto traj_path = entry.path().string();
-    trajectories_[number] = std::make_shared<RacingTrajectory>(traj_path);
-    std::cout << "Loaded trajectory " << number << " from " << traj_path << ". ";
-    std::cout << "Length: " << trajectories_[number]->total_length() << " m." << std::endl;
+    entries_[number] = std::make_unique<TrajectoryEntry>();
+    entries_[number]->index = number;
+    entries_[number]->path = entry.path().string();
+  }
+
+  if (!lazy) {
+    load_all();
+  }
+  background_thread_ = std::thread(&RacingTrajectoryMap::background_loop, this);
+}
+
+RacingTrajectoryMap::~RacingTrajectoryMap()
+{
+  {
+    std::lock_guard<std::mutex> lock(background_mutex_);
+    stop_background_ = true;
   }
+  background_cv_.notify_all();
+  background_thread_.join();
 }
 
 RacingTrajectory::SharedPtr RacingTrajectoryMap::get_trajectory(const int & index)
 {
-  if (trajectories_.find(index) == trajectories_.end()) {
+  const auto it = entries_.find(index);
+  if (it == entries_.end()) {
     std::cerr << "Trajectory number " << index << " not found." << std::endl;
     return nullptr;
   }
-  return trajectories_[index];
+  auto & entry = *it->second;
+  load(index, entry);
+  queue_prefetch_hints(entry);
+  return entry.trajectory;
+}
+
+void RacingTrajectoryMap::prefetch(const int & index)
+{
+  const auto it = entries_.find(index);
+  if (it == entries_.end() || it->second->loaded) {
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> lock(background_mutex_);
+    const auto queued = std::find_if(
+      background_queue_.begin(), background_queue_.end(),
+      [&index](const BackgroundTask & task) {return task.index == index;});
+    if (queued != background_queue_.end()) {
+      return;
+    }
+    background_queue_.push_back(BackgroundTask{index, false});
+  }
+  background_cv_.notify_one();
+}
+
+void RacingTrajectoryMap::set_prefetch_hints(
+  const int & index,
+  const std::vector<int> & next_indices)
+{
+  const auto it = entries_.find(index);
+  if (it == entries_.end()) {
+    throw std::invalid_argument("Trajectory number " + std::to_string(index) + " not found.");
+  }
+  std::lock_guard<std::mutex> lock(background_mutex_);
+  it->second->prefetch_hints = next_indices;
+}
+
+bool RacingTrajectoryMap::is_loaded(const int & index) const
+{
+  const auto it = entries_.find(index);
+  return it != entries_.end() && it->second->loaded;
+}
+
+std::vector<int> RacingTrajectoryMap::trajectory_indices() const
+{
+  std::vector<int> indices;
+  indices.reserve(entries_.size());
+  for (const auto & entry : entries_) {
+    indices.push_back(entry.first);
+  }
+  return indices;
+}
+
+RacingTrajectory::SharedPtr RacingTrajectoryMap::get_active_trajectory() const
+{
+  const auto active = active_.load(std::memory_order_acquire);
+  return active ? active->trajectory : nullptr;
+}
+
+int RacingTrajectoryMap::get_active_trajectory_index() const
+{
+  const auto active = active_.load(std::memory_order_acquire);
+  return active ? active->index : -1;
+}
+
+bool RacingTrajectoryMap::set_active_trajectory(const int & index)
+{
+  const auto it = entries_.find(index);
+  if (it == entries_.end()) {
+    std::cerr << "Trajectory number " << index << " not found." << std::endl;
+    return false;
+  }
+  {
+    std::lock_guard<std::mutex> lock(background_mutex_);
+    pending_active_index_ = index;
+  }
+  try {
+    activate(index, *it->second);
+  } catch (...) {
+    // allow the failed switch to be requested again
+    std::lock_guard<std::mutex> lock(background_mutex_);
+    if (pending_active_index_ == index) {
+      pending_active_index_ = get_active_trajectory_index();
+    }
+    throw;
+  }
+  return true;
+}
+
+bool RacingTrajectoryMap::set_active_trajectory_async(const int & index)
+{
+  if (entries_.find(index) == entries_.end()) {
+    std::cerr << "Trajectory number " << index << " not found." << std::endl;
+    return false;
+  }
+  {
+    std::lock_guard<std::mutex> lock(background_mutex_);
+    pending_active_index_ = index;
+    background_queue_.push_back(BackgroundTask{index, true});
+  }
+  background_cv_.notify_one();
+  return true;
+}
+
+void RacingTrajectoryMap::apply_command(const lmpc_msgs::msg::TrajectoryCommand & command)
+{
+  const auto index = static_cast<int>(command.trajectory_index);
+  {
+    std::lock_guard<std::mutex> lock(background_mutex_);
+    if (index == pending_active_index_) {
+      return;
+    }
+  }
+  set_active_trajectory_async(index);
+}
+
+void RacingTrajectoryMap::load(const int & index, TrajectoryEntry & entry)
+{
+  std::call_once(
+    entry.load_flag, [this, &index, &entry]() {
+      const auto start_time = std::chrono::steady_clock::now();
+      entry.trajectory =
+        std::make_shared<RacingTrajectory>(entry.path, codegen_cache_dir_, index_type_);
+      const auto end_time = std::chrono::steady_clock::now();
+      entry.loaded = true;
+
+      // print in one piece since trajectories load concurrently
+      std::ostringstream ss;
+      ss << "Loaded trajectory " << index << " from " << entry.path << ". ";
+      ss << "Length: " << entry.trajectory->total_length() << " m. ";
+      ss << "Took " <<
+        std::chrono::duration_cast<std::chrono::microseconds>(end_time - start_time).count() /
+        1000.0 << " ms." << std::endl;
+      std::cout << ss.str();
+    });
+}
+
+void RacingTrajectoryMap::load_all()
+{
+  // construct all trajectories in parallel. exceptions are rethrown on this thread.
+  const auto indices = trajectory_indices();
+  std::vector<size_t> positions(indices.size());
+  std::iota(positions.begin(), positions.end(), 0);
+  std::vector<std::exception_ptr> errors(indices.size());
+  std::for_each(
+    std::execution::par, positions.begin(), positions.end(),
+    [this, &errors, &indices](const size_t & i) {
+      try {
+        load(indices[i], *entries_.at(indices[i]));
+      } catch (...) {
+        errors[i] = std::current_exception();
+      }
+    });
+  for (const auto & error : errors) {
+    if (error) {
+      std::rethrow_exception(error);
+    }
+  }
+}
+
+bool RacingTrajectoryMap::activate(const int & index, TrajectoryEntry & entry)
+{
+  // build everything before publishing so that readers never wait on a lazy build
+  load(index, entry);
+  entry.trajectory->warm_up();
+  {
+    // a switch requested during the build supersedes this one
+    std::lock_guard<std::mutex> lock(background_mutex_);
+    if (pending_active_index_ != index) {
+      std::cout << "Dropped the stale switch to trajectory " << index << "." << std::endl;
+      return false;
+    }
+    // the trajectory is never reassigned after its build, which the release publishes
+    active_.store(&entry, std::memory_order_release);
+  }
+  std::cout << "Activated trajectory " << index << "." << std::endl;
+  queue_prefetch_hints(entry);
+  return true;
+}
+
+void RacingTrajectoryMap::queue_prefetch_hints(const TrajectoryEntry & entry)
+{
+  std::vector<int> hints;
+  {
+    std::lock_guard<std::mutex> lock(background_mutex_);
+    hints = entry.prefetch_hints;
+  }
+  for (const auto & hint : hints) {
+    prefetch(hint);
+  }
+}
+
+void RacingTrajectoryMap::background_loop()
+{
+  while (true) {
+    BackgroundTask task;
+    {
+      std::unique_lock<std::mutex> lock(background_mutex_);
+      background_cv_.wait(lock, [this]() {return stop_background_ || !background_queue_.empty();});
+      if (stop_background_) {
+        return;
+      }
+      task = background_queue_.front();
+      background_queue_.pop_front();
+    }
+    try {
+      if (task.activate) {
+        activate(task.index, *entries_.at(task.index));
+      } else {
+        load(task.index, *entries_.at(task.index));
+      }
+    } catch (const std::exception & e) {
+      std::cerr << "Failed to load trajectory " << task.index << ": " << e.what() << std::endl;
+      if (task.activate) {
+        // allow the failed switch to be requested again
+        std::lock_guard<std::mutex> lock(background_mutex_);
+        if (pending_active_index_ == task.index) {
+          pending_active_index_ = get_active_trajectory_index();
+        }
+      }
+    }
+  }
 }
 }  // namespace racing_trajectory
 }  // namespace vehicle_model
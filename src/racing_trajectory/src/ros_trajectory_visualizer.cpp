@@ -13,7 +13,9 @@
 // You should have received a copy of the GNU Lesser General Public License
 // along with this program.  If not, see <https://www.gnu.org/licenses/>.
 
+#include <cmath>
 #include <memory>
+#include <vector>
 
 #include "racing_trajectory/ros_trajectory_visualizer.hpp"
 
@@ -32,41 +34,34 @@ ROSTrajectoryVisualizer::ROSTrajectoryVisualizer(RacingTrajectory & trajectory)
 void ROSTrajectoryVisualizer::change_trajectory(RacingTrajectory & trajectory)
 {
   std::unique_lock<std::shared_mutex> lock(mutex_);
-  const auto abscissa =
-    casadi::DM::linspace(0.0, trajectory.total_length(), 1001)(casadi::Slice(0, -1));
-  const auto N = abscissa.size1();
+  const size_t N = 1000;
+  std::vector<double> abscissa(N);
+  for (size_t i = 0; i < N; i++) {
+    abscissa[i] = trajectory.total_length() * static_cast<double>(i) / N;
+  }
+  TrajectorySamples samples;
+  trajectory.sampler().sample(abscissa.data(), N, samples);
 
   abscissa_polygon_msg_ = std::make_shared<PolygonStamped>();
   abscissa_polygon_msg_->header.frame_id = "map";
-  const auto pts = casadi::DM::horzcat(
-        {
-          trajectory.x_interpolation_function()(abscissa)[0],
-          trajectory.y_interpolation_function()(abscissa)[0]
-        }).T();
-  abscissa_polygon_msg_->polygon = build_polygon(pts);
+  abscissa_polygon_msg_->polygon = build_polygon(samples.x, samples.y);
 
+  // offset the centerline along its normal to get the boundaries
+  std::vector<double> left_x(N), left_y(N), right_x(N), right_y(N);
+  for (size_t i = 0; i < N; i++) {
+    const double normal_x = -std::sin(samples.yaw[i]);
+    const double normal_y = std::cos(samples.yaw[i]);
+    left_x[i] = samples.x[i] + normal_x * samples.left[i];
+    left_y[i] = samples.y[i] + normal_y * samples.left[i];
+    right_x[i] = samples.x[i] + normal_x * samples.right[i];
+    right_y[i] = samples.y[i] + normal_y * samples.right[i];
+  }
   left_boundary_polygon_msg_ = std::make_shared<PolygonStamped>();
   left_boundary_polygon_msg_->header.frame_id = "map";
+  left_boundary_polygon_msg_->polygon = build_polygon(left_x, left_y);
   right_boundary_polygon_msg_ = std::make_shared<PolygonStamped>();
   right_boundary_polygon_msg_->header.frame_id = "map";
-  const auto & left_boundary_frenet = casadi::DM::horzcat(
-        {
-          abscissa,
-          trajectory.left_boundary_interpolation_function()(abscissa)[0],
-          casadi::DM::zeros(N)
-        }).T();
-  const auto & right_boundary_frenet = casadi::DM::horzcat(
-        {
-          abscissa,
-          trajectory.right_boundary_interpolation_function()(abscissa)[0],
-          casadi::DM::zeros(N)
-        }).T();
-  const auto left_boundary_global =
-    trajectory.frenet_to_global_function().map(N)(left_boundary_frenet)[0];
-  const auto right_boundary_global =
-    trajectory.frenet_to_global_function().map(N)(right_boundary_frenet)[0];
-  left_boundary_polygon_msg_->polygon = build_polygon(left_boundary_global);
-  right_boundary_polygon_msg_->polygon = build_polygon(right_boundary_global);
+  right_boundary_polygon_msg_->polygon = build_polygon(right_x, right_y);
 }
 
 ROSTrajectoryVisualizer::~ROSTrajectoryVisualizer()
@@ -113,14 +108,16 @@ void ROSTrajectoryVisualizer::attach_ros_publishers(
     std::bind(&ROSTrajectoryVisualizer::on_static_vis_timer, this), vis_callback_group_);
 }
 
-Polygon ROSTrajectoryVisualizer::build_polygon(const casadi::DM & pts)
+Polygon ROSTrajectoryVisualizer::build_polygon(
+  const std::vector<double> & x,
+  const std::vector<double> & y)
 {
   Polygon polygon;
-  polygon.points.reserve(pts.size2());
-  for (int i = 0; i < pts.size2(); ++i) {
+  polygon.points.reserve(x.size());
+  for (size_t i = 0; i < x.size(); ++i) {
     auto & pt = polygon.points.emplace_back();
-    pt.x = static_cast<double>(pts(0, i));
-    pt.y = static_cast<double>(pts(1, i));
+    pt.x = x[i];
+    pt.y = y[i];
   }
   return polygon;
 }
@@ -18,7 +18,14 @@
 #include <memory>
 #include <vector>
 #include <algorithm>
-#include <execution>
+#include <chrono>
+#include <cmath>
+#include <filesystem>
+#include <iostream>
+#include <limits>
+#include <numeric>
+#include <stdexcept>
+#include <utility>
 
 #include <casadi/casadi.hpp>
 
@@ -30,230 +37,1000 @@ namespace vehicle_model
 {
 namespace racing_trajectory
 {
+namespace
+{
+// minimize sum_j K_j * |M_j * R + y_j|^2 + 1e-3 * |R|^2 with the rows M_j = [x_j^T u_j^T 1]
+// and the prediction errors y_j, K being the Epanechnikov kernel of the distances. the rows
+// are scaled by sqrt(K_j), so the normal equations only take one pass over the points.
+Eigen::MatrixXd fit_error_dynamics(
+  Eigen::MatrixXd M, Eigen::MatrixXd Y, const Eigen::ArrayXd & dists,
+  const double & dist_max)
+{
+  const Eigen::ArrayXd r = dists / dist_max;
+  const Eigen::ArrayXd w = std::sqrt(0.75 / dist_max) * (1.0 - r.square()).abs();
+  M.array().colwise() *= w;
+  Y.array().colwise() *= w;
+  Eigen::MatrixXd Q = 1e-3 * Eigen::MatrixXd::Identity(M.cols(), M.cols());
+  Q.selfadjointView<Eigen::Lower>().rankUpdate(M.transpose());
+  const Eigen::MatrixXd b = -M.transpose() * Y;
+  return Q.selfadjointView<Eigen::Lower>().ldlt().solve(b);
+}
+
+// indices shifted to a block of a horizontally stacked matrix
+std::vector<casadi_int> offset_indices(
+  const std::vector<casadi_int> & indices, const casadi_int & offset)
+{
+  std::vector<casadi_int> shifted(indices.size());
+  std::transform(
+    indices.begin(), indices.end(), shifted.begin(),
+    [&offset](const casadi_int & j) {return j + offset;});
+  return shifted;
+}
+// the laps kept by the recency and the rank of a retention policy, from the oldest lap to the
+// newest. the ranks are the laps from the best to the worst, the newer lap first on a tie.
+void rank_laps(
+  const std::vector<double> & costs, const SSRetentionPolicy & policy,
+  std::vector<bool> & kept, std::vector<bool> & recent, std::vector<size_t> & ranks)
+{
+  const size_t num_laps = costs.size();
+  kept.assign(num_laps, false);
+  recent.assign(num_laps, false);
+  // the newest lap is the current iteration, and always kept
+  const size_t num_recent = std::min(num_laps, std::max<size_t>(policy.num_recent, 1));
+  for (size_t j = num_laps - num_recent; j < num_laps; j++) {
+    kept[j] = recent[j] = true;
+  }
+  ranks.resize(num_laps);
+  std::iota(ranks.begin(), ranks.end(), 0);
+  std::stable_sort(
+    ranks.begin(), ranks.end(), [&costs](const size_t & a, const size_t & b) {
+      return costs[a] < costs[b] || (costs[a] == costs[b] && a > b);
+    });
+  for (size_t r = 0; r < std::min(num_laps, policy.num_best); r++) {
+    kept[ranks[r]] = true;
+  }
+}
+}  // namespace
+
+void SSMetric::validate(const casadi_int & num_states) const
+{
+  if (state_idxs.empty() || state_idxs.size() != weights.size()) {
+    throw std::invalid_argument("the metric needs one weight for every state index.");
+  }
+  for (size_t i = 0; i < state_idxs.size(); i++) {
+    if (state_idxs[i] < 0 || state_idxs[i] >= num_states) {
+      throw std::invalid_argument("the metric state index is out of range.");
+    }
+    if (!(weights[i] > 0.0)) {
+      throw std::invalid_argument("the metric weights must be positive.");
+    }
+  }
+}
+
+bool SSMetric::is_planar() const
+{
+  return state_idxs == std::vector<casadi_int>{0, 1} && weights == std::vector<double>{1.0, 1.0};
+}
+
 SSTrajectory::SSTrajectory(
-  const casadi::DM & x, const casadi::DM & u, const casadi::DM & k,
-  const casadi::DM & t, const double & total_length)
-: lap_(process_lap_data(x, u, k, t, total_length)),
-  tree_(lap_.x_repeat(0, casadi::Slice()).get_elements(),
-    lap_.x_repeat(1, casadi::Slice()).get_elements())
+  casadi::DM x, casadi::DM u, casadi::DM k,
+  const casadi::DM & t, const double & total_length,
+  const WaypointIndexType & index_type, const SSMetric & metric)
+: SSTrajectory(
+    process_lap_data(std::move(x), std::move(u), std::move(k), t, total_length),
+    static_cast<double>(t(-1)) - static_cast<double>(t(0)), index_type, metric, false)
 {
 }
 
+SSTrajectory::SSTrajectory(
+  SSTrajectoryData data, const double & lap_time,
+  const WaypointIndexType & index_type, const SSMetric & metric, const bool & downsampled)
+: lap_(std::move(data)), metric_(metric), index_type_(index_type), lap_time_(lap_time),
+  downsampled_(downsampled)
+{
+  metric_.validate(lap_.x_repeat.size1());
+  if (metric_.is_planar()) {
+    tree_ = make_waypoint_index(
+      index_type, lap_.x_repeat(0, casadi::Slice()).get_elements(),
+      lap_.x_repeat(1, casadi::Slice()).get_elements());
+    return;
+  }
+  // scale the states so that the weighted distance is euclidean
+  const auto nx = static_cast<size_t>(lap_.x_repeat.size1());
+  const auto num_dims = metric_.state_idxs.size();
+  const auto & states = lap_.x_repeat.nonzeros();
+  std::vector<double> features(states.size() / nx * num_dims);
+  for (size_t j = 0, f = 0; j < states.size(); j += nx) {
+    for (size_t d = 0; d < num_dims; d++, f++) {
+      features[f] = std::sqrt(metric_.weights[d]) *
+        states[j + static_cast<size_t>(metric_.state_idxs[d])];
+    }
+  }
+  feature_tree_ = std::make_unique<FeatureKDTree>(features, num_dims);
+}
+
 SSResult SSTrajectory::query(const SSQuery & query) const
 {
   SSResult result;
   std::vector<size_t> indices;
   indices.reserve(query.max_num_per_lap);
-  tree_.find_closest_waypoint_indices(
-    static_cast<double>(query.x(0)),
-    static_cast<double>(query.x(1)),
-    query.max_num_per_lap, indices);
+  find_points(query, indices);
+  std::vector<size_t> u_indices(indices.size());
+  std::transform(
+    indices.begin(), indices.end(), u_indices.begin(),
+    [this](const size_t & i) {return i % static_cast<size_t>(lap_.u.size2());});
   result.x = lap_.x_repeat(casadi::Slice(), indices);
+  result.u = lap_.u(casadi::Slice(), u_indices);
   result.J = lap_.J(casadi::Slice(), indices);
   return result;
 }
 
+void SSTrajectory::find_points(const SSQuery & query, std::vector<size_t> & indices) const
+{
+  if (feature_tree_) {
+    std::vector<double> features(metric_.state_idxs.size());
+    for (size_t d = 0; d < features.size(); d++) {
+      features[d] = std::sqrt(metric_.weights[d]) *
+        static_cast<double>(query.x(metric_.state_idxs[d]));
+    }
+    if (query.dist_max.is_empty()) {
+      feature_tree_->find_closest_indices(
+        features.data(), static_cast<size_t>(query.max_num_per_lap), indices);
+    } else {
+      std::vector<double> dists;
+      feature_tree_->find_within_radius(
+        features.data(), static_cast<double>(query.dist_max), indices, dists,
+        static_cast<size_t>(query.max_num_per_lap));
+    }
+    return;
+  }
+  if (query.dist_max.is_empty()) {
+    tree_->find_closest_waypoint_indices(
+      static_cast<double>(query.x(0)),
+      static_cast<double>(query.x(1)),
+      query.max_num_per_lap, indices);
+  } else {
+    // only the points within reach, from the closest
+    std::vector<double> dists;
+    dists.reserve(query.max_num_per_lap);
+    tree_->find_waypoints_within_radius(
+      static_cast<double>(query.x(0)),
+      static_cast<double>(query.x(1)),
+      static_cast<double>(query.dist_max), indices, dists, query.max_num_per_lap);
+  }
+}
+
+const SSTrajectoryData & SSTrajectory::data() const
+{
+  return lap_;
+}
+
+double SSTrajectory::lap_time() const
+{
+  return lap_time_;
+}
+
+double SSTrajectory::iteration_cost() const
+{
+  // cost-to-go of the first sample of the lap
+  return lap_.J.nonzeros()[static_cast<size_t>(lap_.x.size2())];
+}
+
+bool SSTrajectory::downsampled() const
+{
+  return downsampled_;
+}
+
+size_t SSTrajectory::memory_usage() const
+{
+  size_t num_values = 0;
+  for (const auto * m : {&lap_.x, &lap_.u, &lap_.k, &lap_.dt, &lap_.x_repeat, &lap_.J}) {
+    num_values += static_cast<size_t>(m->nnz());
+  }
+  size_t bytes = num_values * sizeof(double);
+  // every indexed point keeps its coordinates and its index
+  const auto tree_bytes = [](const size_t & num_points, const size_t & num_dims) {
+      return num_points * (num_dims * sizeof(double) + sizeof(size_t));
+    };
+  if (tree_) {
+    bytes += tree_bytes(static_cast<size_t>(lap_.x_repeat.size2()), 2);
+  }
+  if (feature_tree_) {
+    bytes += tree_bytes(feature_tree_->size(), feature_tree_->num_dims());
+  }
+  std::shared_lock<std::shared_mutex> lock(regression_mutex_);
+  for (const auto & [features, index] : regression_indexes_) {
+    bytes += tree_bytes(index->size(), index->num_dims());
+  }
+  return bytes;
+}
+
+SSTrajectory::UniquePtr SSTrajectory::downsample(const double & spacing) const
+{
+  // walk along the lap and keep the samples at least spacing away from the last kept one,
+  // in the metric. the first and the last samples are always kept.
+  const auto num_samples = lap_.x.size2();
+  const auto nx = static_cast<size_t>(lap_.x.size1());
+  const auto & x = lap_.x.nonzeros();
+  const auto distance_sq = [&](const size_t & i, const size_t & j) {
+      double d = 0.0;
+      for (size_t m = 0; m < metric_.state_idxs.size(); m++) {
+        const auto s = static_cast<size_t>(metric_.state_idxs[m]);
+        d += metric_.weights[m] * (x[i * nx + s] - x[j * nx + s]) * (x[i * nx + s] - x[j * nx + s]);
+      }
+      return d;
+    };
+  std::vector<casadi_int> samples{0};
+  for (casadi_int j = 1; j + 1 < num_samples; j++) {
+    if (distance_sq(static_cast<size_t>(samples.back()), static_cast<size_t>(j)) >=
+      spacing * spacing)
+    {
+      samples.push_back(j);
+    }
+  }
+  samples.push_back(num_samples - 1);
+
+  // the kept samples keep their cost-to-go, and step to the next kept sample
+  SSTrajectoryData data;
+  data.x = lap_.x(casadi::Slice(), samples);
+  data.u = lap_.u(casadi::Slice(), samples);
+  data.k = lap_.k(casadi::Slice(), samples);
+  data.dt = casadi::DM::zeros(1, static_cast<casadi_int>(samples.size()));
+  const auto & dt = lap_.dt.nonzeros();
+  for (size_t i = 0; i + 1 < samples.size(); i++) {
+    for (auto j = samples[i]; j < samples[i + 1]; j++) {
+      data.dt.nonzeros()[i] += dt[static_cast<size_t>(j)];
+    }
+  }
+  data.dt.nonzeros().back() = data.dt.nonzeros()[samples.size() - 2];
+  std::vector<casadi_int> repeat_samples;
+  repeat_samples.reserve(3 * samples.size());
+  for (casadi_int copy = 0; copy < 3; copy++) {
+    for (const auto & j : samples) {
+      repeat_samples.push_back(j + copy * num_samples);
+    }
+  }
+  data.x_repeat = lap_.x_repeat(casadi::Slice(), repeat_samples);
+  data.J = lap_.J(casadi::Slice(), repeat_samples);
+  return std::unique_ptr<SSTrajectory>(
+    new SSTrajectory(std::move(data), lap_time_, index_type_, metric_, true));
+}
+
 std::vector<RegResult> SSTrajectory::query(const RegQuery & query) const
 {
   std::vector<RegResult> results;
+  results.reserve(query.reg_out_state_idxs.size());
+  const auto z = query.x.get_elements();
 
-  for (casadi_int i = 0; i < static_cast<casadi_int>(query.reg_out_state_idxs.size()); i++) {
+  for (size_t i = 0; i < query.reg_out_state_idxs.size(); i++) {
     auto & result = results.emplace_back();
     if (query.reg_out_state_idxs[i].size() != 1) {
       throw std::invalid_argument("Only one state variable is supported in every regression");
     }
 
-    // slice the x matrix to get the regression input
-    // the last x is not considered since no xip1 is available for it
-    casadi::DM x_data = lap_.x(query.reg_in_state_idxs[i], casadi::Slice(0, -1));
-    casadi::DM u_data = lap_.u(query.reg_in_control_idxs[i], casadi::Slice(0, -1));
-    casadi::DM xip1_data = lap_.x(
-      query.reg_in_state_idxs[i], casadi::Slice(
-        1,
-        std::numeric_limits<casadi_int>::max()));
-    casadi::DM k_data = lap_.k(casadi::Slice(), casadi::Slice(0, -1));
-    casadi::DM dt_data = lap_.dt(casadi::Slice(), casadi::Slice(0, -1));
-
-    // stack x and u
-    casadi::DM z_data = casadi::DM::vertcat({x_data, u_data});
-    // compute distance to the query point. sort the points by distance.
-    result.dists = casadi::DM::sqrt(
-      casadi::DM::sum1(
-        casadi::DM::pow(
-          z_data - casadi::DM::repmat(query.x, 1, z_data.size2()), 2)));
-    // create a mask to filter out the points that are too far away
-    const auto mask = result.dists < query.dist_max;
-    x_data = x_data(casadi::Slice(), mask);
-    u_data = u_data(casadi::Slice(), mask);
-    xip1_data = xip1_data(casadi::Slice(), mask);
-    k_data = k_data(casadi::Slice(), mask);
-    dt_data = dt_data(casadi::Slice(), mask);
-    result.dists = result.dists(mask);
-    // if there are no points left, skip the sort
-    if (x_data.size2() == 0) {
+    // only the samples within dist_max of the query, from the closest
+    const auto index =
+      regression_index({query.reg_in_state_idxs[i], query.reg_in_control_idxs[i]});
+    if (z.size() != index->num_dims()) {
+      throw std::invalid_argument("the regression query must have one entry per input.");
+    }
+    std::vector<size_t> samples;
+    std::vector<double> dists;
+    index->find_within_radius(z.data(), query.dist_max, samples, dists);
+    if (samples.empty()) {
       continue;
     }
 
-    // convert to eigen and compute the sorted indices
-    auto dist_vec = result.dists.get_elements();
-    Eigen::Map<Eigen::VectorXd> dist_eigen(dist_vec.data(), dist_vec.size());
-    Eigen::VectorXi idx = Eigen::VectorXi::LinSpaced(dist_vec.size(), 0, dist_vec.size() - 1);
-    std::sort(
-      idx.data(), idx.data() + idx.size(),
-      [&dist_eigen](size_t i1, size_t i2) {return dist_eigen(i1) < dist_eigen(i2);});
-    // convert idx to std vector
-    std::vector<casadi_int> idx_vec(idx.data(), idx.data() + idx.size());
-    // slice the data according to the sorted indices
-    result.xs = x_data(casadi::Slice(), idx_vec);
-    result.us = u_data(casadi::Slice(), idx_vec);
-    result.xip1s = xip1_data(casadi::Slice(), idx_vec);
-    result.ks = k_data(casadi::Slice(), idx_vec);
-    result.dts = dt_data(casadi::Slice(), idx_vec);
+    // slice the data of the samples, and the states after them
+    const std::vector<casadi_int> idx(samples.begin(), samples.end());
+    std::vector<casadi_int> next_idx(idx.size());
+    std::transform(
+      idx.begin(), idx.end(), next_idx.begin(),
+      [](const casadi_int & j) {return j + 1;});
+    result.xs = lap_.x(query.reg_in_state_idxs[i], idx);
+    result.us = lap_.u(query.reg_in_control_idxs[i], idx);
+    result.xip1s = lap_.x(query.reg_in_state_idxs[i], next_idx);
+    result.ks = lap_.k(casadi::Slice(), idx);
+    result.dts = lap_.dt(casadi::Slice(), idx);
+    result.dists = casadi::DM(dists);
   }
   return results;
 }
 
+FeatureKDTree::SharedPtr SSTrajectory::regression_index(const RegFeatureIdxs & features) const
+{
+  {
+    std::shared_lock<std::shared_mutex> lock(regression_mutex_);
+    const auto it = regression_indexes_.find(features);
+    if (it != regression_indexes_.end()) {
+      return it->second;
+    }
+  }
+
+  // build outside of the lock, so that queries of the other inputs keep going
+  const auto & [state_idxs, control_idxs] = features;
+  const auto nx = static_cast<size_t>(lap_.x.size1());
+  const auto nu = static_cast<size_t>(lap_.u.size1());
+  for (const auto & j : state_idxs) {
+    if (j < 0 || static_cast<size_t>(j) >= nx) {
+      throw std::invalid_argument("the regression state index is out of range.");
+    }
+  }
+  for (const auto & j : control_idxs) {
+    if (j < 0 || static_cast<size_t>(j) >= nu) {
+      throw std::invalid_argument("the regression control index is out of range.");
+    }
+  }
+  const auto & x = lap_.x.nonzeros();
+  const auto & u = lap_.u.nonzeros();
+  const auto num_samples = static_cast<size_t>(lap_.x.size2()) - 1;
+  std::vector<double> points;
+  points.reserve(num_samples * (state_idxs.size() + control_idxs.size()));
+  for (size_t k = 0; k < num_samples; k++) {
+    for (const auto & j : state_idxs) {
+      points.push_back(x[k * nx + static_cast<size_t>(j)]);
+    }
+    for (const auto & j : control_idxs) {
+      points.push_back(u[k * nu + static_cast<size_t>(j)]);
+    }
+  }
+  auto index = std::make_shared<FeatureKDTree>(points, state_idxs.size() + control_idxs.size());
+
+  std::unique_lock<std::shared_mutex> lock(regression_mutex_);
+  // another query may have built it in the meantime
+  return regression_indexes_.emplace(features, std::move(index)).first->second;
+}
+
 SSTrajectoryData SSTrajectory::process_lap_data(
-  const casadi::DM & x, const casadi::DM & u,
-  const casadi::DM & k, const casadi::DM & t,
-  const double & total_length) const
+  casadi::DM x, casadi::DM u, casadi::DM k, const casadi::DM & t,
+  const double & total_length)
 {
+  if (x.size2() < 2 || u.size2() != x.size2() || k.size2() != x.size2() ||
+    t.size2() != x.size2())
+  {
+    throw std::invalid_argument("the lap data must have the same number of columns.");
+  }
   SSTrajectoryData data;
   const auto J = casadi::DM::linspace(x.size2() - 1, 0, x.size2()).T();
   auto x_offset = casadi::DM::zeros(x.size1(), x.size2());
   x_offset(0, casadi::Slice()) = total_length;
   data.x_repeat = casadi::DM::horzcat({x - x_offset, x, x + x_offset});
-  data.u = u;
-  data.k = k;
+  data.u = std::move(u);
+  data.k = std::move(k);
   data.J = casadi::DM::horzcat({J + x.size2() - 1, J, J - x.size2() + 1});
-  data.x = x;
+  data.x = std::move(x);
   data.dt =
     t(casadi::Slice(), casadi::Slice(0, -1)) - t(
     casadi::Slice(), casadi::Slice(
       1,
       std::numeric_limits<casadi_int>::max()));
   data.dt = casadi::DM::horzcat({data.dt, data.dt(casadi::Slice(), -1)});
+  // the queries read the samples straight out of the dense storage
+  for (auto * m : {&data.x, &data.u, &data.k, &data.dt, &data.x_repeat, &data.J}) {
+    if (!m->is_dense()) {
+      *m = casadi::DM::densify(*m);
+    }
+  }
   return data;
 }
 
-SafeSetManager::SafeSetManager(const size_t & max_lap_stored)
-: laps_(max_lap_stored)
+SafeSetManager::SafeSetManager(
+  const size_t & max_lap_stored,
+  const WaypointIndexType & index_type, const SSMetric & metric,
+  Executor::SharedPtr executor)
+: SafeSetManager(
+    SSRetentionPolicy{max_lap_stored, 0, LapRanking::LAP_TIME,
+      std::numeric_limits<size_t>::max(), 0.0},
+    index_type, metric, std::move(executor))
 {
 }
 
+SafeSetManager::SafeSetManager(
+  const SSRetentionPolicy & retention,
+  const WaypointIndexType & index_type, const SSMetric & metric,
+  Executor::SharedPtr executor)
+: laps_(std::make_shared<const LapSnapshot>()), retention_(retention),
+  index_type_(index_type), metric_(metric),
+  regression_features_(std::make_shared<const std::vector<RegFeatureIdxs>>()),
+  executor_(std::move(executor)), safe_set_profiler_(PROFILE_WINDOW),
+  regression_profiler_(PROFILE_WINDOW)
+{
+  if (!executor_) {
+    throw std::invalid_argument("the safe set needs an executor.");
+  }
+  if (!(retention_.downsample_spacing >= 0.0)) {
+    throw std::invalid_argument("the downsample spacing must not be negative.");
+  }
+  metric_.validate(std::numeric_limits<casadi_int>::max());
+  add_thread_ = std::thread(&SafeSetManager::add_loop, this);
+}
+
+SafeSetManager::~SafeSetManager()
+{
+  {
+    std::lock_guard<std::mutex> lock(add_mutex_);
+    stop_adding_ = true;
+  }
+  add_cv_.notify_all();
+  add_thread_.join();
+}
+
 void SafeSetManager::add_lap(
-  const casadi::DM & x, const casadi::DM & u, const casadi::DM & k,
+  casadi::DM x, casadi::DM u, casadi::DM k,
   const casadi::DM & t, const double & total_length)
 {
-  auto traj = std::make_unique<SSTrajectory>(x, u, k, t, total_length);
-  std::unique_lock<std::shared_mutex> lock(mutex_);
-  laps_.push_back(std::move(traj));
+  auto lap = std::make_unique<SSTrajectory>(
+    std::move(x), std::move(u), std::move(k), t, total_length, index_type_, metric_);
+  // index the regression inputs queried so far, so that the queries do not build them
+  for (const auto & features : *std::atomic_load(&regression_features_)) {
+    build_regression_index(*lap, features);
+  }
+  publish_lap(std::move(lap));
+}
+
+std::future<void> SafeSetManager::add_lap_async(
+  casadi::DM x, casadi::DM u, casadi::DM k, casadi::DM t,
+  const double & total_length)
+{
+  // the lap data is moved into the task, so the caller thread only queues it
+  return add_lap_async_task(
+    std::packaged_task<void()>(
+      [this, x = std::move(x), u = std::move(u), k = std::move(k), t = std::move(t),
+      total_length]() mutable {
+        add_lap(std::move(x), std::move(u), std::move(k), t, total_length);
+      }));
+}
+
+std::future<void> SafeSetManager::add_lap_async_task(std::packaged_task<void()> task)
+{
+  auto future = task.get_future();
+  {
+    std::lock_guard<std::mutex> lock(add_mutex_);
+    add_queue_.push_back(std::move(task));
+  }
+  add_cv_.notify_one();
+  return future;
+}
+
+void SafeSetManager::flush()
+{
+  // the laps are added in order, so an empty task finishes after all the queued laps
+  add_lap_async_task(std::packaged_task<void()>([]() {})).wait();
+}
+
+void SafeSetManager::publish_lap(SSTrajectory::UniquePtr lap)
+{
+  if (retention_.num_recent == 0 && retention_.num_best == 0) {
+    return;
+  }
+  // copy the lap pointers into a new snapshot. the readers keep the old one.
+  std::lock_guard<std::mutex> lock(publish_mutex_);
+  const auto current = std::atomic_load(&laps_);
+  const size_t num_laps = current->laps.size();
+  auto candidates = current->laps;
+  candidates.emplace_back(std::move(lap));
+  const auto kept = retain_laps(candidates);
+
+  auto next = std::make_shared<LapSnapshot>();
+  std::vector<int64_t> positions(candidates.size(), -1);
+  std::vector<size_t> replaced;  // previous laps replaced by their downsampled version
+  for (size_t j = 0; j < candidates.size(); j++) {
+    if (!kept[j]) {
+      continue;
+    }
+    positions[j] = static_cast<int64_t>(next->laps.size());
+    next->laps.push_back(candidates[j]);
+    if (j < num_laps && candidates[j] != current->laps[j]) {
+      replaced.push_back(j);
+    }
+  }
+  // a downsampled lap has not seen the regression queries yet
+  const auto features = std::atomic_load(&regression_features_);
+  for (const auto & j : replaced) {
+    for (const auto & feature : *features) {
+      build_regression_index(*candidates[j], feature);
+    }
+  }
+
+  // merge the new lap into the index. the evicted laps are dropped, and the downsampled laps
+  // are merged again in their position. the multi-lap index only serves the planar metric.
+  if (metric_.is_planar()) {
+    const auto merge = [&next](
+      const SafeSetIndex & previous, const std::vector<int64_t> & lap_map,
+      const SSTrajectory & lap, const int64_t & position) {
+        const auto & x_repeat = lap.data().x_repeat;
+        next->index = SafeSetIndex(
+          previous, lap_map, x_repeat(0, casadi::Slice()).get_elements(),
+          x_repeat(1, casadi::Slice()).get_elements(), static_cast<uint32_t>(position));
+      };
+    std::vector<int64_t> lap_map(positions.begin(), positions.begin() + num_laps);
+    for (const auto & j : replaced) {
+      lap_map[j] = -1;
+    }
+    merge(current->index, lap_map, *candidates.back(), positions.back());
+    for (const auto & j : replaced) {
+      lap_map.resize(next->index.num_laps());
+      std::iota(lap_map.begin(), lap_map.end(), 0);
+      lap_map[positions[j]] = -1;
+      const auto previous = next->index;
+      merge(previous, lap_map, *candidates[j], positions[j]);
+    }
+  }
+  std::atomic_store(&laps_, std::shared_ptr<const LapSnapshot>(std::move(next)));
+}
+
+std::vector<bool> SafeSetManager::retain_laps(std::vector<SSTrajectory::SharedPtr> & laps) const
+{
+  const size_t num_laps = laps.size();
+  std::vector<double> costs(num_laps);
+  for (size_t j = 0; j < num_laps; j++) {
+    costs[j] = retention_.ranking == LapRanking::LAP_TIME ?
+      laps[j]->lap_time() : laps[j]->iteration_cost();
+  }
+  std::vector<bool> kept, recent;
+  std::vector<size_t> ranks;
+  rank_laps(costs, retention_, kept, recent, ranks);
+
+  // the old laps kept for their cost only serve the terminal constraint. thin them out.
+  if (retention_.downsample_spacing > 0.0) {
+    for (size_t j = 0; j < num_laps; j++) {
+      if (kept[j] && !recent[j] && !laps[j]->downsampled()) {
+        laps[j] = laps[j]->downsample(retention_.downsample_spacing);
+      }
+    }
+  }
+
+  // enforce the memory budget, from the worst of the older laps
+  size_t bytes = 0;
+  for (size_t j = 0; j < num_laps; j++) {
+    bytes += kept[j] ? laps[j]->memory_usage() : 0;
+  }
+  for (auto it = ranks.rbegin(); it != ranks.rend() && bytes > retention_.max_bytes; it++) {
+    if (kept[*it] && *it != num_laps - 1) {
+      kept[*it] = false;
+      bytes -= laps[*it]->memory_usage();
+    }
+  }
+  return kept;
+}
+
+std::future<void> SafeSetManager::attach(
+  LapArchive::SharedPtr archive, const std::optional<uint64_t> & trajectory_id)
+{
+  // select the laps from the directory, so that only those are paged in
+  std::vector<size_t> laps;
+  std::vector<double> costs;
+  for (size_t i = 0; i < archive->entries().size(); i++) {
+    const auto & entry = archive->entries()[i];
+    if (trajectory_id && entry.trajectory_id != *trajectory_id) {
+      continue;
+    }
+    laps.push_back(i);
+    // the cost-to-go of the first sample is the number of steps
+    costs.push_back(
+      retention_.ranking == LapRanking::LAP_TIME ?
+      entry.lap_time : static_cast<double>(entry.num_samples) - 1.0);
+  }
+  std::vector<bool> kept, recent;
+  std::vector<size_t> ranks;
+  rank_laps(costs, retention_, kept, recent, ranks);
+  std::vector<size_t> selected;
+  for (size_t j = 0; j < laps.size(); j++) {
+    if (kept[j]) {
+      selected.push_back(laps[j]);
+    }
+  }
+
+  // load them in the background, from the oldest
+  return add_lap_async_task(
+    std::packaged_task<void()>(
+      [this, archive = std::move(archive), selected = std::move(selected)]() {
+        for (const auto & i : selected) {
+          try {
+            auto lap = archive->load(i);
+            add_lap(std::move(lap.x), std::move(lap.u), std::move(lap.k), lap.t, lap.total_length);
+          } catch (const std::exception & e) {
+            std::cerr << "Failed to load lap " << archive->entries()[i].lap_id <<
+              " from the archive: " << e.what() << std::endl;
+          }
+        }
+      }));
+}
+
+void SafeSetManager::add_loop()
+{
+  while (true) {
+    std::packaged_task<void()> task;
+    {
+      std::unique_lock<std::mutex> lock(add_mutex_);
+      add_cv_.wait(lock, [this]() {return stop_adding_ || !add_queue_.empty();});
+      if (add_queue_.empty()) {
+        // stopped, and every queued lap is added
+        return;
+      }
+      task = std::move(add_queue_.front());
+      add_queue_.pop_front();
+    }
+    // exceptions are stored in the future
+    task();
+  }
 }
 
 SSResult SafeSetManager::query(const SSQuery & query)
 {
   SSResult result;
-  casadi::DMVector x;
-  casadi::DMVector J;
-  x.reserve(laps_.size());
-  J.reserve(laps_.size());
+  this->query(query, result);
+  return result;
+}
+
+void SafeSetManager::query(const SSQuery & query, SSResult & result)
+{
+  const auto start = std::chrono::steady_clock::now();
+  find_safe_set(query, result);
+  safe_set_profiler_.add_cycle_stats(std::chrono::steady_clock::now() - start);
+}
+
+lmpc::utils::Profile<> SafeSetManager::safe_set_query_profile()
+{
+  return safe_set_profiler_.profile();
+}
+
+lmpc::utils::Profile<> SafeSetManager::regression_query_profile()
+{
+  return regression_profiler_.profile();
+}
+
+const Executor & SafeSetManager::executor() const
+{
+  return *executor_;
+}
 
-  casadi_int num_total = 0;
-  std::shared_lock<std::shared_mutex> lock(mutex_);
-  // iterate from the last lap to the first lap
-  for (auto it = laps_.rbegin(); num_total < query.max_num_total && it != laps_.rend(); ++it) {
-    const auto result_lap = (*it)->query(query);
-    x.push_back(result_lap.x);
-    J.push_back(result_lap.J);
-    num_total += result_lap.x.size2();
+void SafeSetManager::find_safe_set(const SSQuery & query, SSResult & result)
+{
+  const auto snapshot = std::atomic_load(&laps_);
+  const auto & laps = snapshot->laps;
+  if (laps.empty()) {
+    result = SSResult();
+    return;
   }
-  lock.unlock();
+  const auto max_num_per_lap = static_cast<size_t>(std::max<casadi_int>(query.max_num_per_lap, 0));
+  const auto max_num_total = static_cast<size_t>(std::max<casadi_int>(query.max_num_total, 0));
+  const double radius = query.dist_max.is_empty() ?
+    std::numeric_limits<double>::infinity() : static_cast<double>(query.dist_max);
 
-  result.x = casadi::DM::horzcat(x);
-  result.J = casadi::DM::horzcat(J);
+  std::vector<SafeSetIndex::Neighbor> neighbors;
+  const bool found = metric_.is_planar() && snapshot->index.query(
+    static_cast<double>(query.x(0)), static_cast<double>(query.x(1)), max_num_per_lap,
+    max_num_total, radius, neighbors);
+  if (!found && max_num_per_lap > 0) {
+    // too far from the grid, or a weighted metric.
+    // search the laps one by one, from the last lap to the first lap.
+    std::vector<size_t> indices;
+    for (size_t j = laps.size(); j-- > 0 && neighbors.size() < max_num_total; ) {
+      indices.clear();
+      laps[j]->find_points(query, indices);
+      for (size_t i = 0; i < indices.size() && neighbors.size() < max_num_total; i++) {
+        neighbors.push_back(
+          {static_cast<uint32_t>(j), static_cast<uint32_t>(indices[i]), 0.0});
+      }
+    }
+  }
 
-  if (result.x.size2() > query.max_num_total) {
-    result.x = result.x(casadi::Slice(), casadi::Slice(0, query.max_num_total));
-    result.J = result.J(casadi::Slice(), casadi::Slice(0, query.max_num_total));
+  // copy the columns of the points into dense buffers
+  const auto nx = laps.front()->data().x_repeat.size1();
+  const auto nu = laps.front()->data().u.size1();
+  const auto n = static_cast<casadi_int>(neighbors.size());
+  const auto resize = [](casadi::DM & m, const casadi_int & rows, const casadi_int & cols) {
+      if (m.size1() != rows || m.size2() != cols || !m.is_dense()) {
+        m = casadi::DM(casadi::Sparsity::dense(rows, cols));
+      }
+    };
+  resize(result.x, nx, n);
+  resize(result.u, nu, n);
+  resize(result.J, 1, n);
+  auto x_it = result.x.nonzeros().begin();
+  auto u_it = result.u.nonzeros().begin();
+  auto J_it = result.J.nonzeros().begin();
+  for (const auto & neighbor : neighbors) {
+    const auto & data = laps[neighbor.lap]->data();
+    const auto u_index = neighbor.index % static_cast<size_t>(data.u.size2());
+    x_it = std::copy_n(data.x_repeat.nonzeros().begin() + nx * neighbor.index, nx, x_it);
+    u_it = std::copy_n(data.u.nonzeros().begin() + nu * u_index, nu, u_it);
+    *J_it++ = data.J.nonzeros()[neighbor.index];
   }
-  return result;
 }
 
 RegResult SafeSetManager::query(const RegQuery & query)
 {
-  // parallelly query all the laps
-  std::vector<std::vector<RegResult>> results(laps_.size());
-  std::shared_lock<std::shared_mutex> lock(mutex_);
-  std::transform(
-    std::execution::par_unseq,
-    laps_.begin(), laps_.end(), results.begin(),
-    [&query](const auto & lap) {return lap->query(query);});
-  lock.unlock();
+  const auto start = std::chrono::steady_clock::now();
+  auto result = regress(query);
+  regression_profiler_.add_cycle_stats(std::chrono::steady_clock::now() - start);
+  return result;
+}
+
+RegResult SafeSetManager::regress(const RegQuery & query)
+{
+  if (query.reg_in_state_idxs.size() != query.reg_out_state_idxs.size() ||
+    query.reg_in_control_idxs.size() != query.reg_out_state_idxs.size())
+  {
+    throw std::invalid_argument(
+            "the regression state, control and output indices must have the same length.");
+  }
+  const auto num_stages = static_cast<size_t>(query.x.size2());
+  const auto stage_cols = [&num_stages](const casadi::DM & m) {
+      if (num_stages == 0 || m.size2() % static_cast<casadi_int>(num_stages) != 0) {
+        throw std::invalid_argument("A, B and C must have one block per query stage.");
+      }
+      return m.size2() / static_cast<casadi_int>(num_stages);
+    };
+  const auto A_cols = stage_cols(query.A);
+  const auto B_cols = stage_cols(query.B);
+  const auto C_cols = stage_cols(query.C);
+  const auto z = casadi::DM::densify(query.x).nonzeros();
+  const auto num_inputs = static_cast<size_t>(query.x.size1());
 
-  // aggregate the results and perform regression
+  // the nominal model evaluator is rebuilt only when the model changes
+  auto nominal_model = std::atomic_load(&nominal_model_);
+  if (!nominal_model || nominal_model->function().get() != query.f.get()) {
+    nominal_model = std::make_shared<const BatchEvaluator>(query.f, executor_);
+    std::atomic_store(&nominal_model_, nominal_model);
+  }
+
+  const auto snapshot = std::atomic_load(&laps_);
+  const auto & laps = snapshot->laps;
   RegResult result;
   result.A = query.A;
   result.B = query.B;
   result.C = query.C;
-  for (casadi_int i = 0; i < static_cast<casadi_int>(query.reg_out_state_idxs.size()); i++) {
-    // concatenate the results from all the laps
-    casadi::DM xs;
-    casadi::DM us;
-    casadi::DM xip1s;
-    casadi::DM dists;
-    casadi::DM ks;
-    casadi::DM dts;
-    for (const auto & lap_result : results) {
-      xs = casadi::DM::horzcat({xs, lap_result[i].xs});
-      us = casadi::DM::horzcat({us, lap_result[i].us});
-      xip1s = casadi::DM::horzcat({xip1s, lap_result[i].xip1s});
-      dists = casadi::DM::vertcat({dists, lap_result[i].dists});
-      ks = casadi::DM::horzcat({ks, lap_result[i].ks});
-      dts = casadi::DM::horzcat({dts, lap_result[i].dts});
-    }
-    // if there are no points left, skip the regression
-    if (xs.size2() == 0) {
+  for (size_t i = 0; i < query.reg_out_state_idxs.size(); i++) {
+    if (query.reg_out_state_idxs[i].size() != 1) {
+      throw std::invalid_argument("Only one state variable is supported in every regression");
+    }
+    const auto & state_idxs = query.reg_in_state_idxs[i];
+    const auto & control_idxs = query.reg_in_control_idxs[i];
+    std::vector<FeatureKDTree::SharedPtr> indexes;
+    indexes.reserve(laps.size());
+    for (const auto & lap : laps) {
+      indexes.push_back(lap->regression_index({state_idxs, control_idxs}));
+      if (indexes.back()->num_dims() != num_inputs) {
+        throw std::invalid_argument("the regression query must have one entry per input.");
+      }
+    }
+    // the inputs are valid for the laps, so index them in the laps added later
+    if (!laps.empty()) {
+      register_regression_features({state_idxs, control_idxs});
+    }
+
+    // parallelly search the neighbors of every stage in every lap
+    std::vector<std::vector<std::vector<size_t>>> samples(
+      num_stages, std::vector<std::vector<size_t>>(laps.size()));
+    std::vector<std::vector<std::vector<double>>> dists(
+      num_stages, std::vector<std::vector<double>>(laps.size()));
+    executor_->parallel_for(
+      num_stages, [&](const size_t & s) {
+        for (size_t l = 0; l < laps.size(); l++) {
+          indexes[l]->find_within_radius(
+            z.data() + s * num_inputs, query.dist_max, samples[s][l], dists[s][l]);
+        }
+      });
+
+    // the stages share their neighbors, which are gathered and evaluated once
+    std::vector<std::vector<casadi_int>> lap_samples(laps.size());
+    std::vector<casadi_int> lap_offsets(laps.size() + 1, 0);
+    for (size_t l = 0; l < laps.size(); l++) {
+      for (size_t s = 0; s < num_stages; s++) {
+        lap_samples[l].insert(lap_samples[l].end(), samples[s][l].begin(), samples[s][l].end());
+      }
+      std::sort(lap_samples[l].begin(), lap_samples[l].end());
+      lap_samples[l].erase(
+        std::unique(lap_samples[l].begin(), lap_samples[l].end()), lap_samples[l].end());
+      lap_offsets[l + 1] = lap_offsets[l] + static_cast<casadi_int>(lap_samples[l].size());
+    }
+    const auto num_points = lap_offsets.back();
+    // if there are no points, skip the regression
+    if (num_points == 0) {
       continue;
     }
-    // predict the next state
-    const auto xip1s_pred =
-      query.f.map(xs.size2())(
-      casadi::DMDict{{"x", xs}, {"u", us}, {"k", ks},
-        {"dt", dts}}).at("xip1");
-    // compute Epanechnikov kernel weights
-    const auto K = 0.75 / query.dist_max *
-      casadi::DM::pow(1 - casadi::DM::pow(dists / query.dist_max, 2), 2);
-    // compute the regression matrices
-    const auto reg_x_data = casadi::DM::horzcat({xs.T(), us.T()});
-    const auto reg_y_data = xip1s.T() - xip1s_pred(query.reg_in_state_idxs[i], casadi::Slice()).T();
-    const auto M = casadi::DM::horzcat({reg_x_data, casadi::DM::ones(reg_x_data.size1(), 1)});
-    const auto Q = M.T() * casadi::DM::diag(K) * M + 1e-3 * casadi::DM::eye(M.size2());
-    const auto b = -M.T() * casadi::DM::diag(K) * reg_y_data;
-    // solve the regression
-    const auto R = casadi::DM::solve(Q, b);
-    // extract the regression results
-    const auto dA = R(casadi::Slice(0, static_cast<casadi_int>(query.reg_in_state_idxs[i].size())));
-    const auto dB =
-      R(casadi::Slice(static_cast<casadi_int>(query.reg_in_state_idxs[i].size()), -1));
-    const auto dC = R(-1);
-    // update the regression results
-    result.A(query.reg_out_state_idxs[i], query.reg_in_state_idxs[i]) += dA;
-    result.B(query.reg_out_state_idxs[i], query.reg_in_control_idxs[i]) += dB;
-    result.C(query.reg_out_state_idxs[i]) += dC;
+    std::vector<casadi::DM> xs(laps.size()), us(laps.size()), xip1s(laps.size());
+    std::vector<casadi::DM> ks(laps.size()), dts(laps.size());
+    for (size_t l = 0; l < laps.size(); l++) {
+      const auto & data = laps[l]->data();
+      xs[l] = data.x(state_idxs, lap_samples[l]);
+      us[l] = data.u(control_idxs, lap_samples[l]);
+      xip1s[l] = data.x(state_idxs, offset_indices(lap_samples[l], 1));
+      ks[l] = data.k(casadi::Slice(), lap_samples[l]);
+      dts[l] = data.dt(casadi::Slice(), lap_samples[l]);
+    }
+    // predict the next state with the cached evaluator of the nominal model
+    const auto x_all = casadi::DM::densify(casadi::DM::horzcat(xs));
+    const auto u_all = casadi::DM::densify(casadi::DM::horzcat(us));
+    const auto k_all = casadi::DM::densify(casadi::DM::horzcat(ks));
+    const auto dt_all = casadi::DM::densify(casadi::DM::horzcat(dts));
+    const auto & f = nominal_model->function();
+    std::vector<const double *> model_inputs(f.n_in(), nullptr);
+    for (const auto & [name, input] :
+      {std::make_pair("x", &x_all), std::make_pair("u", &u_all), std::make_pair("k", &k_all),
+        std::make_pair("dt", &dt_all)})
+    {
+      const auto j = f.index_in(name);
+      if (f.nnz_in(j) != input->size1()) {
+        throw std::invalid_argument(
+          std::string("the nominal model input ") + name + " does not match the safe set.");
+      }
+      model_inputs[j] = input->nonzeros().data();
+    }
+    const auto xip1_idx = f.index_out("xip1");
+    Eigen::MatrixXd xip1s_pred(f.nnz_out(xip1_idx), num_points);
+    std::vector<double *> model_outputs(f.n_out(), nullptr);
+    model_outputs[xip1_idx] = xip1s_pred.data();
+    nominal_model->evaluate(model_inputs, static_cast<size_t>(num_points), model_outputs);
+
+    const auto xip1s_all = casadi::DM::densify(casadi::DM::horzcat(xip1s));
+    using ConstMap = Eigen::Map<const Eigen::MatrixXd>;
+    const ConstMap xip1_map(xip1s_all.nonzeros().data(), xip1s_all.size1(), num_points);
+    Eigen::MatrixXd error_map(xip1_map.rows(), num_points);
+    for (Eigen::Index r = 0; r < error_map.rows(); r++) {
+      if (state_idxs[r] >= xip1s_pred.rows()) {
+        throw std::invalid_argument("the regression state index is out of the nominal model.");
+      }
+      error_map.row(r) = xip1_map.row(r) - xip1s_pred.row(state_idxs[r]);
+    }
+    const auto inputs = casadi::DM::vertcat({x_all, u_all});
+    const ConstMap input_map(inputs.nonzeros().data(), inputs.size1(), num_points);
+
+    // parallelly fit every stage on its own neighbors
+    std::vector<Eigen::MatrixXd> fits(num_stages);
+    executor_->parallel_for(
+      num_stages, [&](const size_t & s) {
+        Eigen::Index n = 0;
+        for (const auto & lap_neighbors : samples[s]) {
+          n += static_cast<Eigen::Index>(lap_neighbors.size());
+        }
+        if (n == 0) {
+          return;
+        }
+        Eigen::MatrixXd M(n, input_map.rows() + 1);
+        Eigen::MatrixXd Y(n, error_map.rows());
+        Eigen::ArrayXd d(n);
+        Eigen::Index j = 0;
+        for (size_t l = 0; l < laps.size(); l++) {
+          for (size_t m = 0; m < samples[s][l].size(); m++, j++) {
+            const auto c = lap_offsets[l] + (std::lower_bound(
+                lap_samples[l].begin(), lap_samples[l].end(),
+                static_cast<casadi_int>(samples[s][l][m])) - lap_samples[l].begin());
+            M.row(j) << input_map.col(c).transpose(), 1.0;
+            Y.row(j) = error_map.col(c).transpose();
+            d(j) = dists[s][l][m];
+          }
+        }
+        fits[s] = fit_error_dynamics(std::move(M), std::move(Y), d, query.dist_max);
+      });
+
+    // update the regression results of every stage
+    const auto ns = static_cast<casadi_int>(state_idxs.size());
+    for (size_t s = 0; s < num_stages; s++) {
+      if (fits[s].size() == 0) {
+        continue;
+      }
+      const auto stage = static_cast<casadi_int>(s);
+      const casadi::DM R(std::vector<double>(fits[s].data(), fits[s].data() + fits[s].size()));
+      const auto dA = R(casadi::Slice(0, ns));
+      const auto dB = R(casadi::Slice(ns, -1));
+      const auto dC = R(-1);
+      const auto & out = query.reg_out_state_idxs[i];
+      result.A(out, offset_indices(state_idxs, stage * A_cols)) += dA;
+      result.B(out, offset_indices(control_idxs, stage * B_cols)) += dB;
+      result.C(out, stage * C_cols) += dC;
+    }
   }
   return result;
 }
 
+void SafeSetManager::register_regression_features(const RegFeatureIdxs & features)
+{
+  const auto is_new = [&features](const std::vector<RegFeatureIdxs> & registered) {
+      return std::find(registered.begin(), registered.end(), features) == registered.end();
+    };
+  if (!is_new(*std::atomic_load(&regression_features_))) {
+    return;
+  }
+  std::lock_guard<std::mutex> lock(publish_mutex_);
+  const auto current = std::atomic_load(&regression_features_);
+  if (!is_new(*current)) {
+    return;
+  }
+  auto next = std::make_shared<std::vector<RegFeatureIdxs>>(*current);
+  next->push_back(features);
+  std::atomic_store(
+    &regression_features_, std::shared_ptr<const std::vector<RegFeatureIdxs>>(std::move(next)));
+}
+
+void SafeSetManager::build_regression_index(
+  const SSTrajectory & lap,
+  const RegFeatureIdxs & features)
+{
+  // a lap that does not fit the inputs is still added. its regression index fails on query.
+  try {
+    lap.regression_index(features);
+  } catch (const std::exception & e) {
+    std::cerr << "Failed to index the regression inputs of a new lap: " << e.what() << std::endl;
+  }
+}
+
+ColumnBuffer::ColumnBuffer(const size_t & capacity)
+: capacity_(capacity)
+{
+}
+
+void ColumnBuffer::append(const casadi::DM & column)
+{
+  if (column.size2() != 1) {
+    throw std::invalid_argument("a sample must be a column vector.");
+  }
+  if (cols_ == 0) {
+    rows_ = static_cast<size_t>(column.size1());
+    data_.reserve(rows_ * capacity_);
+  } else if (static_cast<size_t>(column.size1()) != rows_) {
+    throw std::invalid_argument("all samples must have the same number of rows.");
+  }
+  if (column.is_dense()) {
+    const auto & nonzeros = column.nonzeros();
+    data_.insert(data_.end(), nonzeros.begin(), nonzeros.end());
+  } else {
+    const auto elements = column.get_elements();
+    data_.insert(data_.end(), elements.begin(), elements.end());
+  }
+  cols_++;
+}
+
+casadi::DM ColumnBuffer::release()
+{
+  // the nonzeros of a dense matrix are column-major, so the storage is moved as is
+  casadi::DM samples(
+    casadi::Sparsity::dense(static_cast<casadi_int>(rows_), static_cast<casadi_int>(cols_)));
+  samples.nonzeros() = std::move(data_);
+  clear();
+  return samples;
+}
+
+void ColumnBuffer::clear()
+{
+  data_.clear();
+  rows_ = 0;
+  cols_ = 0;
+}
+
+const double & ColumnBuffer::at(const size_t & row, const size_t & col) const
+{
+  return data_[col * rows_ + row];
+}
+
+size_t ColumnBuffer::rows() const
+{
+  return rows_;
+}
+
+size_t ColumnBuffer::cols() const
+{
+  return cols_;
+}
+
 SafeSetRecorder::SafeSetRecorder(
   SafeSetManager & manager,
   const bool & to_file,
-  const std::string & file_prefix)
+  const std::string & file_prefix,
+  const size_t & expected_lap_samples)
 : manager_(manager),
+  last_x_(expected_lap_samples),
+  last_u_(expected_lap_samples),
+  last_t_(expected_lap_samples),
+  last_k_(expected_lap_samples),
   last_x_valid_(false),
   initialized_(false),
   to_file_(to_file),
   file_prefix_(file_prefix),
-  lap_count_(0)
+  lap_count_(0),
+  writer_(to_file ? std::make_unique<LapWriter>() : nullptr)
 {
 }
 
@@ -262,11 +1039,27 @@ void SafeSetRecorder::load(const std::vector<std::string> & from_files, const do
   for (const auto & filename : from_files) {
     try {
       std::cout << "Loading lap from " << filename << std::endl;
-      const auto x = casadi::DM::from_file(filename + "_x.txt", "txt").T();
-      const auto u = casadi::DM::from_file(filename + "_u.txt", "txt").T();
-      const auto k = casadi::DM::from_file(filename + "_k.txt", "txt").T();
-      const auto t = casadi::DM::from_file(filename + "_t.txt", "txt").T();
-      manager_.add_lap(x, u, k, t, total_length);
+      auto lap_file = filename;
+      if (std::filesystem::path(filename).extension() != LAP_FILE_EXTENSION) {
+        lap_file += LAP_FILE_EXTENSION;
+      }
+      if (std::filesystem::exists(lap_file)) {
+        auto lap = read_lap_file(lap_file);
+        if (std::fabs(lap.total_length - total_length) > 1e-6) {
+          std::cout << "Lap " << lap.lap_id << " was recorded on a track of length " <<
+            lap.total_length << " m." << std::endl;
+        }
+        manager_.add_lap(
+          std::move(lap.x), std::move(lap.u), std::move(lap.k), lap.t,
+          total_length);
+      } else {
+        // legacy text files
+        auto x = casadi::DM::from_file(filename + "_x.txt", "txt").T();
+        auto u = casadi::DM::from_file(filename + "_u.txt", "txt").T();
+        auto k = casadi::DM::from_file(filename + "_k.txt", "txt").T();
+        const auto t = casadi::DM::from_file(filename + "_t.txt", "txt").T();
+        manager_.add_lap(std::move(x), std::move(u), std::move(k), t, total_length);
+      }
       lap_count_++;
     } catch (const std::exception & e) {
       std::cout << "Failed to load lap from " << filename << std::endl;
@@ -280,45 +1073,50 @@ void SafeSetRecorder::step(
   const double & total_length)
 {
   if (!last_x_valid_) {
-    last_x_ = x;
+    last_x_.append(x);
     last_x_valid_ = true;
     return;
   }
 
   const auto px = static_cast<double>(x(0));
-  const auto px_last = static_cast<double>(last_x_(0, -1));
+  const auto px_last = last_x_.at(0, last_x_.cols() - 1);
   if (px_last - px > 0.5 * total_length) {
     // new lap
     if (initialized_) {
+      const auto lap_time = static_cast<double>(t) - last_t_.at(0, 0);
       std::cout << "Lap " << lap_count_ << " completed. Adding to safe set." << std::endl;
-      std::cout << "Lap " << lap_count_ << " ave speed: " <<
-        static_cast<double>(total_length / (t - last_t_(0))) << " m/s, time: " <<
-        (t - last_t_(0)) << " s." << std::endl;
-      manager_.add_lap(last_x_, last_u_, last_k_, last_t_, total_length);
+      std::cout << "Lap " << lap_count_ << " ave speed: " << total_length / lap_time <<
+        " m/s, time: " << lap_time << " s." << std::endl;
+      auto lap_x = last_x_.release();
+      auto lap_u = last_u_.release();
+      auto lap_k = last_k_.release();
+      const auto lap_t = last_t_.release();
       if (to_file_) {
-        const auto filename = file_prefix_ + "lap_" + std::to_string(lap_count_);
+        // the writer gets its own copy since the recorded lap is moved into the safe set
+        const auto filename =
+          file_prefix_ + "lap_" + std::to_string(lap_count_) + LAP_FILE_EXTENSION;
         std::cout << "Saving lap to " << filename << std::endl;
-        last_x_.T().to_file(filename + "_x.txt", "txt");
-        last_u_.T().to_file(filename + "_u.txt", "txt");
-        last_t_.T().to_file(filename + "_t.txt", "txt");
-        last_k_.T().to_file(filename + "_k.txt", "txt");
+        writer_->write(filename, LapRecord{lap_count_, total_length, lap_x, lap_u, lap_k, lap_t});
       }
+      // the recorded lap is moved into the safe set, which processes it in the background
+      manager_.add_lap_async(
+        std::move(lap_x), std::move(lap_u), std::move(lap_k), lap_t,
+        total_length);
       std::cout << "------------------------------------------------------------" << std::endl;
     } else {
       initialized_ = true;
     }
     lap_count_++;
     std::cout << "Beginning recording lap " << lap_count_ << std::endl;
-    last_x_ = x;
-    last_u_ = u;
-    last_t_ = t;
-    last_k_ = k;
-  } else {
-    last_x_ = casadi::DM::horzcat({last_x_, x});
-    last_u_ = casadi::DM::horzcat({last_u_, u});
-    last_t_ = casadi::DM::horzcat({last_t_, t});
-    last_k_ = casadi::DM::horzcat({last_k_, k});
+    last_x_.clear();
+    last_u_.clear();
+    last_t_.clear();
+    last_k_.clear();
   }
+  last_x_.append(x);
+  last_u_.append(u);
+  last_t_.append(t);
+  last_k_.append(k);
 }
 
 }  // namespace racing_trajectory
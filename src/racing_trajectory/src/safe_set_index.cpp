@@ -0,0 +1,298 @@
+// Copyright 2023 Haoru Xue
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#include "racing_trajectory/safe_set_index.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <stdexcept>
+#include <utility>
+
+namespace lmpc
+{
+namespace vehicle_model
+{
+namespace racing_trajectory
+{
+namespace
+{
+/**
+ * @brief The closest candidates of consecutive laps, each sorted by squared distance.
+ *
+ */
+class LapNeighborBuffer
+{
+public:
+  LapNeighborBuffer(
+    const uint32_t * laps, const size_t & first_lap, const std::vector<size_t> & caps,
+    const double & radius_sq)
+  : laps_(laps), first_lap_(first_lap), radius_sq_(radius_sq), counts_(caps.size(), 0)
+  {
+    offsets_.reserve(caps.size() + 1);
+    offsets_.push_back(0);
+    for (const auto & cap : caps) {
+      offsets_.push_back(offsets_.back() + cap);
+      num_full_ += cap == 0 ? 1 : 0;
+    }
+    neighbors_.resize(offsets_.back());
+  }
+
+  // squared distance a candidate has to beat to be kept by any lap
+  double bound() const
+  {
+    if (num_full_ < counts_.size()) {
+      return radius_sq_;
+    }
+    double worst = 0.0;
+    for (size_t slot = 0; slot < counts_.size(); slot++) {
+      if (counts_[slot] > 0) {
+        worst = std::max(worst, neighbors_[offsets_[slot + 1] - 1].first);
+      }
+    }
+    return std::min(worst, radius_sq_);
+  }
+
+  void push(const double & d2, const size_t & index)
+  {
+    if (d2 >= radius_sq_ || laps_[index] < first_lap_) {
+      return;
+    }
+    const size_t slot = laps_[index] - first_lap_;
+    const auto begin = neighbors_.begin() + static_cast<std::ptrdiff_t>(offsets_[slot]);
+    const size_t cap = offsets_[slot + 1] - offsets_[slot];
+    auto & count = counts_[slot];
+    if (count == cap) {
+      // the farthest neighbor of the lap is replaced
+      if (cap == 0 || d2 >= begin[count - 1].first) {
+        return;
+      }
+    } else if (++count == cap) {
+      num_full_++;
+    }
+    auto it = begin + static_cast<std::ptrdiff_t>(count - 1);
+    for (; it != begin && d2 < (it - 1)->first; --it) {
+      *it = *(it - 1);
+    }
+    *it = {d2, index};
+  }
+
+  /**
+   * @brief The neighbors of a lap.
+   *
+   * @param slot the lap relative to the first lap.
+   * @return std::pair of the begin and end pointers of the sorted neighbors.
+   */
+  std::pair<const std::pair<double, size_t> *, const std::pair<double, size_t> *> neighbors(
+    const size_t & slot) const
+  {
+    const auto begin = neighbors_.data() + offsets_[slot];
+    return {begin, begin + counts_[slot]};
+  }
+
+private:
+  const uint32_t * laps_;
+  size_t first_lap_;
+  double radius_sq_;
+  size_t num_full_ = 0;
+  std::vector<size_t> offsets_;  // neighbors of slot i are in [offsets[i], offsets[i + 1])
+  std::vector<size_t> counts_;
+  std::vector<std::pair<double, size_t>> neighbors_;
+};
+}  // namespace
+
+SafeSetIndex::SafeSetIndex()
+: cell_offsets_{0}
+{
+}
+
+SafeSetIndex::SafeSetIndex(
+  const SafeSetIndex & previous, const std::vector<int64_t> & lap_map,
+  const std::vector<double> & x, const std::vector<double> & y, const uint32_t & lap)
+{
+  if (x.size() != y.size()) {
+    throw std::invalid_argument("x and y must have the same size.");
+  }
+  if (lap_map.size() != previous.num_laps()) {
+    throw std::invalid_argument("the lap map must have an entry for every previous lap.");
+  }
+
+  // sizes of the laps at their new positions
+  size_t num_points = x.size();
+  lap_sizes_.assign(static_cast<size_t>(lap) + 1, 0);
+  for (size_t j = 0; j < lap_map.size(); j++) {
+    if (lap_map[j] < 0) {
+      continue;
+    }
+    const auto k = static_cast<size_t>(lap_map[j]);
+    if (k >= lap_sizes_.size()) {
+      lap_sizes_.resize(k + 1, 0);
+    }
+    lap_sizes_[k] = previous.lap_sizes_[j];
+    num_points += previous.lap_sizes_[j];
+  }
+  lap_sizes_[lap] = x.size();
+  if (num_points > std::numeric_limits<uint32_t>::max()) {
+    throw std::invalid_argument("too many points in the safe set.");
+  }
+
+  // keep the previous grid if it covers the new lap. otherwise fit a new one with some room.
+  bool same_grid = num_points > x.size();
+  for (size_t i = 0; same_grid && i < x.size(); i++) {
+    same_grid = previous.grid_.contains(x[i], y[i]);
+  }
+  if (same_grid) {
+    grid_ = previous.grid_;
+  } else if (num_points > 0) {
+    double x_min = std::numeric_limits<double>::infinity();
+    double y_min = std::numeric_limits<double>::infinity();
+    double x_max = -std::numeric_limits<double>::infinity();
+    double y_max = -std::numeric_limits<double>::infinity();
+    const auto extend = [&](const double & px, const double & py) {
+        x_min = std::min(x_min, px);
+        x_max = std::max(x_max, px);
+        y_min = std::min(y_min, py);
+        y_max = std::max(y_max, py);
+      };
+    for (size_t i = 0; i < x.size(); i++) {
+      extend(x[i], y[i]);
+    }
+    for (size_t i = 0; i < previous.cell_x_.size(); i++) {
+      if (lap_map[previous.cell_laps_[i]] >= 0) {
+        extend(previous.cell_x_[i], previous.cell_y_[i]);
+      }
+    }
+    const double margin_x = GRID_MARGIN * (x_max - x_min);
+    const double margin_y = GRID_MARGIN * (y_max - y_min);
+    grid_ = UniformGrid(
+      x_min - margin_x, y_min - margin_y, x_max - x_min + 2.0 * margin_x,
+      y_max - y_min + 2.0 * margin_y,
+      SPACING_TO_CELL_SIZE * UniformGrid::median_spacing(x, y),
+      static_cast<double>(MAX_CELLS_PER_POINT * std::max<size_t>(x.size(), 1)));
+  }
+
+  // the kept points cell by cell, then the new points. on the same grid, the kept points
+  // stay in their cells and the new points go after them.
+  const auto for_each_point = [&](auto && visit) {
+      for (size_t c = 0; c + 1 < previous.cell_offsets_.size(); c++) {
+        for (auto i = previous.cell_offsets_[c]; i < previous.cell_offsets_[c + 1]; i++) {
+          const auto new_lap = lap_map[previous.cell_laps_[i]];
+          if (new_lap >= 0) {
+            visit(
+              same_grid ? c : grid_.cell(previous.cell_x_[i], previous.cell_y_[i]),
+              previous.cell_x_[i], previous.cell_y_[i], static_cast<uint32_t>(new_lap),
+              previous.cell_indices_[i]);
+          }
+        }
+      }
+      for (size_t i = 0; i < x.size(); i++) {
+        visit(grid_.cell(x[i], y[i]), x[i], y[i], lap, static_cast<uint32_t>(i));
+      }
+    };
+
+  // counting sort of the points by cell
+  cell_offsets_.assign(grid_.num_cells() + 1, 0);
+  for_each_point(
+    [&](const size_t & cell, const double &, const double &, const uint32_t &,
+    const uint32_t &) {
+      cell_offsets_[cell + 1]++;
+    });
+  for (size_t c = 1; c < cell_offsets_.size(); c++) {
+    cell_offsets_[c] += cell_offsets_[c - 1];
+  }
+  cell_x_.resize(num_points);
+  cell_y_.resize(num_points);
+  cell_laps_.resize(num_points);
+  cell_indices_.resize(num_points);
+  std::vector<uint32_t> next(cell_offsets_.begin(), cell_offsets_.end() - 1);
+  for_each_point(
+    [&](const size_t & cell, const double & px, const double & py, const uint32_t & point_lap,
+    const uint32_t & index) {
+      const auto j = next[cell]++;
+      cell_x_[j] = px;
+      cell_y_[j] = py;
+      cell_laps_[j] = point_lap;
+      cell_indices_[j] = index;
+    });
+}
+
+bool SafeSetIndex::query(
+  const double & x, const double & y, const size_t & max_num_per_lap,
+  const size_t & max_num_total, const double & radius,
+  std::vector<Neighbor> & neighbors) const
+{
+  neighbors.clear();
+  if (max_num_per_lap == 0 || max_num_total == 0 || cell_x_.empty()) {
+    return true;
+  }
+
+  // without a radius, only the newest laps that fill the total contribute.
+  // with a radius, a lap may have fewer points and every lap is searched.
+  const bool bounded = std::isfinite(radius);
+  size_t first_lap = lap_sizes_.size();
+  size_t num_total = 0;
+  while (first_lap > 0 && (bounded || num_total < max_num_total)) {
+    first_lap--;
+    num_total += std::min(max_num_per_lap, lap_sizes_[first_lap]);
+  }
+  std::vector<size_t> caps(lap_sizes_.size() - first_lap);
+  for (size_t slot = 0; slot < caps.size(); slot++) {
+    caps[slot] = std::min(max_num_per_lap, lap_sizes_[first_lap + slot]);
+  }
+
+  LapNeighborBuffer buffer(cell_laps_.data(), first_lap, caps, radius * radius);
+  const bool found = grid_.search(
+    x, y, MAX_SCANNED_CELLS, buffer, [&](const size_t & begin, const size_t & end) {
+      for (auto i = cell_offsets_[begin]; i < cell_offsets_[end]; i++) {
+        const double dx = cell_x_[i] - x;
+        const double dy = cell_y_[i] - y;
+        buffer.push(dx * dx + dy * dy, i);
+      }
+    });
+  if (!found) {
+    return false;
+  }
+
+  neighbors.reserve(std::min(max_num_total, num_total));
+  for (size_t slot = caps.size(); slot-- > 0; ) {
+    const auto [begin, end] = buffer.neighbors(slot);
+    for (auto it = begin; it != end; ++it) {
+      if (neighbors.size() == max_num_total) {
+        return true;
+      }
+      neighbors.push_back({cell_laps_[it->second], cell_indices_[it->second],
+          std::sqrt(it->first)});
+    }
+  }
+  return true;
+}
+
+size_t SafeSetIndex::num_laps() const
+{
+  return lap_sizes_.size();
+}
+
+size_t SafeSetIndex::size() const
+{
+  return cell_x_.size();
+}
+
+double SafeSetIndex::cell_size() const
+{
+  return grid_.cell_size();
+}
+}  // namespace racing_trajectory
+}  // namespace vehicle_model
+}  // namespace lmpc
@@ -0,0 +1,168 @@
+// Copyright 2023 Haoru Xue
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#include "racing_trajectory/trajectory_grid_index.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <stdexcept>
+
+namespace lmpc
+{
+namespace vehicle_model
+{
+namespace racing_trajectory
+{
+namespace
+{
+struct NearestVisitor
+{
+  double best_d2 = std::numeric_limits<double>::infinity();
+  size_t best = 0;
+
+  double bound() const
+  {
+    return best_d2;
+  }
+
+  void push(const double & d2, const size_t & index)
+  {
+    if (d2 < best_d2) {
+      best_d2 = d2;
+      best = index;
+    }
+  }
+};
+}  // namespace
+
+TrajectoryGridIndex::TrajectoryGridIndex(
+  const std::vector<double> & x, const std::vector<double> & y,
+  const double & cell_size)
+: WaypointIndex(x, y), fallback_(x, y)
+{
+  const size_t n = x.size();
+  if (n == 0) {
+    cell_offsets_ = {0};
+    return;
+  }
+  const auto [x_min, x_max] = std::minmax_element(x.begin(), x.end());
+  const auto [y_min, y_max] = std::minmax_element(y.begin(), y.end());
+  // size the cells from the median spacing of consecutive waypoints
+  grid_ = UniformGrid(
+    *x_min, *y_min, *x_max - *x_min, *y_max - *y_min,
+    cell_size > 0.0 ? cell_size : SPACING_TO_CELL_SIZE * UniformGrid::median_spacing(x, y),
+    static_cast<double>(MAX_CELLS_PER_WAYPOINT * n));
+
+  // counting sort of the waypoints by cell
+  std::vector<size_t> cells(n);
+  cell_offsets_.assign(grid_.num_cells() + 1, 0);
+  for (size_t i = 0; i < n; i++) {
+    cells[i] = grid_.cell(x[i], y[i]);
+    cell_offsets_[cells[i] + 1]++;
+  }
+  for (size_t c = 1; c < cell_offsets_.size(); c++) {
+    cell_offsets_[c] += cell_offsets_[c - 1];
+  }
+  cell_x_.resize(n);
+  cell_y_.resize(n);
+  cell_indices_.resize(n);
+  std::vector<size_t> next(cell_offsets_.begin(), cell_offsets_.end() - 1);
+  for (size_t i = 0; i < n; i++) {
+    const auto j = next[cells[i]]++;
+    cell_x_[j] = x[i];
+    cell_y_[j] = y[i];
+    cell_indices_[j] = i;
+  }
+}
+
+size_t TrajectoryGridIndex::find_closest_waypoint_index(
+  const double & x, const double & y) const
+{
+  if (cell_indices_.empty()) {
+    throw std::runtime_error("the grid is empty.");
+  }
+  NearestVisitor visitor;
+  if (!search(x, y, visitor)) {
+    return fallback_.find_closest_waypoint_index(x, y);
+  }
+  return cell_indices_[visitor.best];
+}
+
+void TrajectoryGridIndex::find_closest_waypoint_indices(
+  const double & x, const double & y, const size_t & n,
+  std::vector<size_t> & indices) const
+{
+  if (n == 0 || cell_indices_.empty()) {
+    return;
+  }
+  NeighborBuffer buffer(std::min(n, cell_indices_.size()));
+  if (!search(x, y, buffer)) {
+    fallback_.find_closest_waypoint_indices(x, y, n, indices);
+    return;
+  }
+  const auto & neighbors = buffer.neighbors();
+  for (const auto & neighbor : neighbors) {
+    indices.push_back(cell_indices_[neighbor.second]);
+  }
+}
+
+void TrajectoryGridIndex::find_waypoints_within_radius(
+  const double & x, const double & y, const double & radius,
+  std::vector<size_t> & indices, std::vector<double> & distances,
+  const size_t & max_results) const
+{
+  if (max_results == 0 || cell_indices_.empty()) {
+    return;
+  }
+  RadiusBuffer buffer(radius);
+  if (!search(x, y, buffer)) {
+    fallback_.find_waypoints_within_radius(x, y, radius, indices, distances, max_results);
+    return;
+  }
+  for (const auto & neighbor : buffer.sort(max_results)) {
+    indices.push_back(cell_indices_[neighbor.second]);
+    distances.push_back(std::sqrt(neighbor.first));
+  }
+}
+
+double TrajectoryGridIndex::cell_size() const
+{
+  return grid_.cell_size();
+}
+
+template<typename Visitor>
+bool TrajectoryGridIndex::search(const double & x, const double & y, Visitor & visitor) const
+{
+  return grid_.search(
+    x, y, MAX_SCANNED_CELLS, visitor, [&](const size_t & begin, const size_t & end) {
+      scan(cell_offsets_[begin], cell_offsets_[end], x, y, visitor);
+    });
+}
+
+template<typename Visitor>
+void TrajectoryGridIndex::scan(
+  const size_t & begin, const size_t & end, const double & x, const double & y,
+  Visitor & visitor) const
+{
+  for (size_t i = begin; i < end; i++) {
+    const double dx = cell_x_[i] - x;
+    const double dy = cell_y_[i] - y;
+    visitor.push(dx * dx + dy * dy, i);
+  }
+}
+}  // namespace racing_trajectory
+}  // namespace vehicle_model
+}  // namespace lmpc
@@ -15,10 +15,13 @@
 
 #include "racing_trajectory/trajectory_kd_tree.hpp"
 
-#include <CGAL/Line_2.h>
-#include <CGAL/Point_2.h>
-#include <CGAL/Cartesian.h>
-#include <CGAL/squared_distance_2.h>
+#include <Eigen/Dense>
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <numeric>
+#include <stdexcept>
 
 namespace lmpc
 {
@@ -26,46 +29,197 @@ namespace vehicle_model
 {
 namespace racing_trajectory
 {
+namespace
+{
+constexpr Eigen::Index MAX_LEAF_SIZE = TrajectoryKDTree::LEAF_SIZE;
+
+// fixed capacity array lives on the stack
+typedef Eigen::Array<double, Eigen::Dynamic, 1, Eigen::ColMajor, MAX_LEAF_SIZE, 1> LeafArray;
+
+struct NearestVisitor
+{
+  double best_d2 = std::numeric_limits<double>::infinity();
+  size_t best = 0;
+
+  double bound() const
+  {
+    return best_d2;
+  }
+
+  void scan(const LeafArray & d2, const size_t & begin)
+  {
+    Eigen::Index k;
+    const double d2_min = d2.minCoeff(&k);
+    if (d2_min < best_d2) {
+      best_d2 = d2_min;
+      best = begin + static_cast<size_t>(k);
+    }
+  }
+};
+
+struct KNearestVisitor
+{
+  explicit KNearestVisitor(const size_t & n)
+  : buffer(n)
+  {
+  }
+
+  NeighborBuffer buffer;
+
+  double bound() const
+  {
+    return buffer.bound();
+  }
+
+  void scan(const LeafArray & d2, const size_t & begin)
+  {
+    for (Eigen::Index k = 0; k < d2.size(); k++) {
+      buffer.push(d2(k), begin + static_cast<size_t>(k));
+    }
+  }
+};
+
+struct RadiusVisitor
+{
+  explicit RadiusVisitor(const double & radius)
+  : buffer(radius)
+  {
+  }
+
+  RadiusBuffer buffer;
+
+  double bound() const
+  {
+    return buffer.bound();
+  }
+
+  void scan(const LeafArray & d2, const size_t & begin)
+  {
+    for (Eigen::Index k = 0; k < d2.size(); k++) {
+      buffer.push(d2(k), begin + static_cast<size_t>(k));
+    }
+  }
+};
+}  // namespace
+
 TrajectoryKDTree::TrajectoryKDTree(const std::vector<double> & x, const std::vector<double> & y)
-: x_(x), y_(y)
+: WaypointIndex(x, y)
 {
-  if (x.size() != y.size()) {
-    throw std::invalid_argument("x and y must have the same size.");
+  const size_t n = x.size();
+  // halve until the largest leaf, ceil(n / 2^depth), fits
+  while (((n + (1ul << depth_) - 1) >> depth_) > LEAF_SIZE) {
+    depth_++;
+  }
+  leaf_indices_.resize(n);
+  std::iota(leaf_indices_.begin(), leaf_indices_.end(), 0);
+  split_values_.resize((1ul << depth_) - 1);
+  split_dims_.resize(split_values_.size());
+  if (n > 0) {
+    build(0, 0, n, 0);
   }
-  map_.reserve(x.size());
-  tree_.reserve(x.size());
-  for (size_t i = 0; i < x.size(); i++) {
-    map_.insert({WaypointKey{x[i], y[i]}, i});
-    tree_.insert(Point_d(x[i], y[i]));
+  leaf_x_.resize(n);
+  leaf_y_.resize(n);
+  for (size_t i = 0; i < n; i++) {
+    leaf_x_[i] = x_[leaf_indices_[i]];
+    leaf_y_[i] = y_[leaf_indices_[i]];
   }
-  tree_.build();
 }
 
 size_t TrajectoryKDTree::find_closest_waypoint_index(
   const double & x, const double & y) const
 {
-  Point_d query(x, y);
-  Neighbor_search search(tree_, query, 1);
-  const auto & closest_pt = *search.begin();
-  return map_.find(WaypointKey{closest_pt.first.x(), closest_pt.first.y()})->second;
+  if (leaf_indices_.empty()) {
+    throw std::runtime_error("the tree is empty.");
+  }
+  NearestVisitor visitor;
+  search(x, y, 0, 0, leaf_indices_.size(), 0, visitor);
+  return leaf_indices_[visitor.best];
 }
 
 void TrajectoryKDTree::find_closest_waypoint_indices(
   const double & x, const double & y, const size_t & n,
   std::vector<size_t> & indices) const
 {
-  Point_d query(x, y);
-  Neighbor_search search(tree_, query, n);
-  indices.reserve(search.end() - search.begin());
-  for (const auto & pt : search) {
-    indices.push_back(map_.find(WaypointKey{pt.first.x(), pt.first.y()})->second);
+  if (n == 0 || leaf_indices_.empty()) {
+    return;
+  }
+  KNearestVisitor visitor(std::min(n, leaf_indices_.size()));
+  search(x, y, 0, 0, leaf_indices_.size(), 0, visitor);
+  const auto & neighbors = visitor.buffer.neighbors();
+  for (const auto & neighbor : neighbors) {
+    indices.push_back(leaf_indices_[neighbor.second]);
+  }
+}
+
+void TrajectoryKDTree::find_waypoints_within_radius(
+  const double & x, const double & y, const double & radius,
+  std::vector<size_t> & indices, std::vector<double> & distances,
+  const size_t & max_results) const
+{
+  if (max_results == 0 || leaf_indices_.empty()) {
+    return;
+  }
+  RadiusVisitor visitor(radius);
+  search(x, y, 0, 0, leaf_indices_.size(), 0, visitor);
+  for (const auto & neighbor : visitor.buffer.sort(max_results)) {
+    indices.push_back(leaf_indices_[neighbor.second]);
+    distances.push_back(std::sqrt(neighbor.first));
+  }
+}
+
+void TrajectoryKDTree::build(
+  const size_t & node, const size_t & begin, const size_t & end,
+  const size_t & level)
+{
+  if (level == depth_) {
+    return;
   }
+  // split the wider extent of the bounding box at the median
+  const auto [x_min, x_max] = std::minmax_element(
+    leaf_indices_.begin() + begin, leaf_indices_.begin() + end,
+    [this](const size_t & a, const size_t & b) {return x_[a] < x_[b];});
+  const auto [y_min, y_max] = std::minmax_element(
+    leaf_indices_.begin() + begin, leaf_indices_.begin() + end,
+    [this](const size_t & a, const size_t & b) {return y_[a] < y_[b];});
+  const uint8_t dim = x_[*x_max] - x_[*x_min] >= y_[*y_max] - y_[*y_min] ? 0 : 1;
+  const auto & coords = dim == 0 ? x_ : y_;
+  const size_t mid = begin + (end - begin) / 2;
+  std::nth_element(
+    leaf_indices_.begin() + begin, leaf_indices_.begin() + mid, leaf_indices_.begin() + end,
+    [&coords](const size_t & a, const size_t & b) {return coords[a] < coords[b];});
+  split_values_[node] = coords[leaf_indices_[mid]];
+  split_dims_[node] = dim;
+  build(2 * node + 1, begin, mid, level + 1);
+  build(2 * node + 2, mid, end, level + 1);
 }
 
-void TrajectoryKDTree::get_waypoint(const size_t & index, double & x, double & y) const
+template<typename Visitor>
+void TrajectoryKDTree::search(
+  const double & x, const double & y, const size_t & node, const size_t & begin,
+  const size_t & end, const size_t & level, Visitor & visitor) const
 {
-  x = x_[index];
-  y = y_[index];
+  if (level == depth_) {
+    const auto m = static_cast<Eigen::Index>(end - begin);
+    const LeafArray d2 =
+      (Eigen::Map<const Eigen::ArrayXd>(leaf_x_.data() + begin, m) - x).square() +
+      (Eigen::Map<const Eigen::ArrayXd>(leaf_y_.data() + begin, m) - y).square();
+    visitor.scan(d2, begin);
+    return;
+  }
+  // left holds coordinates <= split and right holds coordinates >= split
+  const size_t mid = begin + (end - begin) / 2;
+  const double diff = (split_dims_[node] == 0 ? x : y) - split_values_[node];
+  if (diff < 0.0) {
+    search(x, y, 2 * node + 1, begin, mid, level + 1, visitor);
+    if (diff * diff < visitor.bound()) {
+      search(x, y, 2 * node + 2, mid, end, level + 1, visitor);
+    }
+  } else {
+    search(x, y, 2 * node + 2, mid, end, level + 1, visitor);
+    if (diff * diff < visitor.bound()) {
+      search(x, y, 2 * node + 1, begin, mid, level + 1, visitor);
+    }
+  }
 }
 }  // namespace racing_trajectory
 }  // namespace vehicle_model
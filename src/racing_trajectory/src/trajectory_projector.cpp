@@ -0,0 +1,141 @@
+// Copyright 2023 Haoru Xue
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#include <algorithm>
+#include <cmath>
+
+#include "racing_trajectory/trajectory_projector.hpp"
+#include "lmpc_utils/utils.hpp"
+
+namespace lmpc
+{
+namespace vehicle_model
+{
+namespace racing_trajectory
+{
+TrajectoryProjector::TrajectoryProjector(
+  CubicSpline::SharedPtr spline, const size_t & x_channel,
+  const size_t & y_channel, const double & total_length)
+: spline_(spline), x_channel_(x_channel), y_channel_(y_channel), total_length_(total_length)
+{
+}
+
+bool TrajectoryProjector::project(
+  const double & x, const double & y, const double & s0,
+  double & s) const
+{
+  size_t segment = spline_->find_segment(wrap_abscissa(s0));
+  return project(x, y, s0, s, segment);
+}
+
+bool TrajectoryProjector::project(
+  const double & x, const double & y, const double & s0,
+  double & s, size_t & segment) const
+{
+  const auto & knots = spline_->knots();
+  s = wrap_abscissa(s0);
+  segment = spline_->find_segment(s, segment);
+
+  // minimize f(s) = 0.5 * |p(s) - q|^2 with newton steps bounded by the larger of the
+  // segment length and the current distance. the objective is periodic,
+  // so the abscissa is wrapped after every step.
+  double dx, dy, d2x, d2y;
+  double ex = spline_->evaluate(segment, x_channel_, s, &dx, &d2x) - x;
+  double ey = spline_->evaluate(segment, y_channel_, s, &dy, &d2y) - y;
+  double f = ex * ex + ey * ey;
+  for (size_t i = 0; i < max_iterations_; i++) {
+    const double g = ex * dx + ey * dy;
+    const double v_sq = dx * dx + dy * dy;
+    const double H = v_sq + ex * d2x + ey * d2y;
+    // fall back to a gradient step scaled by the speed when the curvature is negative
+    double step = H > 1e-6 * v_sq ? -g / H : -g / v_sq;
+    const double max_step = std::max(knots[segment + 1] - knots[segment], std::sqrt(f));
+    step = std::clamp(step, -max_step, max_step);
+    if (std::fabs(step) < tolerance_) {
+      return true;
+    }
+
+    // backtrack until the distance decreases
+    double s_next = s, ex_next = ex, ey_next = ey, f_next = f;
+    size_t seg_next = segment;
+    bool decreased = false;
+    for (int j = 0; j < 5 && !decreased; j++, step *= 0.5) {
+      const double s_raw = s + step;
+      s_next = wrap_abscissa(s_raw);
+      seg_next = s_next == s_raw ? spline_->find_segment(s_next, segment) :
+        spline_->find_segment(s_next);
+      ex_next = spline_->evaluate(seg_next, x_channel_, s_next) - x;
+      ey_next = spline_->evaluate(seg_next, y_channel_, s_next) - y;
+      f_next = ex_next * ex_next + ey_next * ey_next;
+      decreased = f_next <= f;
+    }
+    if (!decreased) {
+      // no descent along the newton direction. we are at the minimum up to round-off.
+      return std::fabs(g) <= 1e-6 * std::sqrt(v_sq * std::max(f, 1e-12));
+    }
+    s = s_next;
+    segment = seg_next;
+    ex = spline_->evaluate(segment, x_channel_, s, &dx, &d2x) - x;
+    ey = spline_->evaluate(segment, y_channel_, s, &dy, &d2y) - y;
+    f = f_next;
+  }
+  return false;
+}
+
+bool TrajectoryProjector::global_to_frenet(
+  const Pose2D & global_pose, const double & s0,
+  FrenetPose2D & frenet_pose) const
+{
+  size_t segment = spline_->find_segment(wrap_abscissa(s0));
+  return global_to_frenet(global_pose, s0, frenet_pose, segment);
+}
+
+bool TrajectoryProjector::global_to_frenet(
+  const Pose2D & global_pose, const double & s0,
+  FrenetPose2D & frenet_pose, size_t & segment) const
+{
+  double s;
+  const bool converged =
+    project(global_pose.position.x, global_pose.position.y, s0, s, segment);
+  Pose2D p0;
+  double dx, dy;
+  p0.position.x = spline_->evaluate(segment, x_channel_, s, &dx);
+  p0.position.y = spline_->evaluate(segment, y_channel_, s, &dy);
+  p0.yaw = std::atan2(dy, dx);
+  frenet_pose.position.s = s;
+  frenet_pose.position.t =
+    distance(global_pose.position, p0.position) * lateral_sign(global_pose.position, p0);
+  frenet_pose.yaw = utils::align_yaw(global_pose.yaw, p0.yaw) - p0.yaw;
+  return converged;
+}
+
+void TrajectoryProjector::centerline_pose(const double & s, Pose2D & pose) const
+{
+  const double s_wrapped = wrap_abscissa(s);
+  const size_t seg = spline_->find_segment(s_wrapped);
+  double dx, dy;
+  pose.position.x = spline_->evaluate(seg, x_channel_, s_wrapped, &dx);
+  pose.position.y = spline_->evaluate(seg, y_channel_, s_wrapped, &dy);
+  pose.yaw = std::atan2(dy, dx);
+}
+
+double TrajectoryProjector::wrap_abscissa(const double & s) const
+{
+  const double s_wrapped = std::fmod(s, total_length_);
+  return s_wrapped < 0.0 ? s_wrapped + total_length_ : s_wrapped;
+}
+}  // namespace racing_trajectory
+}  // namespace vehicle_model
+}  // namespace lmpc
@@ -0,0 +1,165 @@
+// Copyright 2023 Haoru Xue
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#include <Eigen/Dense>
+
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+
+#include "racing_trajectory/trajectory_sampler.hpp"
+
+namespace lmpc
+{
+namespace vehicle_model
+{
+namespace racing_trajectory
+{
+namespace
+{
+constexpr Eigen::Index BLOCK_SIZE = 64;  // number of abscissas evaluated together
+constexpr Eigen::Index NUM_COEFFS = 4 * NUM_SPLINE_CHANNELS;
+
+// fixed capacity arrays live on the stack
+typedef Eigen::Array<double, Eigen::Dynamic, 1, Eigen::ColMajor, BLOCK_SIZE, 1> BlockArray;
+typedef Eigen::Array<double, Eigen::Dynamic, NUM_COEFFS, Eigen::ColMajor, BLOCK_SIZE,
+    NUM_COEFFS> BlockCoefficients;
+typedef Eigen::Map<const Eigen::Array<double, 1, NUM_COEFFS>> SegmentCoefficients;
+
+BlockArray value(const BlockCoefficients & c, const BlockArray & u, const size_t & channel)
+{
+  const auto i = 4 * channel;
+  return c.col(i) + u * (c.col(i + 1) + u * (c.col(i + 2) + u * c.col(i + 3)));
+}
+
+BlockArray first_derivative(
+  const BlockCoefficients & c, const BlockArray & u,
+  const size_t & channel)
+{
+  const auto i = 4 * channel;
+  return c.col(i + 1) + u * (2.0 * c.col(i + 2) + 3.0 * u * c.col(i + 3));
+}
+
+BlockArray second_derivative(
+  const BlockCoefficients & c, const BlockArray & u,
+  const size_t & channel)
+{
+  const auto i = 4 * channel;
+  return 2.0 * c.col(i + 2) + 6.0 * u * c.col(i + 3);
+}
+}  // namespace
+
+void TrajectorySamples::resize(const size_t & n)
+{
+  x.resize(n);
+  y.resize(n);
+  yaw.resize(n);
+  curvature.resize(n);
+  left.resize(n);
+  right.resize(n);
+  velocity.resize(n);
+}
+
+size_t TrajectorySamples::size() const
+{
+  return x.size();
+}
+
+TrajectorySampler::TrajectorySampler(CubicSpline::SharedPtr spline, const double & total_length)
+: spline_(spline), total_length_(total_length)
+{
+  if (spline_->num_channels() != NUM_SPLINE_CHANNELS) {
+    throw std::invalid_argument("the spline does not have the trajectory channels.");
+  }
+}
+
+void TrajectorySampler::sample(const double & s, TrajectorySample & sample) const
+{
+  const double s_wrapped = wrap_abscissa(s);
+  const size_t seg = spline_->find_segment(s_wrapped);
+  double dx, dy, d2x, d2y;
+  sample.x = spline_->evaluate(seg, SPLINE_X, s_wrapped, &dx, &d2x);
+  sample.y = spline_->evaluate(seg, SPLINE_Y, s_wrapped, &dy, &d2y);
+  sample.left = spline_->evaluate(seg, SPLINE_LEFT, s_wrapped);
+  sample.right = spline_->evaluate(seg, SPLINE_RIGHT, s_wrapped);
+  sample.velocity = spline_->evaluate(seg, SPLINE_SPEED, s_wrapped);
+  sample.yaw = std::atan2(dy, dx);
+  sample.curvature = (dx * d2y - dy * d2x) / std::pow(dx * dx + dy * dy, 1.5);
+}
+
+void TrajectorySampler::sample(
+  const double * s, const size_t & n,
+  TrajectorySamples & samples) const
+{
+  samples.resize(n);
+  const auto & knots = spline_->knots();
+  size_t seg = 0;
+  BlockArray u;
+  BlockCoefficients c;
+  for (size_t start = 0; start < n; start += BLOCK_SIZE) {
+    const auto m = static_cast<Eigen::Index>(std::min<size_t>(BLOCK_SIZE, n - start));
+    u.resize(m);
+    c.resize(m, Eigen::NoChange);
+
+    // shared knot search, then gather the packed coefficients of every channel
+    for (Eigen::Index k = 0; k < m; k++) {
+      const double s_k = wrap_abscissa(s[start + k]);
+      seg = find_segment(s_k, seg);
+      u(k) = s_k - knots[seg];
+      c.row(k) = SegmentCoefficients(spline_->coefficients(seg));
+    }
+
+    // vectorized polynomial evaluation
+    const BlockArray dx = first_derivative(c, u, SPLINE_X);
+    const BlockArray dy = first_derivative(c, u, SPLINE_Y);
+    const BlockArray d2x = second_derivative(c, u, SPLINE_X);
+    const BlockArray d2y = second_derivative(c, u, SPLINE_Y);
+    Eigen::Map<Eigen::ArrayXd>(samples.x.data() + start, m) = value(c, u, SPLINE_X);
+    Eigen::Map<Eigen::ArrayXd>(samples.y.data() + start, m) = value(c, u, SPLINE_Y);
+    Eigen::Map<Eigen::ArrayXd>(samples.left.data() + start, m) = value(c, u, SPLINE_LEFT);
+    Eigen::Map<Eigen::ArrayXd>(samples.right.data() + start, m) = value(c, u, SPLINE_RIGHT);
+    Eigen::Map<Eigen::ArrayXd>(samples.velocity.data() + start, m) = value(c, u, SPLINE_SPEED);
+    const BlockArray v_sq = dx.square() + dy.square();
+    Eigen::Map<Eigen::ArrayXd>(samples.curvature.data() + start, m) =
+      (dx * d2y - dy * d2x) / (v_sq * v_sq.sqrt());
+    for (Eigen::Index k = 0; k < m; k++) {
+      samples.yaw[start + k] = std::atan2(dy(k), dx(k));
+    }
+  }
+}
+
+const CubicSpline & TrajectorySampler::spline() const
+{
+  return *spline_;
+}
+
+double TrajectorySampler::wrap_abscissa(const double & s) const
+{
+  const double s_wrapped = std::fmod(s, total_length_);
+  return s_wrapped < 0.0 ? s_wrapped + total_length_ : s_wrapped;
+}
+
+size_t TrajectorySampler::find_segment(const double & s, const size_t & hint) const
+{
+  const auto & knots = spline_->knots();
+  // sorted inputs mostly stay in the same or the next segment
+  if (hint + 2 < knots.size() && s >= knots[hint] && s < knots[hint + 2]) {
+    return spline_->find_segment(s, hint);
+  }
+  return spline_->find_segment(s);
+}
+}  // namespace racing_trajectory
+}  // namespace vehicle_model
+}  // namespace lmpc
@@ -0,0 +1,88 @@
+// Copyright 2023 Haoru Xue
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#include "racing_trajectory/uniform_grid.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+namespace lmpc
+{
+namespace vehicle_model
+{
+namespace racing_trajectory
+{
+UniformGrid::UniformGrid(
+  const double & x_min, const double & y_min, const double & width, const double & height,
+  const double & cell_size, const double & max_cells)
+: x_min_(x_min), y_min_(y_min), cell_size_(cell_size > 0.0 ? cell_size : 1.0)
+{
+  // grow the cells until the grid fits in memory
+  cell_size_ = std::max(cell_size_, std::sqrt(width * height / max_cells));
+  while ((std::floor(width / cell_size_) + 1.0) * (std::floor(height / cell_size_) + 1.0) >
+    max_cells)
+  {
+    cell_size_ *= 1.25;
+  }
+  num_cols_ = static_cast<int64_t>(std::floor(width / cell_size_)) + 1;
+  num_rows_ = static_cast<int64_t>(std::floor(height / cell_size_)) + 1;
+}
+
+size_t UniformGrid::cell(const double & x, const double & y) const
+{
+  const auto col = std::clamp<int64_t>(
+    static_cast<int64_t>(std::floor((x - x_min_) / cell_size_)), 0, num_cols_ - 1);
+  const auto row = std::clamp<int64_t>(
+    static_cast<int64_t>(std::floor((y - y_min_) / cell_size_)), 0, num_rows_ - 1);
+  return static_cast<size_t>(row * num_cols_ + col);
+}
+
+bool UniformGrid::contains(const double & x, const double & y) const
+{
+  const double fx = std::floor((x - x_min_) / cell_size_);
+  const double fy = std::floor((y - y_min_) / cell_size_);
+  return fx >= 0.0 && fx < static_cast<double>(num_cols_) &&
+         fy >= 0.0 && fy < static_cast<double>(num_rows_);
+}
+
+size_t UniformGrid::num_cells() const
+{
+  return static_cast<size_t>(num_cols_ * num_rows_);
+}
+
+double UniformGrid::cell_size() const
+{
+  return cell_size_;
+}
+
+double UniformGrid::median_spacing(const std::vector<double> & x, const std::vector<double> & y)
+{
+  std::vector<double> spacing;
+  spacing.reserve(x.size());
+  for (size_t i = 1; i < x.size(); i++) {
+    const double ds = std::hypot(x[i] - x[i - 1], y[i] - y[i - 1]);
+    if (ds > 0.0) {
+      spacing.push_back(ds);
+    }
+  }
+  if (spacing.empty()) {
+    return 0.0;
+  }
+  std::nth_element(spacing.begin(), spacing.begin() + spacing.size() / 2, spacing.end());
+  return spacing[spacing.size() / 2];
+}
+}  // namespace racing_trajectory
+}  // namespace vehicle_model
+}  // namespace lmpc
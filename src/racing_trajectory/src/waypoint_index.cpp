@@ -0,0 +1,62 @@
+// Copyright 2023 Haoru Xue
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#include "racing_trajectory/waypoint_index.hpp"
+
+#include <stdexcept>
+
+#include "racing_trajectory/trajectory_kd_tree.hpp"
+#include "racing_trajectory/trajectory_grid_index.hpp"
+
+namespace lmpc
+{
+namespace vehicle_model
+{
+namespace racing_trajectory
+{
+WaypointIndex::WaypointIndex(const std::vector<double> & x, const std::vector<double> & y)
+: x_(x), y_(y)
+{
+  if (x.size() != y.size()) {
+    throw std::invalid_argument("x and y must have the same size.");
+  }
+}
+
+void WaypointIndex::get_waypoint(const size_t & index, double & x, double & y) const
+{
+  x = x_[index];
+  y = y_[index];
+}
+
+size_t WaypointIndex::size() const
+{
+  return x_.size();
+}
+
+WaypointIndex::UniquePtr make_waypoint_index(
+  const WaypointIndexType & type, const std::vector<double> & x,
+  const std::vector<double> & y)
+{
+  switch (type) {
+    case WaypointIndexType::KD_TREE:
+      return std::make_unique<TrajectoryKDTree>(x, y);
+    case WaypointIndexType::GRID:
+      return std::make_unique<TrajectoryGridIndex>(x, y);
+  }
+  throw std::invalid_argument("unknown waypoint index type.");
+}
+}  // namespace racing_trajectory
+}  // namespace vehicle_model
+}  // namespace lmpc
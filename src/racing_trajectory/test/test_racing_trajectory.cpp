@@ -15,12 +15,79 @@
 
 #include <gtest/gtest.h>
 
+#include <algorithm>
+#include <atomic>
 #include <chrono>
+#include <cmath>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <future>
+#include <limits>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <vector>
+
+#include <CGAL/Simple_cartesian.h>
+#include <CGAL/Orthogonal_k_neighbor_search.h>
+#include <CGAL/Search_traits_2.h>
 
 #include <rclcpp/rclcpp.hpp>
 #include <ament_index_cpp/get_package_share_directory.hpp>
 
 #include "racing_trajectory/racing_trajectory.hpp"
+#include "racing_trajectory/batch_evaluator.hpp"
+#include "racing_trajectory/executor.hpp"
+#include "racing_trajectory/frenet_tracker.hpp"
+#include "racing_trajectory/racing_trajectory_map.hpp"
+#include "racing_trajectory/safe_set.hpp"
+#include "racing_trajectory/trajectory_kd_tree.hpp"
+#include "racing_trajectory/waypoint_index.hpp"
+
+namespace
+{
+// fills the states, the controls and the curvature of a sample at a track abscissa
+typedef std::function<void(const double & s, double * x, double * u, double * k)> LapShape;
+
+/**
+ * @brief A synthetic lap of 3 states, 2 controls and a curvature per sample.
+ *
+ * @param L length of the track.
+ * @param N number of samples, evenly spaced along the track.
+ * @param shape fills every sample from its abscissa. The values it leaves are zero.
+ * @param dt time step between the samples.
+ * @return std::tuple<casadi::DM, casadi::DM, casadi::DM, casadi::DM> x, u, k and t.
+ */
+std::tuple<casadi::DM, casadi::DM, casadi::DM, casadi::DM> make_lap(
+  const double & L, const size_t & N, const LapShape & shape, const double & dt = 0.01)
+{
+  const auto n = static_cast<casadi_int>(N);
+  auto x = casadi::DM::zeros(3, n);
+  auto u = casadi::DM::zeros(2, n);
+  auto k = casadi::DM::zeros(1, n);
+  auto t = casadi::DM::zeros(1, n);
+  for (size_t i = 0; i < N; i++) {
+    const double s = L * static_cast<double>(i) / N;
+    shape(s, x.ptr() + 3 * i, u.ptr() + 2 * i, k.ptr() + i);
+    t.ptr()[i] = dt * static_cast<double>(i);
+  }
+  return std::make_tuple(x, u, k, t);
+}
+
+// a lap for the regression of the speed, offset from the other laps
+LapShape regression_lap_shape(const double & offset)
+{
+  const LapShape shape = [offset](const double & s, double * x, double * u, double * k) {
+      x[0] = 20.0 + offset + 5.0 * std::sin(s / 3.0);
+      x[1] = s;
+      u[0] = std::cos(s / 5.0);
+      u[1] = 0.1 * std::sin(s);
+      k[0] = 0.01 * std::cos(s / 7.0);
+    };
+  return shape;
+}
+}  // namespace
 
 TEST(RacingTrajectoryTest, TestGlobalToFrenetUninitialized) {
   const auto share_dir = ament_index_cpp::get_package_share_directory("racing_trajectory");
@@ -69,3 +136,1538 @@ TEST(RacingTrajectoryTest, TestGlobalToFrenetInitialized) {
     test_global_pose_moved.position.y += 0.5;
   }
 }
+
+TEST(RacingTrajectoryTest, BenchmarkGlobalToFrenetProjection) {
+  // compare the native projection against the sqpmethod solve on every test track
+  const auto share_dir = ament_index_cpp::get_package_share_directory("racing_trajectory");
+  for (const auto & entry :
+    std::filesystem::recursive_directory_iterator(share_dir + "/test_data"))
+  {
+    if (entry.path().extension() != ".txt") {
+      continue;
+    }
+    auto traj = lmpc::vehicle_model::racing_trajectory::RacingTrajectory(entry.path().string());
+    const auto & L = traj.total_length();
+
+    // sample global poses at half of the track width around the centerline
+    const size_t N = 200;
+    std::vector<lmpc::FrenetPose2D> frenet_poses(N);
+    std::vector<lmpc::Pose2D> global_poses(N);
+    for (size_t i = 0; i < N; i++) {
+      auto & fp = frenet_poses[i];
+      fp.position.s = L * (static_cast<double>(i) + 0.5) / N;
+      const auto & bound = i % 2 ? traj.left_boundary_interpolation_function() :
+        traj.right_boundary_interpolation_function();
+      fp.position.t = 0.5 * static_cast<double>(bound(casadi::DM(fp.position.s))[0]);
+      fp.yaw = 0.1;
+      traj.frenet_to_global(fp, global_poses[i]);
+    }
+
+    auto & g2f = traj.global_to_frenet_function();
+    std::vector<lmpc::FrenetPose2D> nlp_poses(N);
+    auto start_time = std::chrono::high_resolution_clock::now();
+    for (size_t i = 0; i < N; i++) {
+      const auto out = g2f(
+        casadi::DM{
+              global_poses[i].position.x, global_poses[i].position.y, global_poses[i].yaw,
+              frenet_poses[i].position.s, frenet_poses[i].position.t
+            })[0].get_elements();
+      nlp_poses[i] = lmpc::FrenetPose2D{{out[0], out[1]}, out[2]};
+    }
+    auto end_time = std::chrono::high_resolution_clock::now();
+    const auto nlp_us =
+      std::chrono::duration_cast<std::chrono::microseconds>(end_time - start_time).count();
+
+    std::vector<lmpc::FrenetPose2D> native_poses(N);
+    start_time = std::chrono::high_resolution_clock::now();
+    for (size_t i = 0; i < N; i++) {
+      traj.global_to_frenet(global_poses[i], native_poses[i]);
+    }
+    end_time = std::chrono::high_resolution_clock::now();
+    const auto native_us =
+      std::chrono::duration_cast<std::chrono::microseconds>(end_time - start_time).count();
+
+    std::cout << "[Benchmark Global to Frenet] " << entry.path().filename().string() << std::endl;
+    std::cout << "sqpmethod: " << static_cast<double>(nlp_us) / N << " us/pose, native: " <<
+      static_cast<double>(native_us) / N << " us/pose." << std::endl;
+
+    for (size_t i = 0; i < N; i++) {
+      const auto ds = std::fabs(native_poses[i].position.s - nlp_poses[i].position.s);
+      EXPECT_NEAR(std::min(ds, L - ds), 0.0, 1e-3);
+      EXPECT_NEAR(native_poses[i].position.t, nlp_poses[i].position.t, 1e-3);
+      EXPECT_NEAR(native_poses[i].yaw, nlp_poses[i].yaw, 1e-3);
+    }
+  }
+}
+
+TEST(RacingTrajectoryTest, BenchmarkTrajectorySampler) {
+  const auto share_dir = ament_index_cpp::get_package_share_directory("racing_trajectory");
+  for (const auto & file : {"/test_data/mgkt_optm.txt", "/test_data/putnam_optm.txt"}) {
+    auto traj = lmpc::vehicle_model::racing_trajectory::RacingTrajectory(share_dir + file);
+
+    const size_t N = 1000;
+    std::vector<double> abscissa(N);
+    for (size_t i = 0; i < N; i++) {
+      abscissa[i] = traj.total_length() * (static_cast<double>(i) + 0.5) / N;
+    }
+    // a row vector evaluates the scalar functions N times
+    const auto abscissa_dm = casadi::DM(abscissa).T();
+
+    auto start_time = std::chrono::high_resolution_clock::now();
+    const auto x = traj.x_interpolation_function()(abscissa_dm)[0].get_elements();
+    const auto y = traj.y_interpolation_function()(abscissa_dm)[0].get_elements();
+    const auto yaw = traj.yaw_interpolation_function()(abscissa_dm)[0].get_elements();
+    const auto left = traj.left_boundary_interpolation_function()(abscissa_dm)[0].get_elements();
+    const auto right =
+      traj.right_boundary_interpolation_function()(abscissa_dm)[0].get_elements();
+    const auto vel = traj.velocity_interpolation_function()(abscissa_dm)[0].get_elements();
+    auto end_time = std::chrono::high_resolution_clock::now();
+    const auto casadi_us =
+      std::chrono::duration_cast<std::chrono::microseconds>(end_time - start_time).count();
+
+    lmpc::vehicle_model::racing_trajectory::TrajectorySamples samples;
+    start_time = std::chrono::high_resolution_clock::now();
+    traj.sampler().sample(abscissa.data(), N, samples);
+    end_time = std::chrono::high_resolution_clock::now();
+    const auto native_us =
+      std::chrono::duration_cast<std::chrono::microseconds>(end_time - start_time).count();
+
+    std::cout << "[Benchmark Trajectory Sampler] " << file << std::endl;
+    std::cout << "casadi: " << casadi_us << " us, native: " << native_us << " us for " << N <<
+      " abscissas." << std::endl;
+
+    for (size_t i = 0; i < N; i++) {
+      EXPECT_NEAR(samples.x[i], x[i], 1e-6);
+      EXPECT_NEAR(samples.y[i], y[i], 1e-6);
+      EXPECT_NEAR(samples.yaw[i], yaw[i], 1e-6);
+      EXPECT_NEAR(samples.left[i], left[i], 1e-6);
+      EXPECT_NEAR(samples.right[i], right[i], 1e-6);
+      EXPECT_NEAR(samples.velocity[i], vel[i], 1e-6);
+
+      lmpc::vehicle_model::racing_trajectory::TrajectorySample sample;
+      traj.sampler().sample(abscissa[i], sample);
+      EXPECT_DOUBLE_EQ(sample.x, samples.x[i]);
+      EXPECT_DOUBLE_EQ(sample.curvature, samples.curvature[i]);
+    }
+  }
+}
+
+TEST(RacingTrajectoryTest, BenchmarkBatchFrenetConversion) {
+  const auto share_dir = ament_index_cpp::get_package_share_directory("racing_trajectory");
+  for (const auto & file : {"/test_data/mgkt_optm.txt", "/test_data/putnam_optm.txt"}) {
+    auto traj = lmpc::vehicle_model::racing_trajectory::RacingTrajectory(share_dir + file);
+    const auto & L = traj.total_length();
+
+    // poses ordered along the track, weaving between the boundaries
+    const size_t N = 20000;
+    lmpc::FrenetPoses2D frenet_poses;
+    frenet_poses.resize(N);
+    for (size_t i = 0; i < N; i++) {
+      frenet_poses.s[i] = L * (static_cast<double>(i) + 0.5) / N;
+      lmpc::vehicle_model::racing_trajectory::TrajectorySample sample;
+      traj.sampler().sample(frenet_poses.s[i], sample);
+      const double w = std::sin(0.01 * static_cast<double>(i));
+      frenet_poses.t[i] = 0.5 * (w > 0.0 ? sample.left * w : -sample.right * w);
+      frenet_poses.yaw[i] = 0.1 * w;
+    }
+
+    lmpc::Poses2D global_poses;
+    auto start_time = std::chrono::high_resolution_clock::now();
+    traj.frenet_to_global(frenet_poses, global_poses);
+    auto end_time = std::chrono::high_resolution_clock::now();
+    const auto f2g_us =
+      std::chrono::duration_cast<std::chrono::microseconds>(end_time - start_time).count();
+
+    lmpc::FrenetPoses2D ordered_poses;
+    start_time = std::chrono::high_resolution_clock::now();
+    traj.global_to_frenet(global_poses, ordered_poses, true);
+    end_time = std::chrono::high_resolution_clock::now();
+    const auto ordered_us =
+      std::chrono::duration_cast<std::chrono::microseconds>(end_time - start_time).count();
+
+    lmpc::FrenetPoses2D unordered_poses;
+    start_time = std::chrono::high_resolution_clock::now();
+    traj.global_to_frenet(global_poses, unordered_poses);
+    end_time = std::chrono::high_resolution_clock::now();
+    const auto unordered_us =
+      std::chrono::duration_cast<std::chrono::microseconds>(end_time - start_time).count();
+
+    std::vector<lmpc::FrenetPose2D> single_poses(N);
+    start_time = std::chrono::high_resolution_clock::now();
+    for (size_t i = 0; i < N; i++) {
+      const lmpc::Pose2D pose{{global_poses.x[i], global_poses.y[i]}, global_poses.yaw[i]};
+      traj.global_to_frenet(pose, single_poses[i]);
+    }
+    end_time = std::chrono::high_resolution_clock::now();
+    const auto single_us =
+      std::chrono::duration_cast<std::chrono::microseconds>(end_time - start_time).count();
+
+    std::cout << "[Benchmark Batch Frenet Conversion] " << file << " with " <<
+      std::thread::hardware_concurrency() << " threads" << std::endl;
+    std::cout << "frenet to global: " << static_cast<double>(f2g_us) / N << " us/pose, " <<
+      "global to frenet ordered: " << static_cast<double>(ordered_us) / N << " us/pose, " <<
+      "unordered: " << static_cast<double>(unordered_us) / N << " us/pose, " <<
+      "single: " << static_cast<double>(single_us) / N << " us/pose." << std::endl;
+
+    for (size_t i = 0; i < N; i++) {
+      // batch conversion matches the single pose conversion
+      lmpc::Pose2D global_pose;
+      traj.frenet_to_global(
+        lmpc::FrenetPose2D{{frenet_poses.s[i], frenet_poses.t[i]}, frenet_poses.yaw[i]},
+        global_pose);
+      EXPECT_DOUBLE_EQ(global_poses.x[i], global_pose.position.x);
+      EXPECT_DOUBLE_EQ(global_poses.y[i], global_pose.position.y);
+      EXPECT_DOUBLE_EQ(global_poses.yaw[i], global_pose.yaw);
+      EXPECT_DOUBLE_EQ(unordered_poses.s[i], single_poses[i].position.s);
+      EXPECT_DOUBLE_EQ(unordered_poses.t[i], single_poses[i].position.t);
+
+      // and recovers the frenet poses
+      for (const auto * poses : {&ordered_poses, &unordered_poses}) {
+        const auto ds = std::fabs(poses->s[i] - frenet_poses.s[i]);
+        EXPECT_NEAR(std::min(ds, L - ds), 0.0, 1e-6);
+        EXPECT_NEAR(poses->t[i], frenet_poses.t[i], 1e-6);
+        EXPECT_NEAR(poses->yaw[i], frenet_poses.yaw[i], 1e-6);
+      }
+    }
+  }
+}
+
+TEST(RacingTrajectoryTest, BenchmarkCodegenCache) {
+  using lmpc::vehicle_model::racing_trajectory::RacingTrajectory;
+  const auto share_dir = ament_index_cpp::get_package_share_directory("racing_trajectory");
+  const auto traj_file = share_dir + "/test_data/mgkt_optm.txt";
+  const auto cache_dir =
+    (std::filesystem::temp_directory_path() / "racing_trajectory_codegen_test").string();
+  std::filesystem::remove_all(cache_dir);
+
+  auto start_time = std::chrono::high_resolution_clock::now();
+  auto traj = RacingTrajectory(traj_file);
+  traj.warm_up();
+  auto end_time = std::chrono::high_resolution_clock::now();
+  const auto build_us =
+    std::chrono::duration_cast<std::chrono::microseconds>(end_time - start_time).count();
+
+  start_time = std::chrono::high_resolution_clock::now();
+  auto compiled = RacingTrajectory(traj_file, cache_dir);
+  compiled.warm_up();
+  end_time = std::chrono::high_resolution_clock::now();
+  const auto compile_us =
+    std::chrono::duration_cast<std::chrono::microseconds>(end_time - start_time).count();
+
+  start_time = std::chrono::high_resolution_clock::now();
+  auto cached = RacingTrajectory(traj_file, cache_dir);
+  cached.warm_up();
+  end_time = std::chrono::high_resolution_clock::now();
+  const auto load_us =
+    std::chrono::duration_cast<std::chrono::microseconds>(end_time - start_time).count();
+
+  std::cout << "[Benchmark Codegen Cache] build: " << build_us << " us, build and compile: " <<
+    compile_us << " us, load from cache: " << load_us << " us." << std::endl;
+
+  const size_t N = 1000;
+  std::vector<casadi::DM> inputs(N);
+  for (size_t i = 0; i < N; i++) {
+    const double s = traj.total_length() * (static_cast<double>(i) + 0.5) / N;
+    inputs[i] = casadi::DM{s, 0.5, 0.1};
+  }
+  std::vector<casadi::DM> vm_outputs(N), cached_outputs(N);
+  start_time = std::chrono::high_resolution_clock::now();
+  for (size_t i = 0; i < N; i++) {
+    vm_outputs[i] = traj.frenet_to_global_function()(inputs[i])[0];
+  }
+  end_time = std::chrono::high_resolution_clock::now();
+  const auto vm_us =
+    std::chrono::duration_cast<std::chrono::microseconds>(end_time - start_time).count();
+
+  start_time = std::chrono::high_resolution_clock::now();
+  for (size_t i = 0; i < N; i++) {
+    cached_outputs[i] = cached.frenet_to_global_function()(inputs[i])[0];
+  }
+  end_time = std::chrono::high_resolution_clock::now();
+  const auto cached_us =
+    std::chrono::duration_cast<std::chrono::microseconds>(end_time - start_time).count();
+
+  std::cout << "frenet to global virtual machine: " << static_cast<double>(vm_us) / N <<
+    " us/call, compiled: " << static_cast<double>(cached_us) / N << " us/call." << std::endl;
+
+  for (size_t i = 0; i < N; i++) {
+    const auto vm = vm_outputs[i].get_elements();
+    const auto out = cached_outputs[i].get_elements();
+    for (size_t j = 0; j < 3; j++) {
+      EXPECT_NEAR(out[j], vm[j], 1e-9);
+    }
+  }
+
+  // every compiled function matches the virtual machine
+  const auto s = casadi::DM{10.0, 100.0, 1000.0}.T();
+  for (const auto & f : {
+      &RacingTrajectory::x_interpolation_function,
+      &RacingTrajectory::y_interpolation_function,
+      &RacingTrajectory::yaw_interpolation_function,
+      &RacingTrajectory::curvature_interpolation_function,
+      &RacingTrajectory::left_boundary_interpolation_function,
+      &RacingTrajectory::right_boundary_interpolation_function,
+      &RacingTrajectory::velocity_interpolation_function})
+  {
+    const auto vm = (traj.*f)()(s)[0].get_elements();
+    const auto out = (cached.*f)()(s)[0].get_elements();
+    for (size_t j = 0; j < vm.size(); j++) {
+      EXPECT_NEAR(out[j], vm[j], 1e-9);
+    }
+  }
+  const auto g2f_in = casadi::DM{
+    vm_outputs[0](0), vm_outputs[0](1), vm_outputs[0](2), inputs[0](0), inputs[0](1)};
+  const auto vm = traj.global_to_frenet_function()(g2f_in)[0].get_elements();
+  const auto out = cached.global_to_frenet_function()(g2f_in)[0].get_elements();
+  for (size_t j = 0; j < 3; j++) {
+    EXPECT_NEAR(out[j], vm[j], 1e-6);
+  }
+  EXPECT_NO_THROW(cached.frenet_to_global_function().jacobian());
+
+  std::filesystem::remove_all(cache_dir);
+}
+
+TEST(RacingTrajectoryTest, BenchmarkFrenetTracker) {
+  const auto share_dir = ament_index_cpp::get_package_share_directory("racing_trajectory");
+  for (const auto & file : {"/test_data/mgkt_optm.txt", "/test_data/putnam_optm.txt"}) {
+    auto traj =
+      std::make_shared<lmpc::vehicle_model::racing_trajectory::RacingTrajectory>(share_dir + file);
+    const auto & L = traj->total_length();
+    lmpc::vehicle_model::racing_trajectory::FrenetTracker tracker(traj);
+
+    // drive two laps at 60 m/s and 100 Hz, weaving around the centerline
+    const double speed = 60.0;
+    const double dt = 0.01;
+    const size_t N = static_cast<size_t>(1.9 * L / (speed * dt));
+    size_t num_incremental = 0;
+    int64_t tracker_ns = 0;
+    for (size_t i = 0; i < N; i++) {
+      const double s = std::fmod(speed * dt * static_cast<double>(i), L);
+      const lmpc::FrenetPose2D expected{{s, std::sin(0.05 * static_cast<double>(i))}, 0.1};
+      lmpc::Pose2D global_pose;
+      traj->frenet_to_global(expected, global_pose);
+
+      lmpc::FrenetPose2D frenet_pose;
+      const auto start_time = std::chrono::high_resolution_clock::now();
+      num_incremental += tracker.update(global_pose, frenet_pose);
+      const auto end_time = std::chrono::high_resolution_clock::now();
+      tracker_ns +=
+        std::chrono::duration_cast<std::chrono::nanoseconds>(end_time - start_time).count();
+
+      const auto ds = std::fabs(frenet_pose.position.s - expected.position.s);
+      EXPECT_NEAR(std::min(ds, L - ds), 0.0, 1e-6);
+      EXPECT_NEAR(frenet_pose.position.t, expected.position.t, 1e-6);
+      EXPECT_NEAR(frenet_pose.yaw, expected.yaw, 1e-6);
+    }
+    std::cout << "[Benchmark Frenet Tracker] " << file << std::endl;
+    std::cout << "tracker: " << static_cast<double>(tracker_ns) / 1000.0 / N << " us/update." <<
+      std::endl;
+
+    // only the first update is re-localized
+    EXPECT_EQ(num_incremental, N - 1);
+    EXPECT_EQ(tracker.laps(), 1);
+
+    // a teleport is detected and re-localized
+    lmpc::Pose2D global_pose;
+    traj->frenet_to_global(lmpc::FrenetPose2D{{L / 2.0, 0.0}, 0.0}, global_pose);
+    lmpc::FrenetPose2D frenet_pose;
+    EXPECT_FALSE(tracker.update(global_pose, frenet_pose));
+    EXPECT_NEAR(frenet_pose.position.s, L / 2.0, 1e-6);
+    EXPECT_TRUE(tracker.update(global_pose, frenet_pose));
+
+    // switching the trajectory re-localizes
+    tracker.set_trajectory(traj);
+    EXPECT_FALSE(tracker.initialized());
+    EXPECT_FALSE(tracker.update(global_pose, frenet_pose));
+  }
+}
+
+TEST(RacingTrajectoryTest, TestLazyInitialization) {
+  const auto share_dir = ament_index_cpp::get_package_share_directory("racing_trajectory");
+  const auto traj_file = share_dir + "/test_data/mgkt_optm.txt";
+
+  auto start_time = std::chrono::high_resolution_clock::now();
+  auto traj = lmpc::vehicle_model::racing_trajectory::RacingTrajectory(traj_file);
+  auto end_time = std::chrono::high_resolution_clock::now();
+  const auto construct_us =
+    std::chrono::duration_cast<std::chrono::microseconds>(end_time - start_time).count();
+
+  // the native conversions do not need the casadi functions
+  lmpc::Pose2D global_pose;
+  traj.frenet_to_global(lmpc::FrenetPose2D{{100.0, 0.5}, 0.1}, global_pose);
+  lmpc::FrenetPose2D frenet_pose;
+  traj.global_to_frenet(global_pose, frenet_pose);
+  EXPECT_NEAR(frenet_pose.position.s, 100.0, 1e-6);
+
+  // concurrent first uses build the functions once
+  std::vector<std::thread> threads;
+  std::vector<double> yaws(4);
+  start_time = std::chrono::high_resolution_clock::now();
+  for (size_t i = 0; i < yaws.size(); i++) {
+    threads.emplace_back(
+      [&traj, &yaws, i]() {
+        if (i % 2) {
+          yaws[i] = static_cast<double>(traj.yaw_interpolation_function()(casadi::DM(100.0))[0]);
+        } else {
+          const auto out = traj.frenet_to_global_function()(casadi::DM{100.0, 0.0, 0.0})[0];
+          yaws[i] = static_cast<double>(out(2));
+        }
+      });
+  }
+  for (auto & thread : threads) {
+    thread.join();
+  }
+  traj.warm_up();
+  end_time = std::chrono::high_resolution_clock::now();
+  const auto warm_up_us =
+    std::chrono::duration_cast<std::chrono::microseconds>(end_time - start_time).count();
+
+  std::cout << "[Lazy Initialization] construct: " << construct_us << " us, warm up: " <<
+    warm_up_us << " us." << std::endl;
+
+  for (const auto & yaw : yaws) {
+    EXPECT_NEAR(yaw, yaws[0], 1e-9);
+  }
+}
+
+TEST(RacingTrajectoryTest, BenchmarkRacingTrajectoryMapLoading) {
+  const auto share_dir = ament_index_cpp::get_package_share_directory("racing_trajectory");
+  const auto map_dir = share_dir + "/test_data/putnam";
+
+  auto start_time = std::chrono::high_resolution_clock::now();
+  lmpc::vehicle_model::racing_trajectory::RacingTrajectoryMap eager_map(map_dir);
+  auto end_time = std::chrono::high_resolution_clock::now();
+  const auto eager_us =
+    std::chrono::duration_cast<std::chrono::microseconds>(end_time - start_time).count();
+  for (const auto & index : eager_map.trajectory_indices()) {
+    EXPECT_TRUE(eager_map.is_loaded(index));
+  }
+
+  start_time = std::chrono::high_resolution_clock::now();
+  lmpc::vehicle_model::racing_trajectory::RacingTrajectoryMap lazy_map(map_dir, "", true);
+  end_time = std::chrono::high_resolution_clock::now();
+  const auto lazy_us =
+    std::chrono::duration_cast<std::chrono::microseconds>(end_time - start_time).count();
+  EXPECT_FALSE(lazy_map.is_loaded(5));
+  EXPECT_FALSE(lazy_map.is_loaded(27));
+
+  // requesting the race line prefetches the pit lane
+  lazy_map.set_prefetch_hints(5, {27});
+  start_time = std::chrono::high_resolution_clock::now();
+  const auto race_line = lazy_map.get_trajectory(5);
+  end_time = std::chrono::high_resolution_clock::now();
+  const auto get_us =
+    std::chrono::duration_cast<std::chrono::microseconds>(end_time - start_time).count();
+  ASSERT_NE(race_line, nullptr);
+  EXPECT_DOUBLE_EQ(race_line->total_length(), eager_map.get_trajectory(5)->total_length());
+  for (size_t i = 0; i < 1000 && !lazy_map.is_loaded(27); i++) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+  EXPECT_TRUE(lazy_map.is_loaded(27));
+  EXPECT_FALSE(lazy_map.is_loaded(3));
+  EXPECT_EQ(lazy_map.get_trajectory(42), nullptr);
+
+  std::cout << "[Benchmark Trajectory Map] parallel: " << eager_us << " us, lazy: " << lazy_us <<
+    " us, first get: " << get_us << " us." << std::endl;
+}
+
+TEST(RacingTrajectoryTest, TestActiveTrajectorySwitch) {
+  const auto share_dir = ament_index_cpp::get_package_share_directory("racing_trajectory");
+  lmpc::vehicle_model::racing_trajectory::RacingTrajectoryMap map(
+    share_dir + "/test_data/putnam", "", true);
+  EXPECT_EQ(map.get_active_trajectory(), nullptr);
+  EXPECT_EQ(map.get_active_trajectory_index(), -1);
+  EXPECT_TRUE(map.set_active_trajectory(5));
+  EXPECT_EQ(map.get_active_trajectory_index(), 5);
+
+  // a 100 Hz reader always sees a complete trajectory while the race line changes
+  // gtest assertions only fail the test on the main thread, so the reader counts failures
+  std::atomic<bool> stop = false;
+  int64_t worst_ns = 0;
+  size_t num_reads = 0;
+  size_t num_empty_reads = 0;
+  std::thread reader(
+    [&map, &stop, &worst_ns, &num_reads, &num_empty_reads]() {
+      while (!stop) {
+        const auto start_time = std::chrono::high_resolution_clock::now();
+        const auto traj = map.get_active_trajectory();
+        const auto end_time = std::chrono::high_resolution_clock::now();
+        worst_ns = std::max<int64_t>(
+          worst_ns,
+          std::chrono::duration_cast<std::chrono::nanoseconds>(end_time - start_time).count());
+        num_reads++;
+        if (!traj) {
+          num_empty_reads++;
+          std::this_thread::sleep_for(std::chrono::milliseconds(10));
+          continue;
+        }
+        lmpc::Pose2D global_pose;
+        traj->frenet_to_global(lmpc::FrenetPose2D{{10.0, 0.0}, 0.0}, global_pose);
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+      }
+    });
+
+  lmpc_msgs::msg::TrajectoryCommand command;
+  command.trajectory_index = 27;
+  map.apply_command(command);
+  for (size_t i = 0; i < 1000 && map.get_active_trajectory_index() != 27; i++) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+  EXPECT_EQ(map.get_active_trajectory_index(), 27);
+  EXPECT_EQ(map.get_active_trajectory(), map.get_trajectory(27));
+  EXPECT_FALSE(map.set_active_trajectory_async(42));
+  stop = true;
+  reader.join();
+  EXPECT_GT(num_reads, 0u);
+  EXPECT_EQ(num_empty_reads, 0u);
+
+  std::cout << "[Active Trajectory Switch] worst snapshot: " << worst_ns << " ns." << std::endl;
+}
+
+TEST(RacingTrajectoryTest, TestStaleAsyncSwitch) {
+  const auto share_dir = ament_index_cpp::get_package_share_directory("racing_trajectory");
+  lmpc::vehicle_model::racing_trajectory::RacingTrajectoryMap map(
+    share_dir + "/test_data/putnam", "", true);
+  EXPECT_TRUE(map.set_active_trajectory(5));
+
+  // a queued switch finishing after a later synchronous switch must not overwrite it
+  EXPECT_TRUE(map.set_active_trajectory_async(27));
+  EXPECT_TRUE(map.set_active_trajectory(10));
+  EXPECT_EQ(map.get_active_trajectory_index(), 10);
+
+  // the background thread runs its queue in order, so the switch to 27 is done once 15 loads
+  map.prefetch(15);
+  for (size_t i = 0; i < 1000 && !map.is_loaded(15); i++) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+  ASSERT_TRUE(map.is_loaded(15));
+  EXPECT_TRUE(map.is_loaded(27));
+  EXPECT_EQ(map.get_active_trajectory_index(), 10);
+  EXPECT_EQ(map.get_active_trajectory(), map.get_trajectory(10));
+
+  // the dropped switch can be requested again
+  lmpc_msgs::msg::TrajectoryCommand command;
+  command.trajectory_index = 27;
+  map.apply_command(command);
+  for (size_t i = 0; i < 1000 && map.get_active_trajectory_index() != 27; i++) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+  EXPECT_EQ(map.get_active_trajectory_index(), 27);
+}
+
+TEST(RacingTrajectoryTest, BenchmarkTrajectoryKDTree) {
+  // compare the flat kd tree against a cgal search tree on a multi-lap safe set sized cloud
+  typedef CGAL::Simple_cartesian<double> K;
+  typedef CGAL::Search_traits_2<K> TreeTraits;
+  typedef CGAL::Orthogonal_k_neighbor_search<TreeTraits> Neighbor_search;
+
+  const size_t num_laps = 20;
+  const size_t num_per_lap = 1000;
+  std::vector<double> x, y;
+  for (size_t lap = 0; lap < num_laps; lap++) {
+    for (size_t i = 0; i < num_per_lap; i++) {
+      const double theta = 2.0 * M_PI * i / num_per_lap;
+      const double r = 1.0 + 0.01 * static_cast<double>(lap);
+      x.push_back(300.0 * r * std::cos(theta));
+      y.push_back(200.0 * r * std::sin(theta));
+    }
+  }
+  // laps may revisit the exact same waypoint
+  x.push_back(x[42]);
+  y.push_back(y[42]);
+
+  auto start_time = std::chrono::high_resolution_clock::now();
+  Neighbor_search::Tree cgal_tree;
+  for (size_t i = 0; i < x.size(); i++) {
+    cgal_tree.insert(K::Point_2(x[i], y[i]));
+  }
+  cgal_tree.build();
+  auto end_time = std::chrono::high_resolution_clock::now();
+  const auto cgal_build_us =
+    std::chrono::duration_cast<std::chrono::microseconds>(end_time - start_time).count();
+
+  start_time = std::chrono::high_resolution_clock::now();
+  const lmpc::vehicle_model::racing_trajectory::TrajectoryKDTree tree(x, y);
+  end_time = std::chrono::high_resolution_clock::now();
+  const auto flat_build_us =
+    std::chrono::duration_cast<std::chrono::microseconds>(end_time - start_time).count();
+
+  const size_t N = 10000;
+  const size_t k = 8;
+  std::vector<K::Point_2> queries;
+  for (size_t i = 0; i < N; i++) {
+    const double theta = 2.0 * M_PI * (static_cast<double>(i) + 0.5) / N;
+    const double r = 0.9 + 0.4 * static_cast<double>(i % 7) / 6.0;
+    queries.emplace_back(300.0 * r * std::cos(theta), 200.0 * r * std::sin(theta));
+  }
+
+  std::vector<double> cgal_dists(N * k);
+  start_time = std::chrono::high_resolution_clock::now();
+  for (size_t i = 0; i < N; i++) {
+    Neighbor_search search(cgal_tree, queries[i], k);
+    size_t j = 0;
+    for (const auto & pt : search) {
+      cgal_dists[i * k + j++] = pt.second;
+    }
+  }
+  end_time = std::chrono::high_resolution_clock::now();
+  const auto cgal_us =
+    std::chrono::duration_cast<std::chrono::microseconds>(end_time - start_time).count();
+
+  std::vector<size_t> closest(N);
+  std::vector<size_t> indices;
+  indices.reserve(N * k);
+  start_time = std::chrono::high_resolution_clock::now();
+  for (size_t i = 0; i < N; i++) {
+    closest[i] = tree.find_closest_waypoint_index(queries[i].x(), queries[i].y());
+    tree.find_closest_waypoint_indices(queries[i].x(), queries[i].y(), k, indices);
+  }
+  end_time = std::chrono::high_resolution_clock::now();
+  const auto flat_us =
+    std::chrono::duration_cast<std::chrono::microseconds>(end_time - start_time).count();
+
+  std::cout << "[Benchmark Trajectory KD Tree] " << x.size() << " waypoints" << std::endl;
+  std::cout << "cgal: build " << cgal_build_us << " us, " <<
+    static_cast<double>(cgal_us) / N << " us/query. flat: build " << flat_build_us << " us, " <<
+    static_cast<double>(flat_us) / N << " us/query (nearest + " << k << "-nearest)." << std::endl;
+
+  // results are sorted by distance and agree with cgal up to ties
+  ASSERT_EQ(indices.size(), N * k);
+  const auto squared_distance = [&](const size_t & query, const size_t & index) {
+      const double dx = x[index] - queries[query].x();
+      const double dy = y[index] - queries[query].y();
+      return dx * dx + dy * dy;
+    };
+  for (size_t i = 0; i < N; i++) {
+    EXPECT_DOUBLE_EQ(squared_distance(i, closest[i]), cgal_dists[i * k]);
+    for (size_t j = 0; j < k; j++) {
+      EXPECT_DOUBLE_EQ(squared_distance(i, indices[i * k + j]), cgal_dists[i * k + j]);
+    }
+  }
+
+  // duplicated waypoints keep their own indices
+  indices.clear();
+  tree.find_closest_waypoint_indices(x[42], y[42], 2, indices);
+  ASSERT_EQ(indices.size(), 2u);
+  EXPECT_EQ(std::min(indices[0], indices[1]), 42u);
+  EXPECT_EQ(std::max(indices[0], indices[1]), x.size() - 1);
+}
+
+TEST(RacingTrajectoryTest, BenchmarkWaypointIndex) {
+  // compare the grid against the kd tree on every test track, near and far off the track
+  using lmpc::vehicle_model::racing_trajectory::TrajectoryIndex;
+  using lmpc::vehicle_model::racing_trajectory::WaypointIndexType;
+  const auto share_dir = ament_index_cpp::get_package_share_directory("racing_trajectory");
+  for (const auto & entry :
+    std::filesystem::recursive_directory_iterator(share_dir + "/test_data"))
+  {
+    if (entry.path().extension() != ".txt") {
+      continue;
+    }
+    const auto traj = casadi::DM::from_file(entry.path().string()).T();
+    const auto x = traj(TrajectoryIndex::PX, casadi::Slice()).get_elements();
+    const auto y = traj(TrajectoryIndex::PY, casadi::Slice()).get_elements();
+    const auto left_x = traj(TrajectoryIndex::LEFT_BOUND_X, casadi::Slice()).get_elements();
+    const auto left_y = traj(TrajectoryIndex::LEFT_BOUND_Y, casadi::Slice()).get_elements();
+
+    // queries within the track bounds, and every tenth one far away
+    const size_t N = 10000;
+    std::vector<double> qx(N), qy(N);
+    for (size_t i = 0; i < N; i++) {
+      const size_t j = (i * 7919) % x.size();
+      const double r = i % 10 ? static_cast<double>(i % 7) / 3.0 - 1.0 : 100.0;
+      qx[i] = x[j] + r * (left_x[j] - x[j]);
+      qy[i] = y[j] + r * (left_y[j] - y[j]);
+    }
+
+    std::vector<std::vector<size_t>> closest(2), indices(2);
+    std::vector<int64_t> build_us(2), query_us(2);
+    for (const auto & type : {WaypointIndexType::KD_TREE, WaypointIndexType::GRID}) {
+      const auto t = static_cast<size_t>(type);
+      auto start_time = std::chrono::high_resolution_clock::now();
+      const auto index = lmpc::vehicle_model::racing_trajectory::make_waypoint_index(type, x, y);
+      auto end_time = std::chrono::high_resolution_clock::now();
+      build_us[t] =
+        std::chrono::duration_cast<std::chrono::microseconds>(end_time - start_time).count();
+      closest[t].resize(N);
+      start_time = std::chrono::high_resolution_clock::now();
+      for (size_t i = 0; i < N; i++) {
+        closest[t][i] = index->find_closest_waypoint_index(qx[i], qy[i]);
+        index->find_closest_waypoint_indices(qx[i], qy[i], 5, indices[t]);
+      }
+      end_time = std::chrono::high_resolution_clock::now();
+      query_us[t] =
+        std::chrono::duration_cast<std::chrono::microseconds>(end_time - start_time).count();
+    }
+
+    std::cout << "[Benchmark Waypoint Index] " << entry.path().filename().string() << std::endl;
+    std::cout << "kd tree: build " << build_us[0] << " us, " <<
+      static_cast<double>(query_us[0]) / N << " us/query. grid: build " << build_us[1] <<
+      " us, " << static_cast<double>(query_us[1]) / N << " us/query." << std::endl;
+
+    // equal up to ties
+    const auto squared_distance = [&](const size_t & query, const size_t & index) {
+        const double dx = x[index] - qx[query];
+        const double dy = y[index] - qy[query];
+        return dx * dx + dy * dy;
+      };
+    ASSERT_EQ(indices[0].size(), indices[1].size());
+    for (size_t i = 0; i < N; i++) {
+      EXPECT_DOUBLE_EQ(squared_distance(i, closest[0][i]), squared_distance(i, closest[1][i]));
+    }
+    for (size_t i = 0; i < indices[0].size(); i++) {
+      EXPECT_DOUBLE_EQ(
+        squared_distance(i / 5, indices[0][i]), squared_distance(i / 5, indices[1][i]));
+    }
+  }
+}
+
+TEST(RacingTrajectoryTest, TestWaypointRadiusSearch) {
+  // compare the radius search against a brute force scan, with and without a cap
+  using lmpc::vehicle_model::racing_trajectory::TrajectoryIndex;
+  using lmpc::vehicle_model::racing_trajectory::WaypointIndexType;
+  const auto share_dir = ament_index_cpp::get_package_share_directory("racing_trajectory");
+  const auto traj = casadi::DM::from_file(share_dir + "/test_data/putnam_optm.txt").T();
+  const auto x = traj(TrajectoryIndex::PX, casadi::Slice()).get_elements();
+  const auto y = traj(TrajectoryIndex::PY, casadi::Slice()).get_elements();
+
+  for (const auto & type : {WaypointIndexType::KD_TREE, WaypointIndexType::GRID}) {
+    const auto index = lmpc::vehicle_model::racing_trajectory::make_waypoint_index(type, x, y);
+    for (size_t i = 0; i < x.size(); i += 7) {
+      const double qx = x[i] + 1.5;
+      const double qy = y[i] - 2.0;
+      const double radius = 5.0 + static_cast<double>(i % 20);
+      const size_t max_results = i % 2 ? 10 : std::numeric_limits<size_t>::max();
+
+      std::vector<double> expected;
+      for (size_t j = 0; j < x.size(); j++) {
+        const double dist = std::hypot(x[j] - qx, y[j] - qy);
+        if (dist < radius) {
+          expected.push_back(dist);
+        }
+      }
+      std::sort(expected.begin(), expected.end());
+      expected.resize(std::min(expected.size(), max_results));
+
+      std::vector<size_t> indices;
+      std::vector<double> dists;
+      index->find_waypoints_within_radius(qx, qy, radius, indices, dists, max_results);
+      ASSERT_EQ(indices.size(), expected.size());
+      ASSERT_EQ(dists.size(), expected.size());
+      for (size_t j = 0; j < expected.size(); j++) {
+        EXPECT_DOUBLE_EQ(dists[j], expected[j]);
+        EXPECT_DOUBLE_EQ(std::hypot(x[indices[j]] - qx, y[indices[j]] - qy), dists[j]);
+      }
+    }
+  }
+}
+
+TEST(RacingTrajectoryTest, BenchmarkSafeSetRecorder) {
+  // record 90 s laps at 100 Hz and hand them over to the safe set
+  using lmpc::vehicle_model::racing_trajectory::SafeSetManager;
+  using lmpc::vehicle_model::racing_trajectory::SafeSetRecorder;
+  const double L = 1000.0;
+  const size_t N = 9000;
+  const size_t num_laps = 4;
+  SafeSetManager manager(num_laps);
+  SafeSetRecorder recorder(manager, false, "", N);
+
+  std::vector<int64_t> step_us;
+  step_us.reserve(num_laps * N);
+  for (size_t i = 0; i <= num_laps * N; i++) {
+    const double s = L * static_cast<double>(i % N) / N;
+    const casadi::DM x{s, std::sin(s), 30.0};
+    const casadi::DM u{0.1, 0.2};
+    const casadi::DM k{0.01};
+    const casadi::DM t{0.01 * static_cast<double>(i)};
+    const auto start_time = std::chrono::high_resolution_clock::now();
+    recorder.step(x, u, k, t, L);
+    const auto end_time = std::chrono::high_resolution_clock::now();
+    step_us.push_back(
+      std::chrono::duration_cast<std::chrono::microseconds>(end_time - start_time).count());
+  }
+  // the slowest steps add a lap to the safe set
+  std::sort(step_us.begin(), step_us.end());
+  std::cout << "[Benchmark Safe Set Recorder] median step: " << step_us[step_us.size() / 2] <<
+    " us, 99.9th percentile: " << step_us[step_us.size() * 999 / 1000] << " us." << std::endl;
+
+  // the first lap only initializes the recorder. every later lap is complete.
+  manager.flush();
+  lmpc::vehicle_model::racing_trajectory::SSQuery query;
+  query.x = casadi::DM{L / 2.0, std::sin(L / 2.0), 30.0};
+  query.max_num_total = 100;
+  query.max_num_per_lap = 10;
+  const auto result = manager.query(query);
+  ASSERT_EQ(result.x.size1(), 3);
+  ASSERT_EQ(result.x.size2(), static_cast<casadi_int>((num_laps - 1) * query.max_num_per_lap));
+  for (casadi_int j = 0; j < result.x.size2(); j++) {
+    const auto s = static_cast<double>(result.x(0, j));
+    EXPECT_NEAR(s, L / 2.0, 1.0);
+    EXPECT_DOUBLE_EQ(static_cast<double>(result.x(1, j)), std::sin(s));
+  }
+}
+
+TEST(RacingTrajectoryTest, TestLapFilePersistence) {
+  // save laps in the background and load them back next to a legacy text lap
+  using lmpc::vehicle_model::racing_trajectory::SafeSetManager;
+  using lmpc::vehicle_model::racing_trajectory::SafeSetRecorder;
+  namespace rt = lmpc::vehicle_model::racing_trajectory;
+  const auto dir = std::filesystem::temp_directory_path() / "racing_trajectory_test_laps";
+  std::filesystem::remove_all(dir);
+  std::filesystem::create_directories(dir);
+  const auto prefix = dir.string() + "/";
+  const double L = 100.0;
+  const size_t N = 500;
+
+  {
+    SafeSetManager manager(4);
+    SafeSetRecorder recorder(manager, true, prefix, N);
+    int64_t max_step_us = 0;
+    for (size_t i = 0; i <= 3 * N; i++) {
+      const double s = L * static_cast<double>(i % N) / N;
+      const auto start_time = std::chrono::high_resolution_clock::now();
+      recorder.step(
+        casadi::DM{s, 0.1, 10.0}, casadi::DM{0.1, 0.2}, casadi::DM{0.01},
+        casadi::DM{0.01 * static_cast<double>(i)}, L);
+      const auto end_time = std::chrono::high_resolution_clock::now();
+      max_step_us = std::max<int64_t>(
+        max_step_us,
+        std::chrono::duration_cast<std::chrono::microseconds>(end_time - start_time).count());
+    }
+    std::cout << "[Test Lap File Persistence] slowest step: " << max_step_us << " us." <<
+      std::endl;
+    // the recorder writes the queued laps before it is destroyed
+  }
+  ASSERT_TRUE(std::filesystem::exists(prefix + "lap_1.lap"));
+  ASSERT_TRUE(std::filesystem::exists(prefix + "lap_2.lap"));
+
+  const auto lap = rt::read_lap_file(prefix + "lap_2.lap");
+  EXPECT_EQ(lap.lap_id, 2u);
+  EXPECT_DOUBLE_EQ(lap.total_length, L);
+  EXPECT_EQ(lap.x.size1(), 3);
+  EXPECT_EQ(lap.x.size2(), static_cast<casadi_int>(N));
+  EXPECT_EQ(lap.u.size1(), 2);
+  EXPECT_DOUBLE_EQ(static_cast<double>(lap.t(0, 1) - lap.t(0, 0)), 0.01);
+
+  // legacy text lap
+  lap.x.T().to_file(prefix + "legacy_x.txt", "txt");
+  lap.u.T().to_file(prefix + "legacy_u.txt", "txt");
+  lap.k.T().to_file(prefix + "legacy_k.txt", "txt");
+  lap.t.T().to_file(prefix + "legacy_t.txt", "txt");
+
+  SafeSetManager manager(4);
+  SafeSetRecorder recorder(manager, false, prefix);
+  recorder.load({prefix + "lap_1", prefix + "lap_2.lap", prefix + "legacy"}, L);
+  rt::SSQuery query;
+  query.x = casadi::DM{L / 2.0, 0.1, 10.0};
+  query.max_num_total = 100;
+  query.max_num_per_lap = 4;
+  EXPECT_EQ(manager.query(query).x.size2(), 12);
+
+  // corrupted laps are rejected
+  {
+    std::fstream file(prefix + "lap_1.lap", std::ios::in | std::ios::out | std::ios::binary);
+    file.seekp(sizeof(rt::LapFileHeader) + 8);
+    file.put('x');
+  }
+  EXPECT_THROW(rt::read_lap_file(prefix + "lap_1.lap"), std::runtime_error);
+  std::filesystem::remove_all(dir);
+}
+
+TEST(RacingTrajectoryTest, BenchmarkSafeSetAsyncIngestion) {
+  // add 90 s laps at 100 Hz in the background while querying the safe set
+  using lmpc::vehicle_model::racing_trajectory::SafeSetManager;
+  namespace rt = lmpc::vehicle_model::racing_trajectory;
+  const double L = 1000.0;
+  const size_t N = 9000;
+  const size_t num_laps = 6;
+  SafeSetManager manager(4);
+
+  rt::SSQuery query;
+  query.x = casadi::DM{L / 2.0, std::sin(L / 2.0), 30.0};
+  query.max_num_total = 100;
+  query.max_num_per_lap = 10;
+  std::vector<std::future<void>> futures;
+  int64_t max_add_us = 0;
+  for (size_t lap = 0; lap < num_laps; lap++) {
+    auto [x, u, k, t] = make_lap(
+      L, N, [](const double & s, double * x, double *, double *) {
+        x[0] = s;
+        x[1] = std::sin(s);
+        x[2] = 30.0;
+      });
+    const auto start_time = std::chrono::high_resolution_clock::now();
+    futures.push_back(
+      manager.add_lap_async(std::move(x), std::move(u), std::move(k), std::move(t), L));
+    const auto end_time = std::chrono::high_resolution_clock::now();
+    max_add_us = std::max<int64_t>(
+      max_add_us,
+      std::chrono::duration_cast<std::chrono::microseconds>(end_time - start_time).count());
+    // the laps being added are not visible yet, but the published ones are
+    EXPECT_LE(manager.query(query).x.size2(), static_cast<casadi_int>(4 * 10));
+  }
+  std::cout << "[Benchmark Safe Set Async Ingestion] slowest add: " << max_add_us << " us." <<
+    std::endl;
+
+  // each lap is queryable once its future is ready
+  for (auto & future : futures) {
+    future.get();
+  }
+  EXPECT_EQ(manager.query(query).x.size2(), 4 * 10);
+
+  // an invalid lap reports its error through the future
+  auto future = manager.add_lap_async(casadi::DM(3, 10), casadi::DM(2, 5), casadi::DM(1, 10),
+      casadi::DM(1, 10), L);
+  EXPECT_ANY_THROW(future.get());
+  manager.flush();
+  EXPECT_EQ(manager.query(query).x.size2(), 4 * 10);
+}
+
+TEST(RacingTrajectoryTest, BenchmarkSafeSetSnapshotReads) {
+  // query latency while laps are added and evicted in the background
+  using lmpc::vehicle_model::racing_trajectory::SafeSetManager;
+  namespace rt = lmpc::vehicle_model::racing_trajectory;
+  const double L = 1000.0;
+  const size_t N = 9000;
+  SafeSetManager manager(4);
+  const auto shape = [](const double & s, double * x, double *, double *) {
+      x[0] = s;
+      x[1] = std::sin(s);
+      x[2] = 30.0;
+    };
+  for (size_t lap = 0; lap < 4; lap++) {
+    auto [x, u, k, t] = make_lap(L, N, shape);
+    manager.add_lap(std::move(x), std::move(u), std::move(k), t, L);
+  }
+
+  rt::SSQuery query;
+  query.x = casadi::DM{L / 2.0, std::sin(L / 2.0), 30.0};
+  query.max_num_total = 40;
+  query.max_num_per_lap = 10;
+  const auto percentile_us = [&](const size_t & num_queries, const double & p) {
+      std::vector<int64_t> query_us;
+      query_us.reserve(num_queries);
+      for (size_t i = 0; i < num_queries; i++) {
+        const auto start_time = std::chrono::high_resolution_clock::now();
+        const auto result = manager.query(query);
+        const auto end_time = std::chrono::high_resolution_clock::now();
+        EXPECT_EQ(result.x.size2(), 40);
+        query_us.push_back(
+          std::chrono::duration_cast<std::chrono::microseconds>(end_time - start_time).count());
+      }
+      std::sort(query_us.begin(), query_us.end());
+      return query_us[static_cast<size_t>(p * static_cast<double>(num_queries - 1))];
+    };
+  const auto idle_us = percentile_us(2000, 0.99);
+
+  // every new lap evicts the oldest one
+  std::vector<std::future<void>> futures;
+  for (size_t lap = 0; lap < 8; lap++) {
+    auto [x, u, k, t] = make_lap(L, N, shape);
+    futures.push_back(
+      manager.add_lap_async(std::move(x), std::move(u), std::move(k), std::move(t), L));
+  }
+  const auto busy_us = percentile_us(2000, 0.99);
+  for (auto & future : futures) {
+    future.get();
+  }
+  std::cout << "[Benchmark Safe Set Snapshot Reads] 99th percentile query: " << idle_us <<
+    " us idle, " << busy_us << " us while adding laps." << std::endl;
+}
+
+TEST(RacingTrajectoryTest, BenchmarkSafeSetIndex) {
+  // compare the multi-lap index against querying every lap on its own
+  using lmpc::vehicle_model::racing_trajectory::SafeSetManager;
+  using lmpc::vehicle_model::racing_trajectory::SSTrajectory;
+  namespace rt = lmpc::vehicle_model::racing_trajectory;
+  const double L = 1000.0;
+  const size_t N = 9000;
+  const size_t max_laps = 20;
+  SafeSetManager manager(max_laps);
+  std::vector<SSTrajectory::UniquePtr> laps;
+  for (size_t lap = 0; lap < max_laps + 4; lap++) {
+    // every lap takes a slightly different line
+    const double offset = 0.1 * static_cast<double>(lap % 5);
+    auto [x, u, k, t] = make_lap(
+      L, N, [&offset](const double & s, double * x, double * u, double *) {
+        x[0] = s;
+        x[1] = std::sin(s / 10.0) + offset;
+        x[2] = 30.0 + offset;
+        u[0] = offset;
+        u[1] = s;
+      });
+    laps.push_back(std::make_unique<SSTrajectory>(x, u, k, t, L));
+    manager.add_lap(std::move(x), std::move(u), std::move(k), t, L);
+  }
+  // the manager evicted the oldest laps
+  laps.erase(laps.begin(), laps.end() - max_laps);
+
+  const size_t num_queries = 1000;
+  int64_t index_us = 0;
+  int64_t per_lap_us = 0;
+  for (size_t q = 0; q < num_queries; q++) {
+    const double s = L * static_cast<double>(q * 7919 % num_queries) / num_queries;
+    rt::SSQuery query;
+    query.x = casadi::DM{s, std::sin(s / 10.0) + 0.05 * static_cast<double>(q % 9), 30.0};
+    query.max_num_total = 16 + static_cast<casadi_int>(q % 100);
+    query.max_num_per_lap = 4 + static_cast<casadi_int>(q % 8);
+    if (q % 2 == 0) {
+      query.dist_max = 0.2;
+    }
+
+    auto start_time = std::chrono::high_resolution_clock::now();
+    const auto result = manager.query(query);
+    auto end_time = std::chrono::high_resolution_clock::now();
+    index_us +=
+      std::chrono::duration_cast<std::chrono::microseconds>(end_time - start_time).count();
+
+    // the points of every lap from the newest, then from the closest
+    start_time = std::chrono::high_resolution_clock::now();
+    casadi::DMVector x, u, J;
+    casadi_int num_total = 0;
+    for (auto it = laps.rbegin(); num_total < query.max_num_total && it != laps.rend(); ++it) {
+      const auto result_lap = (*it)->query(query);
+      x.push_back(result_lap.x);
+      u.push_back(result_lap.u);
+      J.push_back(result_lap.J);
+      num_total += result_lap.x.size2();
+    }
+    const auto expected_x = casadi::DM::horzcat(x);
+    const auto expected_u = casadi::DM::horzcat(u);
+    const auto expected_J = casadi::DM::horzcat(J);
+    end_time = std::chrono::high_resolution_clock::now();
+    per_lap_us +=
+      std::chrono::duration_cast<std::chrono::microseconds>(end_time - start_time).count();
+
+    const auto n = std::min(expected_x.size2(), query.max_num_total);
+    ASSERT_EQ(result.x.size2(), n);
+    ASSERT_EQ(result.u.size2(), n);
+    ASSERT_EQ(result.J.size2(), n);
+    for (casadi_int j = 0; j < n; j++) {
+      for (casadi_int r = 0; r < 3; r++) {
+        EXPECT_EQ(static_cast<double>(result.x(r, j)), static_cast<double>(expected_x(r, j)));
+      }
+      for (casadi_int r = 0; r < 2; r++) {
+        EXPECT_EQ(static_cast<double>(result.u(r, j)), static_cast<double>(expected_u(r, j)));
+      }
+      EXPECT_EQ(static_cast<double>(result.J(0, j)), static_cast<double>(expected_J(0, j)));
+    }
+  }
+  std::cout << "[Benchmark Safe Set Index] " << max_laps << " laps. multi-lap index: " <<
+    static_cast<double>(index_us) / num_queries << " us/query, every lap: " <<
+    static_cast<double>(per_lap_us) / num_queries << " us/query." << std::endl;
+}
+
+TEST(RacingTrajectoryTest, TestSafeSetWeightedMetric) {
+  // nearest neighbors over the track position and the speed
+  using lmpc::vehicle_model::racing_trajectory::SafeSetManager;
+  namespace rt = lmpc::vehicle_model::racing_trajectory;
+  const double L = 100.0;
+  const size_t N = 1000;
+  rt::SSMetric metric;
+  metric.state_idxs = {0, 1, 2};
+  metric.weights = {1.0, 1.0, 0.25};
+  SafeSetManager manager(2, rt::WaypointIndexType::KD_TREE, metric);
+  const auto [x, u, k, t] = make_lap(
+    L, N, [](const double & s, double * x, double *, double *) {
+      x[0] = s;
+      x[1] = 0.5 * std::sin(s);
+      x[2] = 20.0 + 10.0 * std::sin(s / 3.0);
+    });
+  const auto states = x.get_elements();
+  manager.add_lap(x, u, k, t, L);
+
+  for (const bool bounded : {false, true}) {
+    rt::SSQuery query;
+    query.x = casadi::DM{50.0, 0.0, 25.0};
+    query.max_num_total = 8;
+    query.max_num_per_lap = 8;
+    if (bounded) {
+      query.dist_max = 1.5;
+    }
+    const auto result = manager.query(query);
+
+    // brute force over the lap and its copies one lap ahead and behind
+    std::vector<std::pair<double, double>> expected;  // weighted distance and abscissa
+    for (const double offset : {-L, 0.0, L}) {
+      for (size_t i = 0; i < N; i++) {
+        const double ds = states[3 * i] + offset - 50.0;
+        const double dt = states[3 * i + 1];
+        const double dv = states[3 * i + 2] - 25.0;
+        const double d = std::sqrt(ds * ds + dt * dt + 0.25 * dv * dv);
+        if (!bounded || d < 1.5) {
+          expected.emplace_back(d, states[3 * i] + offset);
+        }
+      }
+    }
+    std::sort(expected.begin(), expected.end());
+    expected.resize(std::min<size_t>(expected.size(), 8));
+    ASSERT_EQ(result.x.size2(), static_cast<casadi_int>(expected.size()));
+    for (casadi_int j = 0; j < result.x.size2(); j++) {
+      EXPECT_DOUBLE_EQ(static_cast<double>(result.x(0, j)), expected[j].second);
+    }
+  }
+
+  // the metric must match the states
+  metric.state_idxs = {0, 3};
+  metric.weights = {1.0, 1.0};
+  SafeSetManager bad_manager(2, rt::WaypointIndexType::KD_TREE, metric);
+  EXPECT_THROW(bad_manager.add_lap(x, u, k, t, L), std::invalid_argument);
+  metric.weights = {1.0, 0.0};
+  EXPECT_THROW(SafeSetManager(2, rt::WaypointIndexType::KD_TREE, metric), std::invalid_argument);
+}
+
+TEST(RacingTrajectoryTest, TestRegressionNeighborSearch) {
+  // radius search in the regression inputs, against a brute force scan
+  namespace rt = lmpc::vehicle_model::racing_trajectory;
+  const double L = 100.0;
+  const size_t N = 5000;
+  const auto [x, u, k, t] = make_lap(
+    L, N, [](const double & s, double * x, double * u, double *) {
+      x[0] = s;
+      x[1] = 0.5 * std::sin(s);
+      x[2] = 20.0 + 10.0 * std::sin(s / 3.0);
+      u[0] = std::cos(s / 5.0);
+    });
+  const auto states = x.get_elements();
+  const auto controls = u.get_elements();
+  rt::SSTrajectory lap(x, u, k, t, L);
+
+  rt::RegQuery query;
+  query.x = casadi::DM{50.0, 25.0, 0.5};
+  query.dist_max = 2.0;
+  query.reg_in_state_idxs = {{0, 2}};
+  query.reg_in_control_idxs = {{0}};
+  query.reg_out_state_idxs = {{2}};
+  lap.query(query);  // builds the index
+  const auto start = std::chrono::high_resolution_clock::now();
+  const auto results = lap.query(query);
+  const auto end = std::chrono::high_resolution_clock::now();
+  std::cout << "Regression neighbor search time: " <<
+    std::chrono::duration_cast<std::chrono::microseconds>(end - start).count() << " us" <<
+    std::endl;
+
+  // the last sample has no next state
+  std::vector<std::pair<double, size_t>> expected;
+  for (size_t i = 0; i + 1 < N; i++) {
+    const double ds = states[3 * i] - 50.0;
+    const double dv = states[3 * i + 2] - 25.0;
+    const double du = controls[2 * i] - 0.5;
+    const double d = std::sqrt(ds * ds + dv * dv + du * du);
+    if (d < 2.0) {
+      expected.emplace_back(d, i);
+    }
+  }
+  std::sort(expected.begin(), expected.end());
+  ASSERT_EQ(results.size(), 1u);
+  const auto & result = results[0];
+  ASSERT_FALSE(expected.empty());
+  ASSERT_EQ(result.xs.size2(), static_cast<casadi_int>(expected.size()));
+  ASSERT_EQ(result.dists.numel(), static_cast<casadi_int>(expected.size()));
+  for (casadi_int j = 0; j < result.xs.size2(); j++) {
+    const auto i = expected[j].second;
+    EXPECT_NEAR(static_cast<double>(result.dists(j)), expected[j].first, 1e-9);
+    EXPECT_DOUBLE_EQ(static_cast<double>(result.xs(0, j)), states[3 * i]);
+    EXPECT_DOUBLE_EQ(static_cast<double>(result.xs(1, j)), states[3 * i + 2]);
+    EXPECT_DOUBLE_EQ(static_cast<double>(result.us(0, j)), controls[2 * i]);
+    EXPECT_DOUBLE_EQ(static_cast<double>(result.xip1s(1, j)), states[3 * (i + 1) + 2]);
+  }
+
+  // the query must match the regression inputs
+  query.x = casadi::DM{50.0, 25.0};
+  EXPECT_THROW(lap.query(query), std::invalid_argument);
+
+  // an invalid manager query is not indexed in the laps added later
+  const auto x_sym = casadi::SX::sym("x", 3);
+  const auto u_sym = casadi::SX::sym("u", 2);
+  const auto k_sym = casadi::SX::sym("k", 1);
+  const auto dt_sym = casadi::SX::sym("dt", 1);
+  rt::SafeSetManager manager(3);
+  manager.add_lap(x, u, k, t, L);
+  query.x = casadi::DM{50.0, 25.0, 0.5};
+  query.A = casadi::DM::eye(3);
+  query.B = casadi::DM::zeros(3, 2);
+  query.C = casadi::DM::zeros(3, 1);
+  query.f = casadi::Function(
+    "f", {x_sym, u_sym, k_sym, dt_sym}, {x_sym}, {"x", "u", "k", "dt"}, {"xip1"});
+  auto bad_query = query;
+  bad_query.reg_in_state_idxs = {{0, 7}};
+  EXPECT_THROW(manager.query(bad_query), std::invalid_argument);
+  bad_query = query;
+  bad_query.reg_in_control_idxs = {{0}, {1}};
+  EXPECT_THROW(manager.query(bad_query), std::invalid_argument);
+  EXPECT_NO_THROW(manager.add_lap(x, u, k, t, L));
+  EXPECT_NO_THROW(manager.add_lap_async(x, u, k, t, L).get());
+  EXPECT_NO_THROW(manager.query(query));
+}
+
+TEST(RacingTrajectoryTest, BenchmarkErrorDynamicsRegression) {
+  // the kernel regression against the dense casadi formulation, at growing neighbor counts
+  namespace rt = lmpc::vehicle_model::racing_trajectory;
+  const auto x_sym = casadi::SX::sym("x", 1);
+  const auto u_sym = casadi::SX::sym("u", 2);
+  const auto k_sym = casadi::SX::sym("k", 1);
+  const auto dt_sym = casadi::SX::sym("dt", 1);
+  const auto f = casadi::Function(
+    "f", {x_sym, u_sym, k_sym, dt_sym},
+    {x_sym + dt_sym * (u_sym(0) - 0.1 * x_sym + k_sym)}, {"x", "u", "k", "dt"}, {"xip1"});
+
+  for (const size_t N : {1000, 10000, 50000}) {
+    const double L = 100.0;
+    const auto [x, u, k, t] = make_lap(L, N, regression_lap_shape(0.0));
+    rt::RegQuery query;
+    query.x = casadi::DM{20.0, 0.0, 0.0};
+    query.A = casadi::DM::zeros(3, 3);
+    query.B = casadi::DM::zeros(3, 2);
+    query.C = casadi::DM::zeros(3, 1);
+    query.f = f;
+    query.dist_max = 100.0;  // every point is a neighbor
+    query.reg_in_state_idxs = {{0}};
+    query.reg_in_control_idxs = {{0, 1}};
+    query.reg_out_state_idxs = {{0}};
+
+    rt::SafeSetManager manager(1);
+    manager.add_lap(x, u, k, t, L);
+    manager.query(query);  // warm up
+    auto start = std::chrono::high_resolution_clock::now();
+    const auto result = manager.query(query);
+    auto end = std::chrono::high_resolution_clock::now();
+    const auto eigen_time =
+      std::chrono::duration_cast<std::chrono::microseconds>(end - start).count();
+
+    // the dense formulation, on the same neighbors
+    start = std::chrono::high_resolution_clock::now();
+    const auto neighbors = rt::SSTrajectory(x, u, k, t, L).query(query)[0];
+    const auto xip1s_pred = f.map(neighbors.xs.size2())(
+      casadi::DMDict{{"x", neighbors.xs}, {"u", neighbors.us}, {"k", neighbors.ks},
+        {"dt", neighbors.dts}}).at("xip1");
+    const auto K = 0.75 / query.dist_max *
+      casadi::DM::pow(1 - casadi::DM::pow(neighbors.dists / query.dist_max, 2), 2);
+    const auto reg_x_data = casadi::DM::horzcat({neighbors.xs.T(), neighbors.us.T()});
+    const auto reg_y_data = neighbors.xip1s.T() - xip1s_pred.T();
+    const auto M = casadi::DM::horzcat({reg_x_data, casadi::DM::ones(reg_x_data.size1(), 1)});
+    const auto Q = casadi::DM::mtimes({M.T(), casadi::DM::diag(K), M}) +
+      1e-3 * casadi::DM::eye(M.size2());
+    const auto b = -casadi::DM::mtimes({M.T(), casadi::DM::diag(K), reg_y_data});
+    const auto R = casadi::DM::solve(Q, b);
+    end = std::chrono::high_resolution_clock::now();
+    const auto dense_time =
+      std::chrono::duration_cast<std::chrono::microseconds>(end - start).count();
+    std::cout << "Error dynamics regression with " << neighbors.xs.size2() << " points: " <<
+      eigen_time << " us, dense casadi: " << dense_time << " us" << std::endl;
+
+    ASSERT_EQ(neighbors.xs.size2(), static_cast<casadi_int>(N - 1));
+    EXPECT_NEAR(static_cast<double>(result.A(0, 0)), static_cast<double>(R(0)), 1e-6);
+    EXPECT_NEAR(static_cast<double>(result.B(0, 0)), static_cast<double>(R(1)), 1e-6);
+    EXPECT_NEAR(static_cast<double>(result.B(0, 1)), static_cast<double>(R(2)), 1e-6);
+    EXPECT_NEAR(static_cast<double>(result.C(0)), static_cast<double>(R(3)), 1e-6);
+  }
+}
+
+TEST(RacingTrajectoryTest, BenchmarkHorizonRegression) {
+  // one batched query for the whole horizon against a query per stage
+  namespace rt = lmpc::vehicle_model::racing_trajectory;
+  const auto x_sym = casadi::SX::sym("x", 1);
+  const auto u_sym = casadi::SX::sym("u", 2);
+  const auto k_sym = casadi::SX::sym("k", 1);
+  const auto dt_sym = casadi::SX::sym("dt", 1);
+  const auto f = casadi::Function(
+    "f", {x_sym, u_sym, k_sym, dt_sym},
+    {x_sym + dt_sym * (u_sym(0) - 0.1 * x_sym + k_sym)}, {"x", "u", "k", "dt"}, {"xip1"});
+  const double L = 100.0;
+  const size_t N = 10000;
+  const casadi_int num_stages = 20;
+  rt::SafeSetManager manager(2);
+  for (const double offset : {0.0, 0.5}) {
+    const auto [x, u, k, t] = make_lap(L, N, regression_lap_shape(offset));
+    manager.add_lap(x, u, k, t, L);
+  }
+
+  rt::RegQuery query;
+  query.x = casadi::DM::zeros(3, num_stages);
+  query.A = casadi::DM::zeros(3, 3 * num_stages);
+  query.B = casadi::DM::zeros(3, 2 * num_stages);
+  query.C = casadi::DM::zeros(3, num_stages);
+  for (casadi_int s = 0; s < num_stages; s++) {
+    query.x(casadi::Slice(), s) = casadi::DM{18.0 + 0.3 * s, 0.5, 0.0};
+    query.A(0, 3 * s) = 1.0;
+  }
+  query.f = f;
+  query.dist_max = 1.0;
+  query.reg_in_state_idxs = {{0}};
+  query.reg_in_control_idxs = {{0, 1}};
+  query.reg_out_state_idxs = {{0}};
+  manager.query(query);  // warm up
+  auto start = std::chrono::high_resolution_clock::now();
+  const auto result = manager.query(query);
+  auto end = std::chrono::high_resolution_clock::now();
+  std::cout << "Horizon regression with " << num_stages << " stages: " <<
+    std::chrono::duration_cast<std::chrono::microseconds>(end - start).count() << " us" <<
+    std::endl;
+  ASSERT_EQ(result.A.size2(), 3 * num_stages);
+  ASSERT_EQ(result.C.size2(), num_stages);
+  auto bad_query = query;
+  bad_query.reg_out_state_idxs = {{0, 1}};
+  EXPECT_THROW(manager.query(bad_query), std::invalid_argument);
+
+  start = std::chrono::high_resolution_clock::now();
+  for (casadi_int s = 0; s < num_stages; s++) {
+    auto stage_query = query;
+    stage_query.x = query.x(casadi::Slice(), s);
+    stage_query.A = query.A(casadi::Slice(), casadi::Slice(3 * s, 3 * s + 3));
+    stage_query.B = query.B(casadi::Slice(), casadi::Slice(2 * s, 2 * s + 2));
+    stage_query.C = query.C(casadi::Slice(), s);
+    const auto stage_result = manager.query(stage_query);
+    for (casadi_int j = 0; j < 3; j++) {
+      EXPECT_NEAR(
+        static_cast<double>(result.A(0, 3 * s + j)),
+        static_cast<double>(stage_result.A(0, j)), 1e-9);
+    }
+    for (casadi_int j = 0; j < 2; j++) {
+      EXPECT_NEAR(
+        static_cast<double>(result.B(0, 2 * s + j)),
+        static_cast<double>(stage_result.B(0, j)), 1e-9);
+    }
+    EXPECT_NEAR(static_cast<double>(result.C(0, s)), static_cast<double>(stage_result.C(0)), 1e-9);
+  }
+  end = std::chrono::high_resolution_clock::now();
+  std::cout << "Regression with a query per stage: " <<
+    std::chrono::duration_cast<std::chrono::microseconds>(end - start).count() << " us" <<
+    std::endl;
+
+  // the blocks must match the stages
+  query.C = casadi::DM::zeros(3, num_stages + 1);
+  EXPECT_THROW(manager.query(query), std::invalid_argument);
+}
+
+TEST(RacingTrajectoryTest, BenchmarkBatchEvaluator) {
+  // sample by sample evaluation against a mapped function
+  using lmpc::vehicle_model::racing_trajectory::BatchEvaluator;
+  const auto x_sym = casadi::SX::sym("x", 3);
+  const auto u_sym = casadi::SX::sym("u", 2);
+  const auto k_sym = casadi::SX::sym("k", 1);
+  const auto dt_sym = casadi::SX::sym("dt", 1);
+  const auto f = casadi::Function(
+    "f", {x_sym, u_sym, k_sym, dt_sym},
+    {x_sym + dt_sym * casadi::SX::vertcat(
+        {x_sym(2) * casadi::SX::cos(x_sym(1)), x_sym(2) * k_sym, u_sym(0) - 0.01 * x_sym(2)})},
+    {"x", "u", "k", "dt"}, {"xip1"});
+  const BatchEvaluator evaluator(f);
+
+  for (const casadi_int n : {1000, 10000, 50000}) {
+    const auto x = casadi::DM::rand(3, n);
+    const auto u = casadi::DM::rand(2, n);
+    const auto k = casadi::DM::rand(1, n);
+    const auto dt = 0.01 * casadi::DM::ones(1, n);
+    auto start = std::chrono::high_resolution_clock::now();
+    const auto expected = f.map(n)(casadi::DMDict{{"x", x}, {"u", u}, {"k", k}, {"dt", dt}});
+    auto end = std::chrono::high_resolution_clock::now();
+    const auto map_time = std::chrono::duration_cast<std::chrono::microseconds>(end - start);
+
+    std::vector<double> xip1(3 * n);
+    start = std::chrono::high_resolution_clock::now();
+    evaluator.evaluate(
+      {x.ptr(), u.ptr(), k.ptr(), dt.ptr()}, static_cast<size_t>(n), {xip1.data()});
+    end = std::chrono::high_resolution_clock::now();
+    const auto batch_time = std::chrono::duration_cast<std::chrono::microseconds>(end - start);
+    std::cout << "Nominal model on " << n << " samples: " << batch_time.count() <<
+      " us, mapped: " << map_time.count() << " us" << std::endl;
+
+    const auto expected_xip1 = casadi::DM::densify(expected.at("xip1")).nonzeros();
+    ASSERT_EQ(expected_xip1.size(), xip1.size());
+    for (size_t i = 0; i < xip1.size(); i++) {
+      EXPECT_DOUBLE_EQ(xip1[i], expected_xip1[i]);
+    }
+  }
+
+  // the inputs and outputs must be dense
+  const auto sparse_f = casadi::Function(
+    "sparse_f", {x_sym}, {casadi::SX::diag(x_sym)}, {"x"}, {"xip1"});
+  EXPECT_THROW(BatchEvaluator{sparse_f}, std::invalid_argument);
+}
+
+TEST(RacingTrajectoryTest, TestSafeSetExecutor) {
+  // the serial executor replays the parallel regression exactly
+  namespace rt = lmpc::vehicle_model::racing_trajectory;
+  const auto x_sym = casadi::SX::sym("x", 1);
+  const auto u_sym = casadi::SX::sym("u", 2);
+  const auto k_sym = casadi::SX::sym("k", 1);
+  const auto dt_sym = casadi::SX::sym("dt", 1);
+  const auto f = casadi::Function(
+    "f", {x_sym, u_sym, k_sym, dt_sym},
+    {x_sym + dt_sym * (u_sym(0) - 0.1 * x_sym + k_sym)}, {"x", "u", "k", "dt"}, {"xip1"});
+  const double L = 100.0;
+  const size_t N = 5000;
+  const casadi_int num_stages = 10;
+  const auto [x, u, k, t] = make_lap(L, N, regression_lap_shape(0.0));
+  rt::RegQuery query;
+  query.x = casadi::DM::zeros(3, num_stages);
+  for (casadi_int s = 0; s < num_stages; s++) {
+    query.x(casadi::Slice(), s) = casadi::DM{18.0 + 0.5 * s, 0.5, 0.0};
+  }
+  query.A = casadi::DM::zeros(3, 3 * num_stages);
+  query.B = casadi::DM::zeros(3, 2 * num_stages);
+  query.C = casadi::DM::zeros(3, num_stages);
+  query.f = f;
+  query.dist_max = 1.0;
+  query.reg_in_state_idxs = {{0}};
+  query.reg_in_control_idxs = {{0, 1}};
+  query.reg_out_state_idxs = {{0}};
+
+  std::vector<rt::RegResult> results;
+  for (const auto type : {rt::ExecutorType::SERIAL, rt::ExecutorType::TBB_ARENA}) {
+    rt::ExecutorConfig config;
+    config.type = type;
+    config.num_threads = 2;
+    config.cpus = {0};
+    const auto executor = std::make_shared<rt::Executor>(config);
+    rt::SafeSetManager manager(1, rt::WaypointIndexType::KD_TREE, rt::SSMetric(), executor);
+    manager.add_lap(x, u, k, t, L);
+    for (int i = 0; i < 10; i++) {
+      results.push_back(manager.query(query));
+    }
+    const auto profile = manager.regression_query_profile();
+    std::cout << "Regression query with " << (type == rt::ExecutorType::SERIAL ?
+      "serial" : "arena") << " executor: " << profile.mean.count() << " ms mean, " <<
+      profile.max.count() << " ms max" << std::endl;
+    EXPECT_GT(profile.max.count(), 0.0);
+    EXPECT_EQ(manager.executor().concurrency(), type == rt::ExecutorType::SERIAL ? 1u : 2u);
+  }
+  for (const auto & result : results) {
+    EXPECT_EQ(result.A.get_elements(), results[0].A.get_elements());
+    EXPECT_EQ(result.B.get_elements(), results[0].B.get_elements());
+    EXPECT_EQ(result.C.get_elements(), results[0].C.get_elements());
+  }
+
+  rt::ExecutorConfig config;
+  config.cpus = {-1};
+  EXPECT_THROW(rt::Executor{config}, std::invalid_argument);
+}
+
+TEST(RacingTrajectoryTest, TestSafeSetRetentionPolicy) {
+  // the best and the most recent laps are kept within the memory budget
+  namespace rt = lmpc::vehicle_model::racing_trajectory;
+  const double L = 100.0;
+  const size_t N = 1000;
+  const auto make_timed_lap = [&](const double & id, const double & lap_time) {
+      return make_lap(
+        L, N, [&id](const double & s, double * x, double *, double *) {
+          x[0] = s;
+          x[2] = id;
+        }, lap_time / (N - 1));
+    };
+  const std::vector<double> lap_times{5.0, 3.0, 6.0, 2.0, 7.0, 8.0};
+  const auto kept_laps = [&](rt::SafeSetManager & manager) {
+      rt::SSQuery query;
+      query.x = casadi::DM{50.0, 0.0, 0.0};
+      query.max_num_per_lap = 1;
+      query.max_num_total = 10;
+      const auto result = manager.query(query);
+      std::vector<double> ids;
+      for (casadi_int j = 0; j < result.x.size2(); j++) {
+        ids.push_back(static_cast<double>(result.x(2, j)));
+      }
+      return ids;
+    };
+
+  rt::SSRetentionPolicy policy;
+  policy.num_recent = 2;
+  policy.num_best = 2;
+  policy.downsample_spacing = 1.0;
+  rt::SafeSetManager manager(policy);
+  for (size_t i = 0; i < lap_times.size(); i++) {
+    const auto [x, u, k, t] = make_timed_lap(static_cast<double>(i), lap_times[i]);
+    manager.add_lap(x, u, k, t, L);
+  }
+  // from the newest lap
+  EXPECT_EQ(kept_laps(manager), (std::vector<double>{5.0, 4.0, 3.0, 1.0}));
+
+  // only the newest lap fits in a tiny budget
+  policy.max_bytes = 1;
+  rt::SafeSetManager small_manager(policy);
+  for (size_t i = 0; i < lap_times.size(); i++) {
+    const auto [x, u, k, t] = make_timed_lap(static_cast<double>(i), lap_times[i]);
+    small_manager.add_lap(x, u, k, t, L);
+  }
+  EXPECT_EQ(kept_laps(small_manager), (std::vector<double>{5.0}));
+
+  // a downsampled lap keeps its cost-to-go and its lap time
+  const auto [x, u, k, t] = make_timed_lap(0.0, 5.0);
+  const rt::SSTrajectory lap(x, u, k, t, L);
+  const auto thin_lap = lap.downsample(1.0);
+  EXPECT_TRUE(thin_lap->downsampled());
+  EXPECT_DOUBLE_EQ(thin_lap->lap_time(), lap.lap_time());
+  EXPECT_DOUBLE_EQ(thin_lap->iteration_cost(), lap.iteration_cost());
+  // about one sample per meter
+  EXPECT_GT(thin_lap->data().x.size2(), 90);
+  EXPECT_LT(thin_lap->data().x.size2(), 110);
+  EXPECT_LT(thin_lap->memory_usage(), lap.memory_usage());
+}
+
+TEST(RacingTrajectoryTest, TestLapArchive) {
+  // append laps of two trajectories, and attach the best and the newest of one of them
+  namespace rt = lmpc::vehicle_model::racing_trajectory;
+  const auto file_name =
+    (std::filesystem::temp_directory_path() / "racing_trajectory_test.lmpca").string();
+  std::filesystem::remove(file_name);
+  const double L = 100.0;
+  const size_t N = 1000;
+  const std::vector<double> lap_times{5.0, 3.0, 6.0, 2.0, 7.0, 8.0};
+  for (size_t i = 0; i < lap_times.size(); i++) {
+    rt::LapRecord lap;
+    lap.lap_id = i;
+    lap.total_length = L;
+    const auto id = static_cast<double>(i);
+    std::tie(lap.x, lap.u, lap.k, lap.t) = make_lap(
+      L, N, [&id](const double & s, double * x, double *, double *) {
+        x[0] = s;
+        x[2] = id;
+      }, lap_times[i] / (N - 1));
+    // the odd laps are on another trajectory
+    rt::LapArchive::append(file_name, lap, i % 2, i / 3);
+  }
+
+  const auto start = std::chrono::high_resolution_clock::now();
+  const auto archive = std::make_shared<rt::LapArchive>(file_name);
+  const auto end = std::chrono::high_resolution_clock::now();
+  std::cout << "Opening the lap archive: " <<
+    std::chrono::duration_cast<std::chrono::microseconds>(end - start).count() << " us" <<
+    std::endl;
+  ASSERT_EQ(archive->entries().size(), lap_times.size());
+  EXPECT_DOUBLE_EQ(archive->entries()[3].lap_time, 2.0);
+  EXPECT_EQ(archive->entries()[3].trajectory_id, 1u);
+  EXPECT_EQ(archive->entries()[3].session_id, 1u);
+  const auto lap = archive->load(4);
+  EXPECT_EQ(lap.lap_id, 4u);
+  EXPECT_EQ(lap.x.size2(), static_cast<casadi_int>(N));
+  EXPECT_DOUBLE_EQ(static_cast<double>(lap.x(2, 10)), 4.0);
+
+  // laps 0, 2 and 4 are on trajectory 0. lap 0 is the best and lap 4 the newest.
+  rt::SSRetentionPolicy policy;
+  policy.num_recent = 1;
+  policy.num_best = 1;
+  rt::SafeSetManager manager(policy);
+  manager.attach(archive, 0).get();
+  rt::SSQuery query;
+  query.x = casadi::DM{50.0, 0.0, 0.0};
+  query.max_num_per_lap = 1;
+  query.max_num_total = 10;
+  const auto result = manager.query(query);
+  ASSERT_EQ(result.x.size2(), 2);
+  EXPECT_DOUBLE_EQ(static_cast<double>(result.x(2, 0)), 4.0);
+  EXPECT_DOUBLE_EQ(static_cast<double>(result.x(2, 1)), 0.0);
+
+  EXPECT_THROW(rt::LapArchive(file_name + ".missing"), std::runtime_error);
+
+  // a first append interrupted within the archive header is written over.
+  // the lap is read before the mapped file shrinks.
+  const auto lap_again = archive->load(4);
+  std::filesystem::resize_file(file_name, 5);
+  EXPECT_THROW(rt::LapArchive(file_name), std::runtime_error);
+  rt::LapArchive::append(file_name, lap_again, 0, 2);
+  const rt::LapArchive rewritten(file_name);
+  ASSERT_EQ(rewritten.entries().size(), 1u);
+  EXPECT_EQ(rewritten.entries()[0].lap_id, 4u);
+  EXPECT_EQ(rewritten.entries()[0].session_id, 2u);
+  std::filesystem::remove(file_name);
+}
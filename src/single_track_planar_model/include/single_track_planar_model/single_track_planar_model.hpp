@@ -17,6 +17,8 @@
 #define SINGLE_TRACK_PLANAR_MODEL__SINGLE_TRACK_PLANAR_MODEL_HPP_
 
 #include <memory>
+#include <string>
+#include <vector>
 
 #include <casadi/casadi.hpp>
 
@@ -75,6 +77,31 @@ public:
     base_vehicle_model::BaseVehicleModelConfig::SharedPtr base_config,
     SingleTrackPlanarModelConfig::SharedPtr config);
 
+  /**
+   * @brief Construct a new SingleTrackPlanarModel object with the dynamics and their jacobians
+   * loaded from a library generated by generate_single_track_planar_model.
+   * The dynamics are not built. The library must be generated from the same parameters,
+   * which is checked against the parameters embedded by the generator.
+   *
+   * @param base_config the base vehicle config.
+   * @param config the single track planar model config.
+   * @param compiled_library path to the compiled shared library.
+   */
+  SingleTrackPlanarModel(
+    base_vehicle_model::BaseVehicleModelConfig::SharedPtr base_config,
+    SingleTrackPlanarModelConfig::SharedPtr config,
+    const std::string & compiled_library);
+
+  /**
+   * @brief Generate C code for the dynamics and their jacobians.
+   * Compile the source into a shared library to load it with the constructor above.
+   *
+   * @param name name of the generated source, without extension.
+   * @param directory output directory. Created if it does not exist.
+   * @return std::string path to the generated source.
+   */
+  std::string generate_code(const std::string & name, const std::string & directory);
+
   const SingleTrackPlanarModelConfig & get_config() const;
 
   size_t nx() const override;
@@ -88,6 +115,17 @@ public:
 
 private:
   void compile_dynamics();
+  void compile_base_conversion();
+  void load_compiled_dynamics(const std::string & library);
+  std::vector<casadi::Function *> compiled_functions();
+  // the parameters of the dynamics, embedded in a compiled library
+  std::vector<double> codegen_parameters() const;
+
+  static constexpr casadi_int CODEGEN_VERSION = 1;  // bump when the dynamics change
+  static constexpr const char * CODEGEN_PARAMETERS_FUNCTION =
+    "single_track_planar_model_parameters";
+  // relative tolerance of the parameters printed into the generated code
+  static constexpr double CODEGEN_PARAMETER_TOLERANCE = 1e-12;
 
   SingleTrackPlanarModelConfig::SharedPtr config_ {};
 };
@@ -0,0 +1,64 @@
+// Copyright 2023 Haoru Xue
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#include <exception>
+#include <iostream>
+#include <string>
+
+#include <rclcpp/rclcpp.hpp>
+
+#include "base_vehicle_model/ros_param_loader.hpp"
+#include "single_track_planar_model/ros_param_loader.hpp"
+#include "single_track_planar_model/single_track_planar_model.hpp"
+
+// generates C code for the dynamics of a vehicle at build time.
+// usage: generate_single_track_planar_model <base params> <model params> <name> <output directory>
+int main(int argc, char ** argv)
+{
+  using lmpc::vehicle_model::single_track_planar_model::SingleTrackPlanarModel;
+
+  if (argc != 5) {
+    std::cerr << "Usage: " << argv[0] <<
+      " <base params> <model params> <name> <output directory>" << std::endl;
+    return 1;
+  }
+  const std::string base_params = argv[1];
+  const std::string model_params = argv[2];
+  const std::string name = argv[3];
+  const std::string directory = argv[4];
+
+  rclcpp::init(0, nullptr);
+  int ret = 0;
+  try {
+    rclcpp::NodeOptions options;
+    options.arguments(
+    {
+      "--ros-args",
+      "--params-file", base_params,
+      "--params-file", model_params,
+    });
+    auto node = rclcpp::Node("generate_single_track_planar_model_node", options);
+    auto base_config = lmpc::vehicle_model::base_vehicle_model::load_parameters(&node);
+    auto config = lmpc::vehicle_model::single_track_planar_model::load_parameters(&node);
+    auto model = SingleTrackPlanarModel(base_config, config);
+    const auto source = model.generate_code(name, directory);
+    std::cout << "Generated single track planar model dynamics to " << source << "." << std::endl;
+  } catch (const std::exception & e) {
+    std::cerr << "Failed to generate " << name << ": " << e.what() << std::endl;
+    ret = 1;
+  }
+  rclcpp::shutdown();
+  return ret;
+}
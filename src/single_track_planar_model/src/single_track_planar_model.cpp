@@ -13,7 +13,14 @@
 // You should have received a copy of the GNU Lesser General Public License
 // along with this program.  If not, see <https://www.gnu.org/licenses/>.
 
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
 #include "single_track_planar_model/single_track_planar_model.hpp"
+#include "lmpc_utils/codegen.hpp"
 #include "lmpc_utils/utils.hpp"
 #define GRAVITY 9.8
 
@@ -29,6 +36,36 @@ SingleTrackPlanarModel::SingleTrackPlanarModel(
 : base_vehicle_model::BaseVehicleModel(base_config), config_(config)
 {
   compile_dynamics();
+  compile_base_conversion();
+}
+
+SingleTrackPlanarModel::SingleTrackPlanarModel(
+  base_vehicle_model::BaseVehicleModelConfig::SharedPtr base_config,
+  SingleTrackPlanarModelConfig::SharedPtr config,
+  const std::string & compiled_library)
+: base_vehicle_model::BaseVehicleModel(base_config), config_(config)
+{
+  // the dynamics are not built. the library carries the parameters it was generated from.
+  load_compiled_dynamics(compiled_library);
+  compile_base_conversion();
+}
+
+std::string SingleTrackPlanarModel::generate_code(
+  const std::string & name,
+  const std::string & directory)
+{
+  std::vector<casadi::Function> functions;
+  for (const auto & function : compiled_functions()) {
+    functions.push_back(*function);
+  }
+  // the jacobians keep the dynamics differentiable in an NLP after loading
+  functions.push_back(dynamics_.jacobian());
+  functions.push_back(discrete_dynamics_.jacobian());
+  functions.push_back(
+    casadi::Function(
+      CODEGEN_PARAMETERS_FUNCTION, casadi::SXVector{},
+      casadi::SXVector{casadi::SX(casadi::DM(codegen_parameters()))}, {}, {"parameters"}));
+  return utils::generate_functions(functions, name, directory);
 }
 
 const SingleTrackPlanarModelConfig & SingleTrackPlanarModel::get_config() const
@@ -385,6 +422,11 @@ void SingleTrackPlanarModel::compile_dynamics()
     {"x", "u", "k", "dt"},
     {"A", "B", "g"}
   );
+}
+
+void SingleTrackPlanarModel::compile_base_conversion()
+{
+  using casadi::SX;
 
   // convert to base state and control
   if (config_->simplify_lon_control) {
@@ -416,6 +458,73 @@ void SingleTrackPlanarModel::compile_dynamics()
       "from_base_state", {x_sym, u_base_sym}, {x_sym}, {"x", "u"}, {"x_out"});
   }
 }
+
+void SingleTrackPlanarModel::load_compiled_dynamics(const std::string & library)
+{
+  const auto functions = compiled_functions();
+  std::vector<std::string> names{CODEGEN_PARAMETERS_FUNCTION};
+  for (const auto & function : functions) {
+    names.push_back(function->name());
+  }
+  const auto loaded = utils::load_compiled_functions(names, library);
+
+  // the parameters baked into the library must be the ones of the configs
+  const auto expected = codegen_parameters();
+  const auto parameters = loaded[0](casadi::DMVector{})[0].get_elements();
+  if (parameters.size() != expected.size()) {
+    throw std::runtime_error(library + " was generated by another version of the model.");
+  }
+  for (size_t i = 0; i < expected.size(); i++) {
+    if (!(std::abs(parameters[i] - expected[i]) <=
+      CODEGEN_PARAMETER_TOLERANCE * std::max(1.0, std::abs(expected[i]))))
+    {
+      throw std::runtime_error(
+              library + " does not match the vehicle parameters. Parameter " +
+              std::to_string(i) + " is " + std::to_string(parameters[i]) + " instead of " +
+              std::to_string(expected[i]) + ".");
+    }
+  }
+  for (size_t i = 0; i < functions.size(); i++) {
+    *functions[i] = loaded[i + 1];
+  }
+}
+
+std::vector<double> SingleTrackPlanarModel::codegen_parameters() const
+{
+  // every parameter the dynamics depend on, after the version of the generated functions
+  const auto & base = get_base_config();
+  return {
+    static_cast<double>(CODEGEN_VERSION),
+    static_cast<double>(nx()),
+    static_cast<double>(nu()),
+    static_cast<double>(config_->simplify_lon_control),
+    static_cast<double>(base.modeling_config->use_frenet),
+    static_cast<double>(base.modeling_config->integrator_type),
+    base.powertrain_config->kd,
+    base.front_brake_config->bias,
+    base.chassis_config->total_mass,
+    base.chassis_config->moi,
+    base.chassis_config->wheel_base,
+    base.chassis_config->cg_ratio,
+    base.chassis_config->fr,
+    base.chassis_config->cg_height,
+    base.aero_config->cl_f,
+    base.aero_config->cl_r,
+    base.aero_config->air_density,
+    base.aero_config->frontal_area,
+    base.aero_config->drag_coeff,
+    config_->mu,
+    base.front_tyre_config->pacejka_b,
+    base.front_tyre_config->pacejka_c,
+    base.rear_tyre_config->pacejka_b,
+    base.rear_tyre_config->pacejka_c
+  };
+}
+
+std::vector<casadi::Function *> SingleTrackPlanarModel::compiled_functions()
+{
+  return {&dynamics_, &dynamics_jacobian_, &discrete_dynamics_, &discrete_dynamics_jacobian_};
+}
 }  // namespace single_track_planar_model
 }  // namespace vehicle_model
 }  // namespace lmpc
@@ -15,8 +15,13 @@
 
 #include <gtest/gtest.h>
 
+#include <chrono>
+#include <cmath>
+#include <filesystem>
 #include <iostream>
+#include <vector>
 #include <rclcpp/rclcpp.hpp>
+#include <ament_index_cpp/get_package_prefix.hpp>
 #include <ament_index_cpp/get_package_share_directory.hpp>
 
 #include "base_vehicle_model/ros_param_loader.hpp"
@@ -81,3 +86,99 @@ TEST(SingleTrackPlanarModelTest, TestSingleTrackDynamics) {
   rclcpp::shutdown();
   SUCCEED();
 }
+
+TEST(SingleTrackPlanarModelTest, BenchmarkCompiledDynamics) {
+  using lmpc::vehicle_model::single_track_planar_model::SingleTrackPlanarModel;
+  const auto library = ament_index_cpp::get_package_prefix("single_track_planar_model") +
+    "/lib/libsingle_track_planar_model_sample_vehicle_2.so";
+  if (!std::filesystem::exists(library)) {
+    GTEST_SKIP() << "Compiled dynamics are not built.";
+  }
+
+  rclcpp::init(0, nullptr);
+  const auto base_share_dir = ament_index_cpp::get_package_share_directory("base_vehicle_model");
+  const auto share_dir = ament_index_cpp::get_package_share_directory("single_track_planar_model");
+  rclcpp::NodeOptions options;
+  options.arguments(
+  {
+    "--ros-args",
+    "--params-file", base_share_dir + "/param/sample_vehicle_2.param.yaml",
+    "--params-file", share_dir + "/param/sample_vehicle_2.param.yaml",
+  });
+  auto test_node = rclcpp::Node("test_single_track_planar_model_node", options);
+
+  auto base_config = lmpc::vehicle_model::base_vehicle_model::load_parameters(&test_node);
+  auto config = lmpc::vehicle_model::single_track_planar_model::load_parameters(&test_node);
+  auto start_time = std::chrono::high_resolution_clock::now();
+  auto vm = SingleTrackPlanarModel(base_config, config);
+  auto end_time = std::chrono::high_resolution_clock::now();
+  const auto build_us =
+    std::chrono::duration_cast<std::chrono::microseconds>(end_time - start_time).count();
+  start_time = std::chrono::high_resolution_clock::now();
+  auto compiled = SingleTrackPlanarModel(base_config, config, library);
+  end_time = std::chrono::high_resolution_clock::now();
+  const auto load_us =
+    std::chrono::duration_cast<std::chrono::microseconds>(end_time - start_time).count();
+  std::cout << "[Benchmark Compiled Dynamics] build: " << build_us << " us, load and check: " <<
+    load_us << " us." << std::endl;
+
+  const size_t N = 1000;
+  std::vector<casadi::DMDict> inputs(N);
+  for (size_t i = 0; i < N; i++) {
+    const double r = static_cast<double>(i) / N;
+    inputs[i] = casadi::DMDict{
+      {"x", casadi::DM{10.0 * r, 0.5 - r, 0.2 * r, 5.0 + 20.0 * r, 0.5 * r, 0.2 - 0.4 * r}},
+      {"u", casadi::DM{2.0 * r - 1.0, 0.2 - 0.4 * r}},
+      {"k", 0.02 * r},
+      {"dt", 0.05}
+    };
+  }
+
+  auto benchmark = [&](const casadi::Function & f, std::vector<casadi::DMDict> & outputs) {
+      outputs.resize(N);
+      const auto start = std::chrono::high_resolution_clock::now();
+      for (size_t i = 0; i < N; i++) {
+        casadi::DMDict in;
+        for (const auto & name : f.name_in()) {
+          in[name] = inputs[i].at(name);
+        }
+        outputs[i] = f(in);
+      }
+      const auto end = std::chrono::high_resolution_clock::now();
+      return static_cast<double>(
+        std::chrono::duration_cast<std::chrono::microseconds>(end - start).count()) / N;
+    };
+
+  for (const auto & f : {
+      &SingleTrackPlanarModel::dynamics,
+      &SingleTrackPlanarModel::dynamics_jacobian,
+      &SingleTrackPlanarModel::discrete_dynamics,
+      &SingleTrackPlanarModel::discrete_dynamics_jacobian})
+  {
+    std::vector<casadi::DMDict> vm_outputs, compiled_outputs;
+    const auto vm_us = benchmark((vm.*f)(), vm_outputs);
+    const auto compiled_us = benchmark((compiled.*f)(), compiled_outputs);
+    std::cout << (vm.*f)().name() << " virtual machine: " << vm_us << " us/call, compiled: " <<
+      compiled_us << " us/call." << std::endl;
+
+    for (size_t i = 0; i < N; i++) {
+      for (const auto & output : vm_outputs[i]) {
+        const auto expected = output.second.get_elements();
+        const auto out = compiled_outputs[i].at(output.first).get_elements();
+        ASSERT_EQ(out.size(), expected.size());
+        for (size_t j = 0; j < expected.size(); j++) {
+          EXPECT_NEAR(out[j], expected[j], 1e-9 * (1.0 + std::abs(expected[j])));
+        }
+      }
+    }
+  }
+  EXPECT_NO_THROW(compiled.discrete_dynamics().jacobian());
+
+  // a library generated from other parameters is rejected
+  auto other_config = std::make_shared<
+    lmpc::vehicle_model::single_track_planar_model::SingleTrackPlanarModelConfig>(*config);
+  other_config->mu *= 0.5;
+  EXPECT_THROW(SingleTrackPlanarModel(base_config, other_config, library), std::runtime_error);
+
+  rclcpp::shutdown();
+}